@@ -1,515 +1,2050 @@
-/**
- * \file AntipoleTree.cpp
- */
-
-#include <cmath>
-#include <map>
-#include <stdexcept>
-
-#include <QFuture>
-#include <QtConcurrent/QtConcurrentRun>
-
-#include "AntipoleTree.h"
-
-const int HelperFunctions::tournament_size = 3;
-const long AntipoleTree::minimum_size = 100;
-
-AntipoleNode::AntipoleNode(const AntipoleTree* tree)
-  :tree(tree)
-{
-}
-
-AntipoleNode::~AntipoleNode()
-{
-}
-
-void AntipoleNode::setCenter(const std::vector<float>& center)
-{
-  this->center = center;
-}
-
-void AntipoleNode::setRadius(float radius)
-{
-  this->radius = radius;
-}
-
-float AntipoleNode::minimumDistance(const std::vector<float>& image) const
-{
-  return HelperFunctions::distance2(image, center) - radius;
-}
-
-AntipoleInternalNode::AntipoleInternalNode(const AntipoleTree* tree)
-  :AntipoleNode(tree), left(NULL), right(NULL)
-{
-}
-
-AntipoleInternalNode::~AntipoleInternalNode()
-{
-  delete right;
-  delete left;
-}
-
-void AntipoleInternalNode::setLeft(AntipoleNode* left)
-{
-  this->left = left;
-}
-
-void AntipoleInternalNode::setRight(AntipoleNode* right)
-{
-  this->right = right;
-}
-
-bool AntipoleInternalNode::isLeaf() const
-{
-  return false;
-}
-
-std::pair<long, float> AntipoleInternalNode::getBestSubnode(const AntipoleNode* node, const std::vector<float>& image, const std::pair<long, float>& current_best) const
-{
-  if(node->minimumDistance(image) < current_best.second)
-  {
-    std::pair<long, float> best_node = left->getClosestThumbnail(image, current_best.second);
-    if (best_node.second < current_best.second)
-    {
-      return best_node;
-    }
-  }
-  return current_best;
-}
-
-std::pair<long, float> AntipoleInternalNode::getClosestThumbnail(const std::vector<float>& image, float max_dist) const
-{
-  std::pair<long, float> best = std::make_pair(-1, max_dist);
-
-  if(left)
-  {
-    best = getBestSubnode(left, image, best);
-  }
-  if(right)
-  {
-    best = getBestSubnode(right, image, best);
-  }
-  return best;
-}
-
-std::pair<long, float> AntipoleInternalNode::visitNode(const std::vector<float>& image, float, NodeMap& node_map) const
-{
-  node_map.insert(std::make_pair(HelperFunctions::distance2(image, left->getCenter()) - left->getRadius(), left));
-  node_map.insert(std::make_pair(HelperFunctions::distance2(image, right->getCenter()) - right->getRadius(), right));
-  return std::make_pair(-1, std::numeric_limits<float>::max());
-}
-
-AntipoleLeaf::AntipoleLeaf(const AntipoleTree* tree)
-  :AntipoleNode(tree)
-{
-}
-
-AntipoleLeaf::~AntipoleLeaf()
-{
-}
-
-bool AntipoleLeaf::isLeaf() const
-{
-  return true;
-}
-
-std::pair<long, float> AntipoleLeaf::getClosestThumbnail(const std::vector<float>& image, float) const
-{
-  const std::vector<std::vector<float> >& thumbnails = tree->getThumbnails();
-  if(thumbnails.empty())
-  {
-    throw std::runtime_error("Empty set for clostest thumbnail");
-  }
-  long closest = -1;
-  float mindist = std::numeric_limits<float>::max();
-
-  for(MatchingThumbnails::const_iterator it = matching_thumbnails.begin(); it != matching_thumbnails.end(); ++it)
-  {
-    float dist = HelperFunctions::distance2(image, thumbnails[*it]);
-    if(dist < mindist)
-    {
-      mindist = dist;
-      closest = *it;
-    }
-  }
-  return std::make_pair(closest, mindist);
-}
-
-std::pair<long, float> AntipoleLeaf::visitNode(const std::vector<float>& image, float max_dist, NodeMap&) const
-{
-  return getClosestThumbnail(image, max_dist);
-}
-
-void AntipoleLeaf::setMatching(const MatchingThumbnails& matching_thumbnails)
-{
-  this->matching_thumbnails = matching_thumbnails;
-}
-
-AntipoleTree::AntipoleTree(void)
-  :root(NULL), conversion_method(0)
-{
-}
-
-AntipoleTree::~AntipoleTree()
-{
-  delete root;
-}
-
-void AntipoleTree::setConversionMethod(int conversion_method)
-{
-  this->conversion_method = conversion_method;
-}
-
-void AntipoleTree::build(const QVector<QImage>& thumbnails)
-{
-  this->thumbnails.clear();
-  
-  MatchingThumbnails default_matching;
-  for(int i = 0; i < thumbnails.size(); ++i)
-  {
-    default_matching.insert(i);
-    this->thumbnails.push_back(convert(thumbnails[i]));
-  }
-  delete root;
-
-  root = buildNewNode(minimum_size, default_matching);
-
-}
-
-const std::vector<std::vector<float> >& AntipoleTree::getThumbnails() const
-{
-  return thumbnails;
-}
-
-long AntipoleTree::getClosestThumbnail(const std::vector<float>& image) const
-{
-  if(root)
-  {
-    NodeMap visiting_map;
-    visiting_map.insert(std::make_pair(0, root));
-    std::pair<long, float> best_pair = std::make_pair(-1, std::numeric_limits<float>::max());
-
-    while(!visiting_map.empty() && best_pair.second > visiting_map.begin()->first)
-    {
-      AntipoleNode* node = visiting_map.begin()->second;
-      visiting_map.erase(visiting_map.begin());
-      std::pair<long, float> node_best_pair = node->visitNode(image, best_pair.second, visiting_map);
-      if(node_best_pair.first >=0 && node_best_pair.second < best_pair.second)
-      {
-        best_pair = node_best_pair;
-      }
-    }
-
-    return best_pair.first; //root->getClosestThumbnail(image, std::numeric_limits<float>::max()).first;
-  }
-  else
-  {
-    return -1;
-  }
-}
-
-std::vector<float> AntipoleTree::convert(const QImage& image) const
-{
-  switch(conversion_method)
-  {
-    case 0:
-      return HelperFunctions::convert_rgb(image);
-      break;
-    case 1:
-      return HelperFunctions::convert_lab(image);
-      break;
-    case 2:
-      return HelperFunctions::convert_lch(image);
-      break;
-  }
-  throw std::runtime_error("Bad conversion method");
-}
-
-long AntipoleTree::getClosestThumbnail(const QImage& image) const
-{
-  return getClosestThumbnail(convert(image));
-}
-
-AntipoleNode* AntipoleTree::buildNewNode(float minimum_size, const MatchingThumbnails& old_matching)
-{
-  MatchingThumbnails left_matching;
-  MatchingThumbnails right_matching;
-  std::vector<float> left_center;
-  std::vector<float> right_center;
-
-  if (old_matching.size() > minimum_size)
-  {
-    int status = divideMatching(old_matching, left_center, right_center, left_matching, right_matching);
-    if(status == 1)
-    {
-      AntipoleInternalNode* node = new AntipoleInternalNode(this);
-      QFuture<AntipoleNode*> left_future = QtConcurrent::run(this, &AntipoleTree::buildNewNode, minimum_size, left_matching);
-      QFuture<AntipoleNode*> right_future = QtConcurrent::run(this, &AntipoleTree::buildNewNode, minimum_size, right_matching);
-      AntipoleNode* left = left_future.result();
-      AntipoleNode* right = right_future.result();
-      node->setLeft(left);
-      computeCenter(left_center, left_matching);
-      left->setCenter(left_center);
-      left->setRadius(computeMaxRadius(left_center, left_matching));
-      node->setRight(right);
-      computeCenter(right_center, right_matching);
-      right->setCenter(right_center);
-      right->setRadius(computeMaxRadius(right_center, right_matching));
-    }
-  }
-  AntipoleLeaf* leaf = new AntipoleLeaf(this);
-  leaf->setMatching(old_matching);
-  return leaf;
-}
-
-int AntipoleTree::divideMatching(const MatchingThumbnails& old_matching, std::vector<float>& left_center, std::vector<float>& right_center, MatchingThumbnails& left_matching, MatchingThumbnails& right_matching)
-{
-  std::pair<std::vector<float>, std::vector<float> > pair = HelperFunctions::approxAntipole(thumbnails, old_matching);
-  left_center = pair.first;
-  right_center = pair.second;
-  assignMatching(old_matching, left_center, right_center, left_matching, right_matching);
-  return 1;
-}
-
-void AntipoleTree::assignMatching(const MatchingThumbnails& old_matching, std::vector<float>& left_center, std::vector<float>& right_center, MatchingThumbnails& left_matching, MatchingThumbnails& right_matching)
-{
-  left_matching.clear();
-  right_matching.clear();
-  for(MatchingThumbnails::const_iterator it = old_matching.begin(); it != old_matching.end(); ++it)
-  {
-    if(HelperFunctions::distance2(thumbnails[*it], left_center) > HelperFunctions::distance2(thumbnails[*it], right_center))
-    {
-      right_matching.insert(*it);
-    }
-    else
-    {
-      left_matching.insert(*it);
-    }
-  }
-}
-
-float AntipoleTree::computeMaxRadius(const std::vector<float>& center, const MatchingThumbnails& matching) const
-{
-  float radius = 0;
-  for(MatchingThumbnails::const_iterator it = matching.begin(); it != matching.end(); ++it)
-  {
-    float new_radius = HelperFunctions::distance2(center, thumbnails[*it]);
-    radius = std::max(radius, new_radius);
-  }
-  return radius;
-}
-
-void AntipoleTree::computeCenter(std::vector<float>& center, const MatchingThumbnails& matching) const
-{
-  center = std::vector<float>(center.size(), 0);
-  for(MatchingThumbnails::const_iterator it = matching.begin(); it != matching.end(); ++it)
-  {
-    std::vector<float>::const_iterator itbis = thumbnails[*it].begin();
-    for(std::vector<float>::iterator it2 = center.begin(); it2 != center.end(); ++it2)
-    {
-      (*it2) += (*itbis);
-      ++itbis;
-    }
-  }
-  for(std::vector<float>::iterator it = center.begin(); it != center.end(); ++it)
-  {
-    *it /= matching.size();
-  }
-}
-
-float HelperFunctions::distance2(const std::vector<float>& object1, const std::vector<float>& object2)
-{
-  float dist = 0;
-
-  for(std::vector<float>::const_iterator it1 = object1.begin(), it2 = object2.begin(); it1 != object1.end() && it2 != object2.end(); ++it1, ++it2)
-  {
-    dist += (*it1 - *it2) * (*it1 - *it2);
-  }
-  return dist;
-}
-
-long HelperFunctions::median1(const std::vector<std::vector<float> >& objects)
-{
-  if(objects.empty())
-  {
-    throw std::runtime_error("Empty set for 1-median algorithm");
-  }
-
-  std::map<float, long> distances;
-
-  for(std::vector<std::vector<float> >::const_iterator it1 = objects.begin(); it1 != objects.end(); ++it1)
-  {
-    float dist = 0;
-    for(std::vector<std::vector<float> >::const_iterator it2 = objects.begin(); it2 != objects.end(); ++it2)
-    {
-      dist += std::sqrt(distance2(*it1, *it2));
-    }
-    distances[dist] = it1 - objects.begin();
-  }
-
-  return distances.begin()->second;
-}
-
-std::pair<std::vector<float>, std::vector<float> > HelperFunctions::approxAntipole(const std::vector<std::vector<float> >& objects, const MatchingThumbnails& matching)
-{
-  std::vector<std::vector<float> > copied_objects;
-  for(MatchingThumbnails::const_iterator it = matching.begin(); it != matching.end(); ++it)
-  {
-    copied_objects.push_back(objects[*it]);
-  }
-  std::vector<std::vector<float> >::iterator it = copied_objects.begin();
-
-  while(copied_objects.size() > 2)
-  {
-    long start = it - copied_objects.begin();
-    std::vector<std::vector<float> > new_tournament;
-    for(int i = 0; i < tournament_size && i < static_cast<int>(copied_objects.size()); ++i)
-    {
-      new_tournament.push_back(*it);
-      ++it;
-      if(it == copied_objects.end())
-      {
-        it = copied_objects.begin();
-      }
-    }
-    unsigned long result = (median1(new_tournament) + start) % copied_objects.size();
-    unsigned long distance = it - copied_objects.begin();
-    copied_objects.erase(copied_objects.begin() + result);
-    if(result < distance)
-    {
-      it = copied_objects.begin() + distance - 1;
-    }
-    else if(result == distance)
-    {
-      if(distance == copied_objects.size())
-      {
-        it = copied_objects.begin();
-      }
-      else
-      {
-        it = copied_objects.begin() + distance;
-      }
-    }
-  }
-  return std::make_pair(*copied_objects.begin(), *(copied_objects.begin()+1));
-}
-
-std::vector<float> HelperFunctions::convert_rgb(const QImage& image)
-{
-  std::vector<float> thumbnail;
-  
-  for(int j = 0; j < image.height(); ++j)
-  {
-    for(int i = 0; i < image.width(); ++i)
-    {
-      QRgb pixel = image.pixel(i, j);
-      thumbnail.push_back(qRed(pixel));
-      thumbnail.push_back(qBlue(pixel));
-      thumbnail.push_back(qGreen(pixel));
-    }
-  }
-  
-  return thumbnail;
-}
-
-static float pivotRGB(float n)
-{
-  return (n > 0.04045 ? std::pow((n + 0.055) / 1.055, 2.4) : n / 12.92) * 100;
-}
-
-static float pivotXYZ(float n)
-{
-  return (n > 0.008856 ? std::pow(n, 1. / 3.) : (903.3 * n + 16) / 116);
-}
-
-void convertRGB2XYZ(float r, float g, float b, float& x, float& y, float& z)
-{
-  float x_ref= 95.047;
-  float y_ref = 100;
-  float z_ref = 108.883;
-  x = pivotXYZ(r * 0.4124 + g * 0.3576 + b * 0.1805) / x_ref;
-  y = pivotXYZ(r * 0.2126 + g * 0.7152 + b * 0.0722) / y_ref;
-  z = pivotXYZ(r * 0.0193 + g * 0.1192 + b * 0.9505) / z_ref;
-}
-
-void convertXYZ2LAB(float x, float y, float z, float& l, float& a, float& b)
-{
-  l = std::max(0., 116. * y - 16);
-  a = 500 * (x - y);
-  b = 200 * (y - z);
-}
-
-void convertRGB2LAB(float red, float green, float blue, float& l, float& a, float& b)
-{
-  float x, y, z;
-  convertRGB2XYZ(red, green, blue, x, y, z);
-  convertXYZ2LAB(x, y, z, l, a, b);
-}
-
-void convertAB2CH(float a, float b, float& c, float& h)
-{
-  h = std::atan2(b, a) / M_PI * 180;
-  c = std::sqrt(a*a + b*b);
-}
-
-void convertRGB2LCH(float red, float green, float blue, float& l, float& c, float& h)
-{
-  float x, y, z, a, b;
-  convertRGB2XYZ(red, green, blue, x, y, z);
-  convertXYZ2LAB(x, y, z, l, a, b);
-  convertAB2CH(a, b, c, h);
-}
-
-std::vector<float> HelperFunctions::convert_lab(const QImage& image)
-{
-  std::vector<float> thumbnail;
-  
-  for(int j = 0; j < image.height(); ++j)
-  {
-    for(int i = 0; i < image.width(); ++i)
-    {
-      QRgb pixel = image.pixel(i, j);
-      
-      float red = pivotRGB(qRed(pixel));
-      float green = pivotRGB(qGreen(pixel));
-      float blue = pivotRGB(qBlue(pixel));
-      
-      float l, a, b;
-      
-      convertRGB2LAB(red, green, blue, l, a, b);
-      
-      thumbnail.push_back(l);
-      thumbnail.push_back(a);
-      thumbnail.push_back(b);
-    }
-  }
-  
-  return thumbnail;
-}
-
-std::vector<float> HelperFunctions::convert_lch(const QImage& image)
-{
-  std::vector<float> thumbnail;
-  
-  for(int j = 0; j < image.height(); ++j)
-  {
-    for(int i = 0; i < image.width(); ++i)
-    {
-      QRgb pixel = image.pixel(i, j);
-      
-      float red = pivotRGB(qRed(pixel));
-      float green = pivotRGB(qGreen(pixel));
-      float blue = pivotRGB(qBlue(pixel));
-      
-      float l, c, h;
-      
-      convertRGB2LCH(red, green, blue, l, c, h);
-      
-      thumbnail.push_back(l);
-      thumbnail.push_back(c);
-      thumbnail.push_back(h);
-    }
-  }
-  
-  return thumbnail;
-}
+/**
+ * \file AntipoleTree.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+#include <QtCore/QThreadStorage>
+#include <QtCore/QWaitCondition>
+
+#include "AntipoleTree.h"
+#include "ColorConversion.h"
+#include "DistanceKernels.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ANTIPOLETREE_SSE2
+#include <emmintrin.h>
+#endif
+
+const int HelperFunctions::tournament_size = 3;
+const long AntipoleTree::minimum_size = 100;
+const long AntipoleTree::query_minimum_size = 16;
+const long AntipoleTree::build_task_size = 4096;
+const long AntipoleTree::parallel_chunk_size = 16384;
+// Quantized L*a*b and L*c*h values are kept to half a unit, the conversions stay within 500 units
+const float AntipoleTree::quantization_scale = 2;
+
+/**
+ * Best matches of the queries of a dual-tree search, in the order of the query tree.
+ * Bounds are the largest best distance of the queries below each query node.
+ */
+struct DualTreeState
+{
+  std::vector<long> closest;
+  std::vector<float> distances;
+  std::vector<float> bounds;
+  // Work done for each query node, shared by the queries below it, and for each query in leaf scans
+  std::vector<SearchStatistics> node_statistics;
+  std::vector<SearchStatistics> statistics;
+};
+
+/**
+ * Shared state of a build. Subtrees handed to other threads are built in their own fragment,
+ * the node that split them off references them with a negative right child until the fragments are joined.
+ */
+struct BuildState
+{
+  long minimum_size;
+  QThreadPool pool;
+  QMutex mutex;
+  std::vector<AntipoleSubtree*> fragments;
+
+  BuildState(long minimum_size)
+    :minimum_size(minimum_size)
+  {
+    pool.setMaxThreadCount(QThreadPool::globalInstance()->maxThreadCount());
+  }
+
+  ~BuildState()
+  {
+    pool.waitForDone();
+    for(std::vector<AntipoleSubtree*>::iterator it = fragments.begin(); it != fragments.end(); ++it)
+    {
+      delete *it;
+    }
+  }
+
+  long addFragment(AntipoleSubtree*& fragment)
+  {
+    QMutexLocker locker(&mutex);
+    fragment = new AntipoleSubtree;
+    fragments.push_back(fragment);
+    return fragments.size() - 1;
+  }
+};
+
+namespace
+{
+  class FunctionTask : public QRunnable
+  {
+    std::function<void()> function;
+  public:
+    FunctionTask(const std::function<void()>& function)
+      :function(function)
+    {
+    }
+
+    void run()
+    {
+      function();
+    }
+  };
+
+  /**
+   * Chunks of a loop shared by the thread that started it and helper tasks.
+   * The starting thread processes chunks as well and only waits for the chunks already being processed,
+   * never for a helper that is still queued behind other tasks.
+   */
+  struct ParallelLoop
+  {
+    std::function<void(long)> body;
+    long chunk_count;
+    QAtomicInt next_chunk;
+    QAtomicInt remaining;
+    QMutex mutex;
+    QWaitCondition finished;
+
+    ParallelLoop(const std::function<void(long)>& body, long chunk_count)
+      :body(body), chunk_count(chunk_count), next_chunk(0), remaining(chunk_count)
+    {
+    }
+
+    void work()
+    {
+      for(long chunk = next_chunk.fetchAndAddOrdered(1); chunk < chunk_count; chunk = next_chunk.fetchAndAddOrdered(1))
+      {
+        body(chunk);
+        if(remaining.fetchAndAddOrdered(-1) == 1)
+        {
+          QMutexLocker locker(&mutex);
+          finished.wakeAll();
+        }
+      }
+    }
+
+    void wait()
+    {
+      QMutexLocker locker(&mutex);
+      while(remaining.loadAcquire() > 0)
+      {
+        finished.wait(&mutex);
+      }
+    }
+  };
+
+  void parallelFor(QThreadPool& pool, long chunk_count, const std::function<void(long)>& body)
+  {
+    if(chunk_count < 2 || pool.maxThreadCount() < 2)
+    {
+      for(long chunk = 0; chunk < chunk_count; ++chunk)
+      {
+        body(chunk);
+      }
+      return;
+    }
+
+    std::shared_ptr<ParallelLoop> loop(new ParallelLoop(body, chunk_count));
+    long helpers = std::min<long>(chunk_count, pool.maxThreadCount()) - 1;
+    for(long i = 0; i < helpers; ++i)
+    {
+      pool.start(new FunctionTask([loop]()
+      {
+        loop->work();
+      }));
+    }
+    loop->work();
+    loop->wait();
+  }
+
+  QThreadStorage<SearchContext*> search_contexts;
+
+  void pushNode(NodeHeap& node_heap, float bound, long node)
+  {
+    node_heap.push_back(std::make_pair(bound, node));
+    std::push_heap(node_heap.begin(), node_heap.end(), std::greater<std::pair<float, long> >());
+  }
+
+  void popNode(NodeHeap& node_heap)
+  {
+    std::pop_heap(node_heap.begin(), node_heap.end(), std::greater<std::pair<float, long> >());
+    node_heap.pop_back();
+  }
+
+  const char index_magic[8] = {'Q', 'T', 'M', 'O', 'S', 'I', 'D', 'X'};
+  const quint32 index_version = 6;
+  const quint32 index_byte_order = 0x01020304;
+
+  /**
+   * Header of an index file, followed by the nodes, the centers, the indices of the ordered thumbnails and the thumbnails
+   */
+  struct AntipoleIndexHeader
+  {
+    char magic[8];
+    quint32 version;
+    quint32 byte_order;
+    qint32 conversion_method;
+    qint32 dimension;
+    qint32 descriptor_storage;
+    qint32 code_size;
+    qint64 thumbnail_count;
+    qint64 node_count;
+    char checksum[64];
+  };
+
+  qint64 indexFileSize(const AntipoleIndexHeader& header)
+  {
+    return sizeof(AntipoleIndexHeader) + header.node_count * (sizeof(AntipoleNode) + header.dimension * sizeof(float)) + header.thumbnail_count * (sizeof(qint32) + header.code_size);
+  }
+}
+
+AntipoleTree::AntipoleTree(void)
+  :dimension(0), conversion_method(0), requested_storage(FloatStorage), descriptor_storage(FloatStorage), descriptor_cascade(true), cascade_size(0), leaf_specialization(true), leaf_scan(&AntipoleTree::scanLeaf), index_file(NULL), garbage(0)
+{
+  clear();
+}
+
+AntipoleTree::~AntipoleTree()
+{
+  delete index_file;
+}
+
+void AntipoleTree::clear()
+{
+  thumbnails.clear();
+  indices.clear();
+  nodes.clear();
+  centers.clear();
+  codes.clear();
+  thumbnail_indices.clear();
+  delete index_file;
+  index_file = NULL;
+  parents.clear();
+  built_sizes.clear();
+  updates.clear();
+  garbage = 0;
+  setStorage();
+}
+
+void AntipoleTree::detach()
+{
+  if(index_file == NULL)
+  {
+    return;
+  }
+  nodes.assign(node_data, node_data + node_count);
+  centers.assign(center_data, center_data + node_count * dimension);
+  codes.assign(code_data, code_data + thumbnail_count * getCodeSize());
+  thumbnail_indices.assign(index_data, index_data + thumbnail_count);
+  delete index_file;
+  index_file = NULL;
+  setStorage();
+}
+
+void AntipoleTree::setStorage()
+{
+  thumbnail_count = thumbnail_indices.size();
+  node_count = nodes.size();
+  node_data = nodes.empty() ? NULL : &nodes[0];
+  center_data = centers.empty() ? NULL : &centers[0];
+  code_data = codes.empty() ? NULL : &codes[0];
+  index_data = thumbnail_indices.empty() ? NULL : &thumbnail_indices[0];
+}
+
+bool AntipoleTree::save(const QString& filename, const QByteArray& checksum) const
+{
+  AntipoleIndexHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, index_magic, sizeof(index_magic));
+  header.version = index_version;
+  header.byte_order = index_byte_order;
+  header.conversion_method = conversion_method;
+  header.dimension = dimension;
+  header.descriptor_storage = descriptor_storage;
+  header.code_size = getCodeSize();
+  header.thumbnail_count = thumbnail_count;
+  header.node_count = node_count;
+  std::memcpy(header.checksum, checksum.constData(), std::min<std::size_t>(checksum.size(), sizeof(header.checksum)));
+
+  QFile file(filename);
+  if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+  {
+    return false;
+  }
+  bool success = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header);
+  success = success && file.write(reinterpret_cast<const char*>(node_data), node_count * sizeof(AntipoleNode)) == static_cast<qint64>(node_count * sizeof(AntipoleNode));
+  success = success && file.write(reinterpret_cast<const char*>(center_data), node_count * dimension * sizeof(float)) == static_cast<qint64>(node_count * dimension * sizeof(float));
+  success = success && file.write(reinterpret_cast<const char*>(index_data), thumbnail_count * sizeof(qint32)) == static_cast<qint64>(thumbnail_count * sizeof(qint32));
+  success = success && file.write(reinterpret_cast<const char*>(code_data), thumbnail_count * getCodeSize()) == static_cast<qint64>(thumbnail_count * getCodeSize());
+  file.close();
+  if(!success)
+  {
+    file.remove();
+  }
+  return success;
+}
+
+bool AntipoleTree::load(const QString& filename, const QByteArray& checksum)
+{
+  QFile* file = new QFile(filename);
+  if(!file->open(QIODevice::ReadOnly) || file->size() < static_cast<qint64>(sizeof(AntipoleIndexHeader)))
+  {
+    delete file;
+    return false;
+  }
+  uchar* data = file->map(0, file->size());
+  if(data == NULL)
+  {
+    delete file;
+    return false;
+  }
+
+  AntipoleIndexHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  char expected_checksum[sizeof(header.checksum)] = {0};
+  std::memcpy(expected_checksum, checksum.constData(), std::min<std::size_t>(checksum.size(), sizeof(expected_checksum)));
+  if(std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0 || header.version != index_version || header.byte_order != index_byte_order
+    || header.conversion_method != conversion_method || header.descriptor_storage != getStorage(header.dimension) || std::memcmp(header.checksum, expected_checksum, sizeof(expected_checksum)) != 0
+    || header.dimension <= 0 || header.node_count <= 0 || header.thumbnail_count <= 0 || indexFileSize(header) != file->size())
+  {
+    delete file;
+    return false;
+  }
+
+  clear();
+  dimension = header.dimension;
+  descriptor_storage = getStorage(dimension);
+  setCascade();
+  selectLeafScan();
+  if(header.code_size != getCodeSize())
+  {
+    delete file;
+    return false;
+  }
+  index_file = file;
+  thumbnail_count = header.thumbnail_count;
+  node_count = header.node_count;
+  const uchar* current = data + sizeof(header);
+  node_data = reinterpret_cast<const AntipoleNode*>(current);
+  current += node_count * sizeof(AntipoleNode);
+  center_data = reinterpret_cast<const float*>(current);
+  current += node_count * dimension * sizeof(float);
+  index_data = reinterpret_cast<const qint32*>(current);
+  current += thumbnail_count * sizeof(qint32);
+  code_data = current;
+  return true;
+}
+
+void AntipoleTree::setConversionMethod(int conversion_method)
+{
+  this->conversion_method = conversion_method;
+}
+
+int AntipoleTree::getConversionMethod() const
+{
+  return conversion_method;
+}
+
+void AntipoleTree::setDescriptorStorage(DescriptorStorage descriptor_storage)
+{
+  requested_storage = descriptor_storage;
+}
+
+void AntipoleTree::setDescriptorCascade(bool descriptor_cascade)
+{
+  this->descriptor_cascade = descriptor_cascade;
+}
+
+void AntipoleTree::setLeafSpecialization(bool leaf_specialization)
+{
+  this->leaf_specialization = leaf_specialization;
+}
+
+void AntipoleTree::setCascade()
+{
+  cascade_sides.clear();
+  cascade_weights.clear();
+  cascade_size = 0;
+
+  // Only square grids of colors have coarse levels: the mean color, and a 3x3 grid for grids of 9x9 and more
+  // (for a 6x6 grid, the 3x3 level costs more than it prunes)
+  long side = static_cast<long>(std::sqrt(dimension / 3.) + .5);
+  if(!descriptor_cascade || side < 2 || 3 * side * side != dimension)
+  {
+    return;
+  }
+  cascade_sides.push_back(1);
+  if(side % 3 == 0 && side >= 9)
+  {
+    cascade_sides.push_back(3);
+  }
+  // A coarse cell is the mean of block * block cells, so the squared distance is at least block^2 times the coarse one
+  for(std::vector<long>::const_iterator it = cascade_sides.begin(); it != cascade_sides.end(); ++it)
+  {
+    long block = side / *it;
+    cascade_weights.push_back(block * block);
+    cascade_size += 3 * *it * *it;
+  }
+}
+
+DescriptorStorage AntipoleTree::getStorage(long dimension) const
+{
+  // The integer kernels sum squared differences in 32 bits
+  long max_size = conversion_method == 0 ? DistanceKernels::max_byte_size : DistanceKernels::max_word_size;
+  return requested_storage == QuantizedStorage && dimension <= max_size ? QuantizedStorage : FloatStorage;
+}
+
+long AntipoleTree::getElementSize() const
+{
+  if(descriptor_storage == FloatStorage)
+  {
+    return sizeof(float);
+  }
+  return conversion_method == 0 ? sizeof(quint8) : sizeof(qint16);
+}
+
+float AntipoleTree::getStoredValue(float value) const
+{
+  if(descriptor_storage == FloatStorage)
+  {
+    return value;
+  }
+  if(conversion_method == 0)
+  {
+    return std::min(std::max(std::floor(value + .5f), 0.f), 255.f);
+  }
+  // Values stay within 11 bits so that differences fit in the 12 bits the integer kernels expect
+  return std::min(std::max(std::floor(value * quantization_scale + .5f), -1023.f), 1023.f) / quantization_scale;
+}
+
+void AntipoleTree::quantize(const float* values, float* stored, long size) const
+{
+  for(long i = 0; i < size; ++i)
+  {
+    stored[i] = getStoredValue(values[i]);
+  }
+}
+
+void AntipoleTree::encode(const float* thumbnail, uchar* code) const
+{
+  uchar* fine_code = code + cascade_size * sizeof(float);
+  if(descriptor_storage == FloatStorage)
+  {
+    std::memcpy(fine_code, thumbnail, dimension * sizeof(float));
+  }
+  else if(conversion_method == 0)
+  {
+    for(long i = 0; i < dimension; ++i)
+    {
+      fine_code[i] = static_cast<quint8>(getStoredValue(thumbnail[i]));
+    }
+  }
+  else
+  {
+    qint16* word_code = reinterpret_cast<qint16*>(fine_code);
+    for(long i = 0; i < dimension; ++i)
+    {
+      word_code[i] = static_cast<qint16>(getStoredValue(thumbnail[i]) * quantization_scale);
+    }
+  }
+  std::fill(fine_code + dimension * getElementSize(), code + getCodeSize(), 0);
+
+  if(cascade_size == 0)
+  {
+    return;
+  }
+  // Levels are computed from the stored values, so that they bound the distance between codes
+  float* level = reinterpret_cast<float*>(code);
+  long side = static_cast<long>(std::sqrt(dimension / 3.) + .5);
+  for(std::vector<long>::const_iterator it = cascade_sides.begin(); it != cascade_sides.end(); ++it)
+  {
+    long block = side / *it;
+    std::fill(level, level + 3 * *it * *it, 0.f);
+    for(long j = 0; j < side; ++j)
+    {
+      for(long i = 0; i < side; ++i)
+      {
+        float* cell = level + 3 * ((j / block) * *it + i / block);
+        const float* pixel = thumbnail + 3 * (j * side + i);
+        for(long channel = 0; channel < 3; ++channel)
+        {
+          cell[channel] += getStoredValue(pixel[channel]) / (block * block);
+        }
+      }
+    }
+    level += 3 * *it * *it;
+  }
+}
+
+std::vector<uchar> AntipoleTree::encode(const std::vector<float>& thumbnail) const
+{
+  std::vector<uchar> code(getCodeSize());
+  encode(&thumbnail[0], &code[0]);
+  return code;
+}
+
+void AntipoleTree::decode(const uchar* code, float* thumbnail) const
+{
+  code += cascade_size * sizeof(float);
+  if(descriptor_storage == FloatStorage)
+  {
+    std::memcpy(thumbnail, code, dimension * sizeof(float));
+  }
+  else if(conversion_method == 0)
+  {
+    std::copy(code, code + dimension, thumbnail);
+  }
+  else
+  {
+    const qint16* word_code = reinterpret_cast<const qint16*>(code);
+    for(long i = 0; i < dimension; ++i)
+    {
+      thumbnail[i] = word_code[i] / quantization_scale;
+    }
+  }
+}
+
+float AntipoleTree::codeDistance(const uchar* code1, const uchar* code2, float max_dist) const
+{
+  if(cascade_size > 0)
+  {
+    const float* level1 = reinterpret_cast<const float*>(code1);
+    const float* level2 = reinterpret_cast<const float*>(code2);
+    // The mean color is compared inline, finer levels are abandoned as soon as they prune
+    float bound = cascade_weights[0] * ((level1[0] - level2[0]) * (level1[0] - level2[0]) + (level1[1] - level2[1]) * (level1[1] - level2[1]) + (level1[2] - level2[2]) * (level1[2] - level2[2]));
+    if(bound >= max_dist)
+    {
+      return bound;
+    }
+    level1 += 3;
+    level2 += 3;
+    for(std::size_t i = 1; i < cascade_sides.size(); ++i)
+    {
+      long level_size = 3 * cascade_sides[i] * cascade_sides[i];
+      bound = cascade_weights[i] * DistanceKernels::partialDistance2(level1, level2, level_size, max_dist / cascade_weights[i]);
+      if(bound >= max_dist)
+      {
+        return bound;
+      }
+      level1 += level_size;
+      level2 += level_size;
+    }
+    code1 += cascade_size * sizeof(float);
+    code2 += cascade_size * sizeof(float);
+  }
+
+  if(descriptor_storage == FloatStorage)
+  {
+    return DistanceKernels::partialDistance2(reinterpret_cast<const float*>(code1), reinterpret_cast<const float*>(code2), dimension, max_dist);
+  }
+  if(conversion_method == 0)
+  {
+    return DistanceKernels::distance2(code1, code2, dimension);
+  }
+  return DistanceKernels::distance2(reinterpret_cast<const qint16*>(code1), reinterpret_cast<const qint16*>(code2), dimension) / (quantization_scale * quantization_scale);
+}
+
+/**
+ * Metric policies of the specialized leaf scans: squared distances between the fine parts of two codes of a fixed dimension.
+ * The loops have a constant trip count, so that the compiler unrolls them. Quantized codes are compared up to their padding,
+ * which is zero in every code, with the same multiply-add as the integer kernels.
+ */
+struct AntipoleTree::FloatMetric
+{
+  template<long Dimension>
+  static float distance2(const uchar* code1, const uchar* code2)
+  {
+    const float* object1 = reinterpret_cast<const float*>(code1);
+    const float* object2 = reinterpret_cast<const float*>(code2);
+    // Independent sums, so that they can be kept in a single vector register
+    float sums[4] = {0, 0, 0, 0};
+    for(long i = 0; i + 4 <= Dimension; i += 4)
+    {
+      for(long j = 0; j < 4; ++j)
+      {
+        float difference = object1[i + j] - object2[i + j];
+        sums[j] += difference * difference;
+      }
+    }
+    for(long i = Dimension / 4 * 4; i < Dimension; ++i)
+    {
+      float difference = object1[i] - object2[i];
+      sums[0] += difference * difference;
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  }
+};
+
+#if defined(ANTIPOLETREE_SSE2)
+namespace
+{
+  qint32 horizontalSum(__m128i sums)
+  {
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sums);
+  }
+
+  __m128i byteDistance2(__m128i object1, __m128i object2, __m128i sums)
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i difference = _mm_or_si128(_mm_subs_epu8(object1, object2), _mm_subs_epu8(object2, object1));
+    __m128i low = _mm_unpacklo_epi8(difference, zero);
+    __m128i high = _mm_unpackhi_epi8(difference, zero);
+    return _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+  }
+
+  __m128i wordDistance2(__m128i object1, __m128i object2, __m128i sums)
+  {
+    __m128i difference = _mm_sub_epi16(object1, object2);
+    return _mm_add_epi32(sums, _mm_madd_epi16(difference, difference));
+  }
+}
+#endif
+
+struct AntipoleTree::ByteMetric
+{
+  template<long Dimension>
+  static float distance2(const uchar* code1, const uchar* code2)
+  {
+    const long size = (Dimension + 3) / 4 * 4;
+    qint32 sum = 0;
+    long i = 0;
+#if defined(ANTIPOLETREE_SSE2)
+    __m128i sums = _mm_setzero_si128();
+    for(; i + 16 <= size; i += 16)
+    {
+      sums = byteDistance2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(code1 + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(code2 + i)), sums);
+    }
+    if(i + 8 <= size)
+    {
+      // The high halves are zero, so they add nothing
+      sums = byteDistance2(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code1 + i)), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(code2 + i)), sums);
+      i += 8;
+    }
+    sum = horizontalSum(sums);
+#endif
+    for(; i < size; ++i)
+    {
+      qint32 difference = static_cast<qint32>(code1[i]) - code2[i];
+      sum += difference * difference;
+    }
+    return sum;
+  }
+};
+
+struct AntipoleTree::WordMetric
+{
+  template<long Dimension>
+  static float distance2(const uchar* code1, const uchar* code2)
+  {
+    const long size = (Dimension + 1) / 2 * 2;
+    const qint16* object1 = reinterpret_cast<const qint16*>(code1);
+    const qint16* object2 = reinterpret_cast<const qint16*>(code2);
+    qint32 sum = 0;
+#if defined(ANTIPOLETREE_SSE2)
+    // The vector loops take whole groups of four words, the scalar loop starts from a constant after them
+    const long vector_size = size / 4 * 4;
+    __m128i sums = _mm_setzero_si128();
+    long i = 0;
+    for(; i + 8 <= vector_size; i += 8)
+    {
+      sums = wordDistance2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(object1 + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(object2 + i)), sums);
+    }
+    if(i < vector_size)
+    {
+      sums = wordDistance2(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(object1 + i)), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(object2 + i)), sums);
+    }
+    sum = horizontalSum(sums);
+#else
+    const long vector_size = 0;
+#endif
+    for(long j = vector_size; j < size; ++j)
+    {
+      qint32 difference = static_cast<qint32>(object1[j]) - object2[j];
+      sum += difference * difference;
+    }
+    return sum / (quantization_scale * quantization_scale);
+  }
+};
+
+template<long Dimension, class Metric, bool Cascade>
+std::pair<long, float> AntipoleTree::scanLeaf(const AntipoleTree& tree, const uchar* code, long begin, long end, float max_dist)
+{
+  // Specialized scans only handle the mean color level
+  const long offset = Cascade ? 3 * sizeof(float) : 0;
+  const float weight = Cascade ? tree.cascade_weights[0] : 0;
+  const float* mean = reinterpret_cast<const float*>(code);
+  const long code_size = tree.getCodeSize();
+  const uchar* current = tree.getCode(begin);
+  long closest = -1;
+  for(long i = begin; i < end; ++i, current += code_size)
+  {
+    if(Cascade)
+    {
+      const float* other = reinterpret_cast<const float*>(current);
+      float bound = weight * ((mean[0] - other[0]) * (mean[0] - other[0]) + (mean[1] - other[1]) * (mean[1] - other[1]) + (mean[2] - other[2]) * (mean[2] - other[2]));
+      if(bound >= max_dist)
+      {
+        continue;
+      }
+    }
+    float dist = Metric::template distance2<Dimension>(code + offset, current + offset);
+    if(dist < max_dist)
+    {
+      max_dist = dist;
+      closest = i;
+    }
+  }
+  return std::make_pair(closest, max_dist);
+}
+
+std::pair<long, float> AntipoleTree::scanLeaf(const AntipoleTree& tree, const uchar* code, long begin, long end, float max_dist)
+{
+  long closest = -1;
+  for(long i = begin; i < end; ++i)
+  {
+    float dist = tree.codeDistance(code, tree.getCode(i), max_dist);
+    if(dist < max_dist)
+    {
+      max_dist = dist;
+      closest = i;
+    }
+  }
+  return std::make_pair(closest, max_dist);
+}
+
+template<long Dimension>
+AntipoleTree::LeafScanFunction AntipoleTree::selectLeafScan() const
+{
+  bool cascade = cascade_size > 0;
+  if(descriptor_storage == FloatStorage)
+  {
+    return cascade ? &AntipoleTree::scanLeaf<Dimension, FloatMetric, true> : &AntipoleTree::scanLeaf<Dimension, FloatMetric, false>;
+  }
+  if(conversion_method == 0)
+  {
+    return cascade ? &AntipoleTree::scanLeaf<Dimension, ByteMetric, true> : &AntipoleTree::scanLeaf<Dimension, ByteMetric, false>;
+  }
+  return cascade ? &AntipoleTree::scanLeaf<Dimension, WordMetric, true> : &AntipoleTree::scanLeaf<Dimension, WordMetric, false>;
+}
+
+void AntipoleTree::selectLeafScan()
+{
+  leaf_scan = &AntipoleTree::scanLeaf;
+  // Grids of 9x9 and more have a 3x3 level, which only the generic scan compares
+  if(!leaf_specialization || cascade_sides.size() > 1)
+  {
+    return;
+  }
+  // Thumbnails of 2x2 to 5x5 pixels, the database model scales them to 3x3
+  switch(dimension)
+  {
+    case 12:
+      leaf_scan = selectLeafScan<12>();
+      break;
+    case 27:
+      leaf_scan = selectLeafScan<27>();
+      break;
+    case 48:
+      leaf_scan = selectLeafScan<48>();
+      break;
+    case 75:
+      leaf_scan = selectLeafScan<75>();
+      break;
+  }
+}
+
+void AntipoleTree::build(const QVector<QImage>& thumbnails)
+{
+  clear();
+  dimension = 0;
+
+  for(int i = 0; i < thumbnails.size(); ++i)
+  {
+    std::vector<float> thumbnail = convert(thumbnails[i]);
+    dimension = thumbnail.size();
+    this->thumbnails.insert(this->thumbnails.end(), thumbnail.begin(), thumbnail.end());
+    indices.push_back(i);
+  }
+  buildIndex(minimum_size);
+}
+
+void AntipoleTree::build(const std::vector<float>& thumbnails, long dimension, long minimum_size)
+{
+  clear();
+  this->thumbnails = thumbnails;
+  this->dimension = dimension;
+
+  long size = dimension > 0 ? thumbnails.size() / dimension : 0;
+  for(long i = 0; i < size; ++i)
+  {
+    indices.push_back(i);
+  }
+  buildIndex(minimum_size);
+}
+
+void AntipoleTree::buildIndex(long minimum_size)
+{
+  descriptor_storage = getStorage(dimension);
+  setCascade();
+  selectLeafScan();
+  if(indices.empty())
+  {
+    return;
+  }
+  // Bounds computed from the stored values hold for the distances between codes
+  if(descriptor_storage != FloatStorage)
+  {
+    quantize(&thumbnails[0], &thumbnails[0], thumbnails.size());
+  }
+
+  // The calling thread builds the top of the tree, large subtrees are handed to the pool
+  BuildState state(minimum_size);
+  AntipoleSubtree fragment;
+  buildNode(state, fragment, 0, indices.size());
+  state.pool.waitForDone();
+
+  AntipoleSubtree tree;
+  joinFragment(state, tree, fragment, 0);
+  nodes.swap(tree.nodes);
+  centers.swap(tree.centers);
+
+  // Thumbnails are stored in leaf order so that a leaf scan is a linear walk, only their codes are kept
+  long code_size = getCodeSize();
+  codes.resize(indices.size() * code_size);
+  for(std::size_t i = 0; i < indices.size(); ++i)
+  {
+    encode(&this->thumbnails[indices[i] * dimension], &codes[i * code_size]);
+  }
+  std::vector<float>().swap(this->thumbnails);
+  thumbnail_indices.assign(indices.begin(), indices.end());
+  std::vector<long>().swap(indices);
+  setStorage();
+}
+
+float AntipoleTree::minimumDistance(long node, const float* image) const
+{
+  float distance = std::sqrt(HelperFunctions::distance2(image, getCenter(node), dimension)) - node_data[node].radius;
+  return distance > 0 ? distance * distance : 0;
+}
+
+std::pair<long, float> AntipoleTree::visitNode(long node, const float* image, const uchar* code, float max_dist, NodeHeap& node_heap) const
+{
+  const AntipoleNode& current = node_data[node];
+  if(!current.isLeaf())
+  {
+    pushNode(node_heap, minimumDistance(current.left, image), current.left);
+    pushNode(node_heap, minimumDistance(current.right, image), current.right);
+    return std::make_pair(-1, std::numeric_limits<float>::max());
+  }
+
+  return leaf_scan(*this, code, current.begin, current.end, max_dist);
+}
+
+std::vector<float> AntipoleTree::getThumbnails() const
+{
+  std::vector<float> thumbnails;
+  if(node_count == 0)
+  {
+    return thumbnails;
+  }
+
+  std::vector<long> leaves;
+  std::vector<long> stack(1, 0);
+  while(!stack.empty())
+  {
+    const AntipoleNode& current = node_data[stack.back()];
+    stack.pop_back();
+    if(current.isLeaf())
+    {
+      for(long i = current.begin; i < current.end; ++i)
+      {
+        leaves.push_back(i);
+      }
+    }
+    else
+    {
+      stack.push_back(current.left);
+      stack.push_back(current.right);
+    }
+  }
+
+  thumbnails.resize(leaves.size() * dimension);
+  for(std::vector<long>::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+  {
+    decode(getCode(*it), &thumbnails[index_data[*it] * dimension]);
+  }
+  return thumbnails;
+}
+
+TreeStatistics AntipoleTree::getStatistics() const
+{
+  TreeStatistics statistics = {0, 0, 0, std::vector<long>(), std::vector<float>()};
+  if(node_count == 0)
+  {
+    return statistics;
+  }
+
+  std::vector<long> counts;
+  std::vector<std::pair<long, long> > stack(1, std::make_pair(0L, 0L));
+  while(!stack.empty())
+  {
+    const AntipoleNode& current = node_data[stack.back().first];
+    long depth = stack.back().second;
+    stack.pop_back();
+    ++statistics.nodes;
+    statistics.depth = std::max(statistics.depth, depth);
+    if(static_cast<long>(counts.size()) <= depth)
+    {
+      counts.resize(depth + 1, 0);
+      statistics.radii.resize(depth + 1, 0);
+    }
+    ++counts[depth];
+    statistics.radii[depth] += current.radius;
+    if(current.isLeaf())
+    {
+      ++statistics.leaves;
+      long bucket = 0;
+      for(long size = current.end - current.begin; size > 1; size /= 2)
+      {
+        ++bucket;
+      }
+      if(static_cast<long>(statistics.leaf_sizes.size()) <= bucket)
+      {
+        statistics.leaf_sizes.resize(bucket + 1, 0);
+      }
+      ++statistics.leaf_sizes[bucket];
+    }
+    else
+    {
+      stack.push_back(std::make_pair(static_cast<long>(current.left), depth + 1));
+      stack.push_back(std::make_pair(static_cast<long>(current.right), depth + 1));
+    }
+  }
+  for(std::size_t depth = 0; depth < counts.size(); ++depth)
+  {
+    statistics.radii[depth] /= counts[depth];
+  }
+  return statistics;
+}
+
+long AntipoleTree::getClosestThumbnail(const std::vector<float>& image) const
+{
+  return search(image, SearchOptions()).index;
+}
+
+SearchResult AntipoleTree::search(const std::vector<float>& image, const SearchOptions& options) const
+{
+  if(node_count > 0 && static_cast<long>(image.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+  return search(image.empty() ? NULL : &image[0], options, getThreadContext());
+}
+
+SearchResult AntipoleTree::search(const float* image, const SearchOptions& options, SearchContext& context) const
+{
+  SearchResult result = {-1, std::numeric_limits<float>::max(), true, SearchStatistics()};
+  if(node_count == 0)
+  {
+    return result;
+  }
+
+  float relaxation = (1 + options.epsilon) * (1 + options.epsilon);
+  context.code.resize(getCodeSize());
+  encode(image, &context.code[0]);
+  const float* query = image;
+  if(descriptor_storage != FloatStorage)
+  {
+    context.query.resize(dimension);
+    quantize(image, &context.query[0], dimension);
+    query = &context.query[0];
+  }
+  NodeHeap& visiting_heap = context.nodes;
+  visiting_heap.clear();
+  visiting_heap.reserve(node_count);
+  pushNode(visiting_heap, minimumDistance(0, query), 0);
+  std::pair<long, float> best_pair = std::make_pair(-1, std::numeric_limits<float>::max());
+  SearchStatistics& statistics = result.statistics;
+  statistics.queries = 1;
+  statistics.distances = 1;
+  long leaves = 0;
+
+  while(!visiting_heap.empty() && best_pair.second > visiting_heap.front().first * relaxation)
+  {
+    if(best_pair.first >= 0 && (best_pair.second < options.accept_distance || (options.max_leaves > 0 && leaves >= options.max_leaves) || (options.max_distances > 0 && statistics.distances >= options.max_distances)))
+    {
+      break;
+    }
+    long node = visiting_heap.front().second;
+    popNode(visiting_heap);
+    ++statistics.visited_nodes;
+    const AntipoleNode& current = node_data[node];
+    if(current.isLeaf())
+    {
+      ++leaves;
+      statistics.leaf_members += current.end - current.begin;
+      statistics.distances += current.end - current.begin;
+    }
+    else
+    {
+      statistics.distances += 2;
+    }
+    std::pair<long, float> node_best_pair = visitNode(node, query, &context.code[0], best_pair.second, visiting_heap);
+    if(node_best_pair.first >= 0 && node_best_pair.second < best_pair.second)
+    {
+      best_pair = node_best_pair;
+    }
+  }
+
+  result.index = best_pair.first >= 0 ? index_data[best_pair.first] : -1;
+  result.distance = best_pair.second;
+  result.exact = visiting_heap.empty() || visiting_heap.front().first >= best_pair.second;
+  statistics.pruned_subtrees = visiting_heap.size();
+  return result;
+}
+
+void AntipoleTree::visitNode(long node, const float* image, const uchar* code, long k, CandidateHeap& candidates, NodeHeap& node_heap) const
+{
+  const AntipoleNode& current = node_data[node];
+  if(!current.isLeaf())
+  {
+    pushNode(node_heap, minimumDistance(current.left, image), current.left);
+    pushNode(node_heap, minimumDistance(current.right, image), current.right);
+    return;
+  }
+
+  for(long i = current.begin; i < current.end; ++i)
+  {
+    float max_dist = static_cast<long>(candidates.size()) < k ? std::numeric_limits<float>::max() : candidates.front().first;
+    float dist = codeDistance(code, getCode(i), max_dist);
+    if(dist < max_dist)
+    {
+      if(static_cast<long>(candidates.size()) == k)
+      {
+        std::pop_heap(candidates.begin(), candidates.end());
+        candidates.pop_back();
+      }
+      candidates.push_back(std::make_pair(dist, i));
+      std::push_heap(candidates.begin(), candidates.end());
+    }
+  }
+}
+
+std::vector<std::pair<long, float> > AntipoleTree::getClosestThumbnails(const std::vector<float>& image, long k) const
+{
+  std::vector<std::pair<long, float> > closest;
+  if(node_count == 0 || k <= 0)
+  {
+    return closest;
+  }
+  if(static_cast<long>(image.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+
+  SearchContext& context = getThreadContext();
+  CandidateHeap& candidates = context.candidates;
+  candidates.clear();
+  candidates.reserve(k + 1);
+  context.code.resize(getCodeSize());
+  encode(&image[0], &context.code[0]);
+  context.query.resize(dimension);
+  quantize(&image[0], &context.query[0], dimension);
+  NodeHeap& visiting_heap = context.nodes;
+  visiting_heap.clear();
+  visiting_heap.reserve(node_count);
+  pushNode(visiting_heap, minimumDistance(0, &context.query[0]), 0);
+
+  while(!visiting_heap.empty() && (static_cast<long>(candidates.size()) < k || candidates.front().first > visiting_heap.front().first))
+  {
+    long node = visiting_heap.front().second;
+    popNode(visiting_heap);
+    visitNode(node, &context.query[0], &context.code[0], k, candidates, visiting_heap);
+  }
+
+  std::sort_heap(candidates.begin(), candidates.end());
+  for(CandidateHeap::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+  {
+    closest.push_back(std::make_pair(index_data[it->second], it->first));
+  }
+  return closest;
+}
+
+std::vector<long> AntipoleTree::getClosestThumbnails(const std::vector<std::vector<float> >& images) const
+{
+  std::vector<SearchResult> results = search(images, SearchOptions());
+  std::vector<long> closest(results.size());
+  for(std::size_t i = 0; i < results.size(); ++i)
+  {
+    closest[i] = results[i].index;
+  }
+  return closest;
+}
+
+std::vector<SearchResult> AntipoleTree::search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const
+{
+  SearchResult no_result = {-1, std::numeric_limits<float>::max(), true, SearchStatistics()};
+  std::vector<SearchResult> results(images.size(), no_result);
+  if(node_count == 0 || images.empty())
+  {
+    return results;
+  }
+
+  if(!options.isExact())
+  {
+    std::vector<long> positions(images.size());
+    for(std::size_t i = 0; i < positions.size(); ++i)
+    {
+      positions[i] = i;
+    }
+    QtConcurrent::blockingMap(positions, [&](long& position)
+    {
+      results[position] = search(images[position], options);
+    });
+    return results;
+  }
+
+  std::vector<float> descriptors;
+  descriptors.reserve(images.size() * dimension);
+  for(std::vector<std::vector<float> >::const_iterator it = images.begin(); it != images.end(); ++it)
+  {
+    if(static_cast<long>(it->size()) != dimension)
+    {
+      throw std::runtime_error("Bad thumbnail size");
+    }
+    descriptors.insert(descriptors.end(), it->begin(), it->end());
+  }
+
+  AntipoleTree queries;
+  queries.setConversionMethod(conversion_method);
+  queries.setDescriptorStorage(descriptor_storage);
+  queries.setDescriptorCascade(descriptor_cascade);
+  queries.build(descriptors, dimension, query_minimum_size);
+
+  DualTreeState state;
+  state.closest.assign(images.size(), -1);
+  state.distances.assign(images.size(), std::numeric_limits<float>::max());
+  state.bounds.assign(queries.node_count, std::numeric_limits<float>::max());
+  state.node_statistics.resize(queries.node_count);
+  state.statistics.resize(images.size());
+
+  // Query subtrees update disjoint parts of the state, so they are searched in parallel
+  std::vector<long> query_nodes(1, 0);
+  long minimum_jobs = 4 * QThreadPool::globalInstance()->maxThreadCount();
+  bool split = true;
+  while(split && static_cast<long>(query_nodes.size()) < minimum_jobs)
+  {
+    split = false;
+    std::vector<long> children;
+    for(std::vector<long>::const_iterator it = query_nodes.begin(); it != query_nodes.end(); ++it)
+    {
+      const AntipoleNode& query_node = queries.node_data[*it];
+      if(query_node.isLeaf())
+      {
+        children.push_back(*it);
+      }
+      else
+      {
+        children.push_back(query_node.left);
+        children.push_back(query_node.right);
+        split = true;
+      }
+    }
+    query_nodes.swap(children);
+  }
+  QtConcurrent::blockingMap(query_nodes, [&](long& query_node)
+  {
+    dualTreeSearch(queries, query_node, 0, state);
+  });
+
+  // The work done for a query node is shared by the queries below it, it is counted once with the first of them
+  std::vector<long> stack(1, 0);
+  while(!stack.empty())
+  {
+    long query_node = stack.back();
+    stack.pop_back();
+    const AntipoleNode& current_query = queries.node_data[query_node];
+    const SearchStatistics& node_statistics = state.node_statistics[query_node];
+    if(current_query.isLeaf())
+    {
+      if(current_query.begin < current_query.end)
+      {
+        state.statistics[current_query.begin] += node_statistics;
+      }
+    }
+    else
+    {
+      state.node_statistics[current_query.left] += node_statistics;
+      stack.push_back(current_query.left);
+      stack.push_back(current_query.right);
+    }
+  }
+
+  for(std::size_t i = 0; i < state.closest.size(); ++i)
+  {
+    SearchResult& result = results[queries.index_data[i]];
+    result.statistics = state.statistics[i];
+    result.statistics.queries = 1;
+    if(state.closest[i] >= 0)
+    {
+      result.index = index_data[state.closest[i]];
+      result.distance = state.distances[i];
+    }
+  }
+  return results;
+}
+
+float AntipoleTree::minimumDistance(long node, const AntipoleTree& queries, long query_node) const
+{
+  float distance = std::sqrt(HelperFunctions::distance2(queries.getCenter(query_node), getCenter(node), dimension)) - queries.node_data[query_node].radius - node_data[node].radius;
+  return distance > 0 ? distance * distance : 0;
+}
+
+void AntipoleTree::dualTreeSearch(const AntipoleTree& queries, long query_node, long node, DualTreeState& state) const
+{
+  SearchStatistics& statistics = state.node_statistics[query_node];
+  ++statistics.distances;
+  if(minimumDistance(node, queries, query_node) >= state.bounds[query_node])
+  {
+    ++statistics.pruned_subtrees;
+    return;
+  }
+  ++statistics.visited_nodes;
+
+  const AntipoleNode& current_query = queries.node_data[query_node];
+  const AntipoleNode& current = node_data[node];
+  if(current_query.isLeaf() && current.isLeaf())
+  {
+    dualTreeLeaves(queries, query_node, node, state);
+  }
+  else if(current_query.isLeaf() || (!current.isLeaf() && current.radius > current_query.radius))
+  {
+    float left_distance = minimumDistance(current.left, queries, query_node);
+    float right_distance = minimumDistance(current.right, queries, query_node);
+    statistics.distances += 2;
+    long first = left_distance <= right_distance ? current.left : current.right;
+    long second = left_distance <= right_distance ? current.right : current.left;
+    dualTreeSearch(queries, query_node, first, state);
+    dualTreeSearch(queries, query_node, second, state);
+  }
+  else
+  {
+    dualTreeSearch(queries, current_query.left, node, state);
+    dualTreeSearch(queries, current_query.right, node, state);
+    state.bounds[query_node] = std::max(state.bounds[current_query.left], state.bounds[current_query.right]);
+  }
+}
+
+void AntipoleTree::dualTreeLeaves(const AntipoleTree& queries, long query_node, long node, DualTreeState& state) const
+{
+  const AntipoleNode& current_query = queries.node_data[query_node];
+  const AntipoleNode& current = node_data[node];
+  float bound = 0;
+  float closest_bound = std::numeric_limits<float>::max();
+
+  long previous = -1;
+  std::vector<float>& image = getThreadContext().descriptor;
+  image.resize(dimension);
+
+  for(long i = current_query.begin; i < current_query.end; ++i)
+  {
+    const uchar* code = queries.getCode(i);
+    float& mindist = state.distances[i];
+    SearchStatistics& statistics = state.statistics[i];
+    if(state.closest[i] < 0 && previous >= 0)
+    {
+      // Neighbouring queries are similar, the previous match is a good first candidate
+      mindist = codeDistance(code, getCode(previous), std::numeric_limits<float>::max());
+      state.closest[i] = previous;
+      ++statistics.distances;
+    }
+    queries.decode(code, &image[0]);
+    ++statistics.distances;
+    if(minimumDistance(node, &image[0]) < mindist)
+    {
+      statistics.leaf_members += current.end - current.begin;
+      statistics.distances += current.end - current.begin;
+      std::pair<long, float> best_pair = leaf_scan(*this, code, current.begin, current.end, mindist);
+      if(best_pair.first >= 0)
+      {
+        state.closest[i] = best_pair.first;
+        mindist = best_pair.second;
+      }
+    }
+    previous = state.closest[i];
+    bound = std::max(bound, mindist);
+    closest_bound = std::min(closest_bound, mindist);
+  }
+  // Every query of the leaf is at most twice the radius away from the query with the closest match
+  float neighbour_bound = std::sqrt(closest_bound) + 2 * current_query.radius;
+  state.bounds[query_node] = std::min(bound, neighbour_bound * neighbour_bound);
+}
+
+std::vector<float> AntipoleTree::convert(const QImage& image) const
+{
+  return ColorConversion::convert(image, conversion_method);
+}
+
+void AntipoleTree::convert(const QImage& image, float* descriptor) const
+{
+  ColorConversion::convert(image, conversion_method, descriptor);
+}
+
+long AntipoleTree::getClosestThumbnail(const QImage& image) const
+{
+  return getClosestThumbnail(image, getThreadContext());
+}
+
+long AntipoleTree::getClosestThumbnail(const QImage& image, SearchContext& context) const
+{
+  if(node_count == 0)
+  {
+    return -1;
+  }
+  if(3 * image.width() * image.height() != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+  context.descriptor.resize(dimension);
+  convert(image, &context.descriptor[0]);
+  return search(&context.descriptor[0], SearchOptions(), context).index;
+}
+
+SearchContext& AntipoleTree::getThreadContext()
+{
+  if(!search_contexts.hasLocalData())
+  {
+    search_contexts.setLocalData(new SearchContext);
+  }
+  return *search_contexts.localData();
+}
+
+long AntipoleTree::buildNode(BuildState& state, AntipoleSubtree& fragment, long begin, long end)
+{
+  long position = fragment.nodes.size();
+  AntipoleNode node;
+  node.left = -1;
+  node.right = -1;
+  node.begin = begin;
+  node.end = end;
+  node.capacity = end;
+  std::vector<float> center = computeCenter(state, begin, end);
+  node.radius = computeMaxRadius(state, &center[0], begin, end);
+  fragment.nodes.push_back(node);
+  fragment.centers.insert(fragment.centers.end(), center.begin(), center.end());
+
+  if (end - begin > state.minimum_size)
+  {
+    long middle = divideMatching(state, begin, end);
+    if(middle > begin && middle < end)
+    {
+      long right = -1;
+      if(end - middle >= build_task_size && state.pool.maxThreadCount() > 1)
+      {
+        AntipoleSubtree* right_fragment;
+        right = -2 - state.addFragment(right_fragment);
+        state.pool.start(new FunctionTask([this, &state, right_fragment, middle, end]()
+        {
+          buildNode(state, *right_fragment, middle, end);
+        }));
+      }
+      long left = buildNode(state, fragment, begin, middle);
+      if(right == -1)
+      {
+        right = buildNode(state, fragment, middle, end);
+      }
+      fragment.nodes[position].left = left;
+      fragment.nodes[position].right = right;
+    }
+  }
+  return position;
+}
+
+long AntipoleTree::joinFragment(const BuildState& state, AntipoleSubtree& tree, const AntipoleSubtree& fragment, long node) const
+{
+  long position = tree.nodes.size();
+  const AntipoleNode& current = fragment.nodes[node];
+  tree.nodes.push_back(current);
+  tree.centers.insert(tree.centers.end(), fragment.centers.begin() + node * dimension, fragment.centers.begin() + (node + 1) * dimension);
+
+  if(!current.isLeaf())
+  {
+    long left = joinFragment(state, tree, fragment, current.left);
+    long right = current.right < -1 ? joinFragment(state, tree, *state.fragments[-2 - current.right], 0) : joinFragment(state, tree, fragment, current.right);
+    tree.nodes[position].left = left;
+    tree.nodes[position].right = right;
+  }
+  return position;
+}
+
+void AntipoleTree::insert(const std::vector<float>& thumbnail, long index)
+{
+  if(node_count == 0)
+  {
+    build(thumbnail, thumbnail.size());
+    thumbnail_indices[0] = index;
+    setStorage();
+    return;
+  }
+  if(static_cast<long>(thumbnail.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+  prepareUpdates();
+  std::vector<float> stored(dimension);
+  quantize(&thumbnail[0], &stored[0], dimension);
+
+  for(std::vector<qint32>::iterator it = thumbnail_indices.begin(); it != thumbnail_indices.end(); ++it)
+  {
+    if(*it >= index)
+    {
+      ++(*it);
+    }
+  }
+
+  std::vector<long> path;
+  long node = 0;
+  while(true)
+  {
+    path.push_back(node);
+    AntipoleNode& current = nodes[node];
+    current.radius = std::max(current.radius, std::sqrt(HelperFunctions::distance2(&stored[0], getCenter(node), dimension)));
+    if(current.isLeaf())
+    {
+      break;
+    }
+    node = HelperFunctions::distance2(&stored[0], getCenter(current.left), dimension) <= HelperFunctions::distance2(&stored[0], getCenter(current.right), dimension) ? current.left : current.right;
+  }
+
+  if(nodes[node].end == nodes[node].capacity)
+  {
+    relocateLeaf(node, 2 * (nodes[node].end - nodes[node].begin) + 1);
+  }
+  AntipoleNode& leaf = nodes[node];
+  encode(&stored[0], &codes[leaf.end * getCodeSize()]);
+  thumbnail_indices[leaf.end] = index;
+  ++leaf.end;
+  setStorage();
+
+  checkPath(path);
+}
+
+void AntipoleTree::remove(long index)
+{
+  if(node_count == 0)
+  {
+    return;
+  }
+  prepareUpdates();
+
+  std::vector<qint32>::iterator position = std::find(thumbnail_indices.begin(), thumbnail_indices.end(), index);
+  if(position == thumbnail_indices.end())
+  {
+    return;
+  }
+  long removed = position - thumbnail_indices.begin();
+  long node = -1;
+  for(long i = 0; i < node_count; ++i)
+  {
+    if(nodes[i].isLeaf() && nodes[i].begin <= removed && removed < nodes[i].end)
+    {
+      node = i;
+      break;
+    }
+  }
+
+  AntipoleNode& leaf = nodes[node];
+  --leaf.end;
+  long code_size = getCodeSize();
+  std::copy(codes.begin() + leaf.end * code_size, codes.begin() + (leaf.end + 1) * code_size, codes.begin() + removed * code_size);
+  thumbnail_indices[removed] = thumbnail_indices[leaf.end];
+  thumbnail_indices[leaf.end] = -1;
+
+  for(std::vector<qint32>::iterator it = thumbnail_indices.begin(); it != thumbnail_indices.end(); ++it)
+  {
+    if(*it > index)
+    {
+      --(*it);
+    }
+  }
+  setStorage();
+
+  checkPath(getPath(node));
+}
+
+void AntipoleTree::prepareUpdates()
+{
+  detach();
+  if(static_cast<long>(parents.size()) == node_count)
+  {
+    return;
+  }
+
+  parents.assign(node_count, -1);
+  std::vector<long> sizes(node_count, 0);
+  computeSizes(0, sizes);
+  long previous = built_sizes.size();
+  built_sizes.resize(node_count, 0);
+  updates.resize(node_count, 0);
+  for(long i = previous; i < node_count; ++i)
+  {
+    built_sizes[i] = sizes[i];
+  }
+}
+
+long AntipoleTree::computeSizes(long node, std::vector<long>& sizes)
+{
+  const AntipoleNode& current = nodes[node];
+  if(current.isLeaf())
+  {
+    sizes[node] = current.end - current.begin;
+  }
+  else
+  {
+    parents[current.left] = node;
+    parents[current.right] = node;
+    sizes[node] = computeSizes(current.left, sizes) + computeSizes(current.right, sizes);
+  }
+  return sizes[node];
+}
+
+std::vector<long> AntipoleTree::getPath(long node) const
+{
+  std::vector<long> path;
+  for(; node >= 0; node = parents[node])
+  {
+    path.push_back(node);
+  }
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+void AntipoleTree::checkPath(const std::vector<long>& path)
+{
+  for(std::vector<long>::const_iterator it = path.begin(); it != path.end(); ++it)
+  {
+    ++updates[*it];
+  }
+
+  // A subtree that changed too much since it was built is rebuilt as a whole
+  for(std::vector<long>::const_iterator it = path.begin(); it != path.end(); ++it)
+  {
+    if(built_sizes[*it] >= minimum_size && 2 * updates[*it] > built_sizes[*it])
+    {
+      rebuildNode(*it);
+      return;
+    }
+  }
+
+  long leaf = path.back();
+  long size = nodes[leaf].end - nodes[leaf].begin;
+  if(size > 2 * minimum_size)
+  {
+    rebuildNode(leaf);
+  }
+  else if(4 * size < minimum_size && path.size() > 1)
+  {
+    long parent = path[path.size() - 2];
+    long sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+    if(nodes[sibling].isLeaf())
+    {
+      rebuildNode(parent);
+    }
+  }
+}
+
+void AntipoleTree::relocateLeaf(long node, long capacity)
+{
+  AntipoleNode& leaf = nodes[node];
+  long begin = thumbnail_indices.size();
+  long code_size = getCodeSize();
+  codes.resize((begin + capacity) * code_size, 0);
+  thumbnail_indices.resize(begin + capacity, -1);
+  std::copy(codes.begin() + leaf.begin * code_size, codes.begin() + leaf.end * code_size, codes.begin() + begin * code_size);
+  std::copy(thumbnail_indices.begin() + leaf.begin, thumbnail_indices.begin() + leaf.end, thumbnail_indices.begin() + begin);
+  std::fill(thumbnail_indices.begin() + leaf.begin, thumbnail_indices.begin() + leaf.capacity, -1);
+  garbage += leaf.capacity - leaf.begin;
+
+  leaf.end = begin + leaf.end - leaf.begin;
+  leaf.begin = begin;
+  leaf.capacity = begin + capacity;
+}
+
+void AntipoleTree::releaseNode(long node, std::vector<float>& thumbnails, std::vector<long>& indices)
+{
+  AntipoleNode& current = nodes[node];
+  if(!current.isLeaf())
+  {
+    releaseNode(current.left, thumbnails, indices);
+    releaseNode(current.right, thumbnails, indices);
+    return;
+  }
+  long offset = thumbnails.size();
+  thumbnails.resize(offset + (current.end - current.begin) * dimension);
+  for(long i = current.begin; i < current.end; ++i)
+  {
+    decode(getCode(i), &thumbnails[offset + (i - current.begin) * dimension]);
+  }
+  indices.insert(indices.end(), thumbnail_indices.begin() + current.begin, thumbnail_indices.begin() + current.end);
+  std::fill(thumbnail_indices.begin() + current.begin, thumbnail_indices.begin() + current.capacity, -1);
+  garbage += current.capacity - current.begin;
+}
+
+void AntipoleTree::rebuildNode(long node)
+{
+  std::vector<float> released_thumbnails;
+  std::vector<long> released_indices;
+  releaseNode(node, released_thumbnails, released_indices);
+
+  AntipoleTree subtree;
+  subtree.setConversionMethod(conversion_method);
+  subtree.setDescriptorStorage(descriptor_storage);
+  subtree.setDescriptorCascade(descriptor_cascade);
+  subtree.build(released_thumbnails, dimension);
+
+  long positions = thumbnail_indices.size();
+  if(subtree.node_count == 0)
+  {
+    AntipoleNode& leaf = nodes[node];
+    leaf.left = -1;
+    leaf.right = -1;
+    leaf.begin = positions;
+    leaf.end = positions;
+    leaf.capacity = positions;
+    leaf.radius = 0;
+  }
+  else
+  {
+    // The root of the subtree replaces the node, the other nodes are appended
+    long offset = nodes.size() - 1;
+    for(long i = 0; i < subtree.node_count; ++i)
+    {
+      AntipoleNode new_node = subtree.node_data[i];
+      if(!new_node.isLeaf())
+      {
+        new_node.left += offset;
+        new_node.right += offset;
+      }
+      new_node.begin += positions;
+      new_node.end += positions;
+      new_node.capacity += positions;
+      if(i == 0)
+      {
+        nodes[node] = new_node;
+        std::copy(subtree.getCenter(i), subtree.getCenter(i) + dimension, centers.begin() + node * dimension);
+      }
+      else
+      {
+        nodes.push_back(new_node);
+        centers.insert(centers.end(), subtree.getCenter(i), subtree.getCenter(i) + dimension);
+      }
+    }
+    codes.insert(codes.end(), subtree.code_data, subtree.code_data + subtree.thumbnail_count * getCodeSize());
+    for(long i = 0; i < subtree.thumbnail_count; ++i)
+    {
+      thumbnail_indices.push_back(released_indices[subtree.index_data[i]]);
+    }
+  }
+  setStorage();
+
+  prepareUpdates();
+  built_sizes[node] = released_indices.size();
+  updates[node] = 0;
+
+  if(2 * garbage > thumbnail_count)
+  {
+    compact();
+  }
+}
+
+void AntipoleTree::compact()
+{
+  if(node_count == 0)
+  {
+    return;
+  }
+  detach();
+
+  std::vector<AntipoleNode> new_nodes;
+  std::vector<float> new_centers;
+  std::vector<uchar> new_codes;
+  std::vector<qint32> new_indices;
+  std::vector<long> mapping(node_count, -1);
+  compactNode(0, new_nodes, new_centers, new_codes, new_indices, mapping);
+
+  std::vector<long> new_built_sizes(new_nodes.size(), 0);
+  std::vector<long> new_updates(new_nodes.size(), 0);
+  for(long i = 0; i < static_cast<long>(mapping.size()) && i < static_cast<long>(built_sizes.size()); ++i)
+  {
+    if(mapping[i] >= 0)
+    {
+      new_built_sizes[mapping[i]] = built_sizes[i];
+      new_updates[mapping[i]] = updates[i];
+    }
+  }
+
+  nodes.swap(new_nodes);
+  centers.swap(new_centers);
+  codes.swap(new_codes);
+  thumbnail_indices.swap(new_indices);
+  parents.clear();
+  built_sizes.clear();
+  updates.clear();
+  garbage = 0;
+  setStorage();
+
+  prepareUpdates();
+  built_sizes.swap(new_built_sizes);
+  updates.swap(new_updates);
+}
+
+void AntipoleTree::compactNode(long node, std::vector<AntipoleNode>& new_nodes, std::vector<float>& new_centers, std::vector<uchar>& new_codes, std::vector<qint32>& new_indices, std::vector<long>& mapping) const
+{
+  long new_node = new_nodes.size();
+  mapping[node] = new_node;
+  new_nodes.push_back(node_data[node]);
+  new_centers.insert(new_centers.end(), getCenter(node), getCenter(node) + dimension);
+
+  const AntipoleNode& current = node_data[node];
+  long begin = new_indices.size();
+  if(current.isLeaf())
+  {
+    new_codes.insert(new_codes.end(), getCode(current.begin), getCode(current.end));
+    new_indices.insert(new_indices.end(), index_data + current.begin, index_data + current.end);
+  }
+  else
+  {
+    compactNode(current.left, new_nodes, new_centers, new_codes, new_indices, mapping);
+    new_nodes[new_node].left = mapping[current.left];
+    compactNode(current.right, new_nodes, new_centers, new_codes, new_indices, mapping);
+    new_nodes[new_node].right = mapping[current.right];
+  }
+  new_nodes[new_node].begin = begin;
+  new_nodes[new_node].end = new_indices.size();
+  new_nodes[new_node].capacity = new_indices.size();
+}
+
+long AntipoleTree::divideMatching(BuildState& state, long begin, long end)
+{
+  long size = end - begin;
+  long chunk_count = (size + parallel_chunk_size - 1) / parallel_chunk_size;
+  if(chunk_count > 1)
+  {
+    // Chunks run their own tournaments, their survivors play the final rounds
+    parallelFor(state.pool, chunk_count, [&](long chunk)
+    {
+      long chunk_begin = begin + chunk * parallel_chunk_size;
+      HelperFunctions::approxAntipole(&thumbnails[0], dimension, indices.begin() + chunk_begin, indices.begin() + std::min(end, chunk_begin + parallel_chunk_size));
+    });
+    size = 0;
+    for(long chunk = 0; chunk < chunk_count; ++chunk)
+    {
+      long chunk_begin = begin + chunk * parallel_chunk_size;
+      long survivors = std::min<long>(2, end - chunk_begin);
+      for(long i = 0; i < survivors; ++i)
+      {
+        std::swap(indices[begin + size++], indices[chunk_begin + i]);
+      }
+    }
+  }
+  std::pair<long, long> pair = HelperFunctions::approxAntipole(&thumbnails[0], dimension, indices.begin() + begin, indices.begin() + begin + size);
+  return assignMatching(state, begin, end, &thumbnails[pair.first * dimension], &thumbnails[pair.second * dimension]);
+}
+
+long AntipoleTree::assignMatching(BuildState& state, long begin, long end, const float* left_center, const float* right_center)
+{
+  // While building, thumbnails are still in database order
+  auto closer_to_left = [&](long index)
+  {
+    const float* thumbnail = &thumbnails[index * dimension];
+    return HelperFunctions::distance2(thumbnail, left_center, dimension) <= HelperFunctions::distance2(thumbnail, right_center, dimension);
+  };
+
+  long chunk_count = (end - begin + parallel_chunk_size - 1) / parallel_chunk_size;
+  if(chunk_count < 2)
+  {
+    return std::partition(indices.begin() + begin, indices.begin() + end, closer_to_left) - indices.begin();
+  }
+
+  // Chunks are partitioned in parallel, then their halves are gathered on each side of the middle
+  std::vector<long> left_sizes(chunk_count);
+  parallelFor(state.pool, chunk_count, [&](long chunk)
+  {
+    std::vector<long>::iterator chunk_begin = indices.begin() + begin + chunk * parallel_chunk_size;
+    std::vector<long>::iterator chunk_end = indices.begin() + std::min(end, begin + (chunk + 1) * parallel_chunk_size);
+    left_sizes[chunk] = std::partition(chunk_begin, chunk_end, closer_to_left) - chunk_begin;
+  });
+
+  std::vector<long> left_offsets(chunk_count);
+  std::vector<long> right_offsets(chunk_count);
+  long left_size = 0;
+  for(long chunk = 0; chunk < chunk_count; ++chunk)
+  {
+    left_offsets[chunk] = left_size;
+    left_size += left_sizes[chunk];
+  }
+  long right_size = left_size;
+  for(long chunk = 0; chunk < chunk_count; ++chunk)
+  {
+    right_offsets[chunk] = right_size;
+    right_size += std::min(end, begin + (chunk + 1) * parallel_chunk_size) - begin - chunk * parallel_chunk_size - left_sizes[chunk];
+  }
+
+  std::vector<long> partitioned(end - begin);
+  parallelFor(state.pool, chunk_count, [&](long chunk)
+  {
+    std::vector<long>::const_iterator chunk_begin = indices.begin() + begin + chunk * parallel_chunk_size;
+    std::vector<long>::const_iterator chunk_end = indices.begin() + std::min(end, begin + (chunk + 1) * parallel_chunk_size);
+    std::copy(chunk_begin, chunk_begin + left_sizes[chunk], partitioned.begin() + left_offsets[chunk]);
+    std::copy(chunk_begin + left_sizes[chunk], chunk_end, partitioned.begin() + right_offsets[chunk]);
+  });
+  std::copy(partitioned.begin(), partitioned.end(), indices.begin() + begin);
+  return begin + left_size;
+}
+
+float AntipoleTree::computeMaxRadius(BuildState& state, const float* center, long begin, long end) const
+{
+  long chunk_count = (end - begin + parallel_chunk_size - 1) / parallel_chunk_size;
+  std::vector<float> radii(chunk_count, 0);
+  parallelFor(state.pool, chunk_count, [&](long chunk)
+  {
+    long chunk_end = std::min(end, begin + (chunk + 1) * parallel_chunk_size);
+    for(long i = begin + chunk * parallel_chunk_size; i < chunk_end; ++i)
+    {
+      radii[chunk] = std::max(radii[chunk], HelperFunctions::distance2(center, &thumbnails[indices[i] * dimension], dimension));
+    }
+  });
+  return std::sqrt(*std::max_element(radii.begin(), radii.end()));
+}
+
+std::vector<float> AntipoleTree::computeCenter(BuildState& state, long begin, long end) const
+{
+  long chunk_count = (end - begin + parallel_chunk_size - 1) / parallel_chunk_size;
+  std::vector<std::vector<float> > sums(chunk_count, std::vector<float>(dimension, 0));
+  parallelFor(state.pool, chunk_count, [&](long chunk)
+  {
+    std::vector<float>& sum = sums[chunk];
+    long chunk_end = std::min(end, begin + (chunk + 1) * parallel_chunk_size);
+    for(long i = begin + chunk * parallel_chunk_size; i < chunk_end; ++i)
+    {
+      const float* thumbnail = &thumbnails[indices[i] * dimension];
+      for(long j = 0; j < dimension; ++j)
+      {
+        sum[j] += thumbnail[j];
+      }
+    }
+  });
+
+  std::vector<float> center(dimension, 0);
+  for(long chunk = 0; chunk < chunk_count; ++chunk)
+  {
+    for(long j = 0; j < dimension; ++j)
+    {
+      center[j] += sums[chunk][j];
+    }
+  }
+  for(std::vector<float>::iterator it = center.begin(); it != center.end(); ++it)
+  {
+    *it /= (end - begin);
+  }
+  return center;
+}
+
+float HelperFunctions::distance2(const float* object1, const float* object2, long size)
+{
+  return DistanceKernels::distance2(object1, object2, size);
+}
+
+float HelperFunctions::distance2(const std::vector<float>& object1, const std::vector<float>& object2)
+{
+  return distance2(&object1[0], &object2[0], std::min(object1.size(), object2.size()));
+}
+
+long HelperFunctions::median1(const float* objects, long dimension, const long* tournament, long size)
+{
+  if(size == 0)
+  {
+    throw std::runtime_error("Empty set for 1-median algorithm");
+  }
+
+  long median = 0;
+  float min_dist = std::numeric_limits<float>::max();
+  for(long i = 0; i < size; ++i)
+  {
+    float dist = 0;
+    for(long j = 0; j < size; ++j)
+    {
+      if(j != i)
+      {
+        dist += std::sqrt(distance2(objects + tournament[i] * dimension, objects + tournament[j] * dimension, dimension));
+      }
+    }
+    if(dist < min_dist)
+    {
+      min_dist = dist;
+      median = i;
+    }
+  }
+  return median;
+}
+
+std::pair<long, long> HelperFunctions::approxAntipole(const float* objects, long dimension, std::vector<long>::iterator begin, std::vector<long>::iterator end)
+{
+  // Each round drops the median of every tournament and moves the others to the front of the range,
+  // so that the range shrinks geometrically and the last two survivors are far apart
+  long size = end - begin;
+  while(size > 2)
+  {
+    long survivors = 0;
+    long i = 0;
+    for(; i + tournament_size <= size; i += tournament_size)
+    {
+      long median = median1(objects, dimension, &begin[i], tournament_size);
+      for(long j = 0; j < tournament_size; ++j)
+      {
+        if(j != median)
+        {
+          std::swap(begin[survivors++], begin[i + j]);
+        }
+      }
+    }
+    for(; i < size; ++i)
+    {
+      std::swap(begin[survivors++], begin[i]);
+    }
+    size = survivors;
+  }
+  return std::make_pair(begin[0], begin[size - 1]);
+}
+
+std::vector<float> HelperFunctions::convert_rgb(const QImage& image)
+{
+  std::vector<float> thumbnail;
+  
+  for(int j = 0; j < image.height(); ++j)
+  {
+    for(int i = 0; i < image.width(); ++i)
+    {
+      QRgb pixel = image.pixel(i, j);
+      thumbnail.push_back(qRed(pixel));
+      thumbnail.push_back(qBlue(pixel));
+      thumbnail.push_back(qGreen(pixel));
+    }
+  }
+  
+  return thumbnail;
+}
+
+static float pivotRGB(float n)
+{
+  return (n > 0.04045 ? std::pow((n + 0.055) / 1.055, 2.4) : n / 12.92) * 100;
+}
+
+static float pivotXYZ(float n)
+{
+  return (n > 0.008856 ? std::pow(n, 1. / 3.) : (903.3 * n + 16) / 116);
+}
+
+void convertRGB2XYZ(float r, float g, float b, float& x, float& y, float& z)
+{
+  float x_ref= 95.047;
+  float y_ref = 100;
+  float z_ref = 108.883;
+  x = pivotXYZ(r * 0.4124 + g * 0.3576 + b * 0.1805) / x_ref;
+  y = pivotXYZ(r * 0.2126 + g * 0.7152 + b * 0.0722) / y_ref;
+  z = pivotXYZ(r * 0.0193 + g * 0.1192 + b * 0.9505) / z_ref;
+}
+
+void convertXYZ2LAB(float x, float y, float z, float& l, float& a, float& b)
+{
+  l = std::max(0., 116. * y - 16);
+  a = 500 * (x - y);
+  b = 200 * (y - z);
+}
+
+void convertRGB2LAB(float red, float green, float blue, float& l, float& a, float& b)
+{
+  float x, y, z;
+  convertRGB2XYZ(red, green, blue, x, y, z);
+  convertXYZ2LAB(x, y, z, l, a, b);
+}
+
+void convertAB2CH(float a, float b, float& c, float& h)
+{
+  h = std::atan2(b, a) / M_PI * 180;
+  c = std::sqrt(a*a + b*b);
+}
+
+void convertRGB2LCH(float red, float green, float blue, float& l, float& c, float& h)
+{
+  float x, y, z, a, b;
+  convertRGB2XYZ(red, green, blue, x, y, z);
+  convertXYZ2LAB(x, y, z, l, a, b);
+  convertAB2CH(a, b, c, h);
+}
+
+std::vector<float> HelperFunctions::convert_lab(const QImage& image)
+{
+  std::vector<float> thumbnail;
+  
+  for(int j = 0; j < image.height(); ++j)
+  {
+    for(int i = 0; i < image.width(); ++i)
+    {
+      QRgb pixel = image.pixel(i, j);
+      
+      float red = pivotRGB(qRed(pixel));
+      float green = pivotRGB(qGreen(pixel));
+      float blue = pivotRGB(qBlue(pixel));
+      
+      float l, a, b;
+      
+      convertRGB2LAB(red, green, blue, l, a, b);
+      
+      thumbnail.push_back(l);
+      thumbnail.push_back(a);
+      thumbnail.push_back(b);
+    }
+  }
+  
+  return thumbnail;
+}
+
+std::vector<float> HelperFunctions::convert_lch(const QImage& image)
+{
+  std::vector<float> thumbnail;
+  
+  for(int j = 0; j < image.height(); ++j)
+  {
+    for(int i = 0; i < image.width(); ++i)
+    {
+      QRgb pixel = image.pixel(i, j);
+      
+      float red = pivotRGB(qRed(pixel));
+      float green = pivotRGB(qGreen(pixel));
+      float blue = pivotRGB(qBlue(pixel));
+      
+      float l, c, h;
+      
+      convertRGB2LCH(red, green, blue, l, c, h);
+      
+      thumbnail.push_back(l);
+      thumbnail.push_back(c);
+      thumbnail.push_back(h);
+    }
+  }
+  
+  return thumbnail;
+}
@@ -6,110 +6,262 @@
 #define ANTIPOLETREE
 
 #include <vector>
-#include <set>
-#include <map>
 #include <qimage.h>
+#include <QtCore/qfile.h>
 
-class AntipoleTree;
+#include "ThumbnailIndex.h"
 
-typedef std::set<long> MatchingThumbnails;
-class AntipoleNode;
-typedef std::multimap<float, AntipoleNode*> NodeMap;
-
-class AntipoleNode
+/**
+ * A node of the flattened tree. Internal nodes reference their children by index in the node array,
+ * leaves reference a contiguous range of the thumbnails, which are stored in leaf order.
+ * A leaf may grow until its capacity before it has to be moved, only leaf ranges are kept up to date by updates.
+ */
+struct AntipoleNode
 {
-protected:
-  const AntipoleTree* tree;
+  qint32 left;
+  qint32 right;
+  qint32 begin;
+  qint32 end;
+  qint32 capacity;
   float radius;
-  std::vector<float> center;
-public:
-  AntipoleNode(const AntipoleTree* tree);
-  virtual ~AntipoleNode();
 
-  void setCenter(const std::vector<float>& center);
-  const std::vector<float>& getCenter() const
-  {
-    return center;
-  }
-  void setRadius(float radius);
-  float getRadius() const
+  bool isLeaf() const
   {
-    return radius;
+    return left < 0;
   }
-  float minimumDistance(const std::vector<float>& image) const;
-
-  virtual bool isLeaf() const = 0;
-  virtual std::pair<long, float> getClosestThumbnail(const std::vector<float>& image, float max_dist) const = 0;
-  virtual std::pair<long, float> visitNode(const std::vector<float>& image, float max_dist, NodeMap& node_map) const = 0;
 };
 
-class AntipoleInternalNode: public AntipoleNode
+/**
+ * How the thumbnails of a built tree are stored. Quantized thumbnails are stored on 8 bits for RGB
+ * and as 16 bits fixed point numbers for L*a*b and L*c*h, and are compared with integer kernels.
+ */
+enum DescriptorStorage
 {
-  AntipoleNode* left;
-  AntipoleNode* right;
-
-  std::pair<long, float> getBestSubnode(const AntipoleNode* node, const std::vector<float>& image, const std::pair<long, float>& current_best) const;
-public:
-  AntipoleInternalNode(const AntipoleTree* tree);
-  virtual ~AntipoleInternalNode();
+  FloatStorage = 0,
+  QuantizedStorage
+};
 
-  void setLeft(AntipoleNode* left);
-  void setRight(AntipoleNode* right);
+/// Min-heap of (lower bound, node) of the nodes left to visit
+typedef std::vector<std::pair<float, long> > NodeHeap;
+/// Max-heap of (distance, position) of the best candidates of a k-nearest neighbours query
+typedef std::vector<std::pair<float, long> > CandidateHeap;
 
-  virtual bool isLeaf() const;
-  virtual std::pair<long, float> getClosestThumbnail(const std::vector<float>& image, float max_dist) const;
-  virtual std::pair<long, float> visitNode(const std::vector<float>& image, float max_dist, NodeMap& node_map) const;
+/**
+ * Scratch memory of the queries of a thread. Buffers keep their capacity from one query to the next,
+ * so that queries stop allocating once the first ones have run.
+ */
+struct SearchContext
+{
+  std::vector<float> descriptor;
+  /// The query as its code stores it, node bounds are computed from it
+  std::vector<float> query;
+  std::vector<uchar> code;
+  NodeHeap nodes;
+  CandidateHeap candidates;
 };
 
-class AntipoleLeaf: public AntipoleNode
+/**
+ * Shape of a built tree
+ */
+struct TreeStatistics
 {
-  MatchingThumbnails matching_thumbnails;
-public:
-  AntipoleLeaf(const AntipoleTree* tree);
-  virtual ~AntipoleLeaf();
+  long nodes;
+  long leaves;
+  long depth;
+  /// Number of leaves holding [2^i, 2^(i+1)) thumbnails, empty leaves are counted with the first bucket
+  std::vector<long> leaf_sizes;
+  /// Mean radius of the nodes at each depth
+  std::vector<float> radii;
+};
 
-  virtual bool isLeaf() const;
-  virtual std::pair<long, float> getClosestThumbnail(const std::vector<float>& image, float max_dist) const;
-  virtual std::pair<long, float> visitNode(const std::vector<float>& image, float max_dist, NodeMap& node_map) const;
-  void setMatching(const MatchingThumbnails& inner_thumbnails);
+/**
+ * A fragment of a tree being built: nodes are indexed from its root (0), centers are packed by node index.
+ */
+struct AntipoleSubtree
+{
+  std::vector<AntipoleNode> nodes;
+  std::vector<float> centers;
 };
 
-class AntipoleTree
+struct DualTreeState;
+struct BuildState;
+
+class AntipoleTree : public ThumbnailIndex
 {
   static const long minimum_size;
-  std::vector<std::vector<float> > thumbnails;
-  AntipoleNode* root;
+  static const long query_minimum_size;
+  static const long build_task_size;
+  static const long parallel_chunk_size;
+  static const float quantization_scale;
+  long dimension;
+  // Thumbnails in database order while the tree is built
+  std::vector<float> thumbnails;
+  std::vector<long> indices;
+  std::vector<AntipoleNode> nodes;
+  std::vector<float> centers;
+  std::vector<uchar> codes;
+  std::vector<qint32> thumbnail_indices;
   int conversion_method;
+  // The storage asked for, and the one of the built tree, which falls back to float when the integer sums could overflow
+  DescriptorStorage requested_storage;
+  DescriptorStorage descriptor_storage;
+
+  // Coarse levels stored in front of each code, coarsest first, with the weights that make them lower bounds
+  bool descriptor_cascade;
+  std::vector<long> cascade_sides;
+  std::vector<float> cascade_weights;
+  long cascade_size;
+
+  // Leaf scans are specialized on the dimension of the usual thumbnail sizes and on the storage of the codes
+  struct FloatMetric;
+  struct ByteMetric;
+  struct WordMetric;
+  typedef std::pair<long, float> (*LeafScanFunction)(const AntipoleTree& tree, const uchar* code, long begin, long end, float max_dist);
+  bool leaf_specialization;
+  LeafScanFunction leaf_scan;
+
+  // The built tree, either in the vectors above or in a mapped index file
+  long thumbnail_count;
+  long node_count;
+  const AntipoleNode* node_data;
+  const float* center_data;
+  const uchar* code_data;
+  const qint32* index_data;
+  QFile* index_file;
+
+  // Bookkeeping of the incremental updates
+  std::vector<qint32> parents;
+  std::vector<long> built_sizes;
+  std::vector<long> updates;
+  long garbage;
+
+  AntipoleTree(const AntipoleTree&);
+  AntipoleTree& operator=(const AntipoleTree&);
+
+  void clear();
+  void setStorage();
+  void buildIndex(long minimum_size);
+  long buildNode(BuildState& state, AntipoleSubtree& fragment, long begin, long end);
+  long joinFragment(const BuildState& state, AntipoleSubtree& tree, const AntipoleSubtree& fragment, long node) const;
+  long divideMatching(BuildState& state, long begin, long end);
+  long assignMatching(BuildState& state, long begin, long end, const float* left_center, const float* right_center);
+  float computeMaxRadius(BuildState& state, const float* center, long begin, long end) const;
+  std::vector<float> computeCenter(BuildState& state, long begin, long end) const;
+
+  void detach();
+  void prepareUpdates();
+  long computeSizes(long node, std::vector<long>& sizes);
+  std::vector<long> getPath(long node) const;
+  void checkPath(const std::vector<long>& path);
+  void relocateLeaf(long node, long capacity);
+  void releaseNode(long node, std::vector<float>& thumbnails, std::vector<long>& indices);
+  void rebuildNode(long node);
+  void compactNode(long node, std::vector<AntipoleNode>& new_nodes, std::vector<float>& new_centers, std::vector<uchar>& new_codes, std::vector<qint32>& new_indices, std::vector<long>& mapping) const;
+
+  void setCascade();
+  DescriptorStorage getStorage(long dimension) const;
+  long getElementSize() const;
+  float getStoredValue(float value) const;
+  void encode(const float* thumbnail, uchar* code) const;
+  void decode(const uchar* code, float* thumbnail) const;
+  std::vector<uchar> encode(const std::vector<float>& thumbnail) const;
+  /// Squared distance between two stored thumbnails, float ones are abandoned once they exceed max_dist
+  float codeDistance(const uchar* code1, const uchar* code2, float max_dist) const;
+  void selectLeafScan();
+  template<long Dimension>
+  LeafScanFunction selectLeafScan() const;
+  /// Closest thumbnail of a leaf range strictly under max_dist, -1 if there is none
+  static std::pair<long, float> scanLeaf(const AntipoleTree& tree, const uchar* code, long begin, long end, float max_dist);
+  template<long Dimension, class Metric, bool Cascade>
+  static std::pair<long, float> scanLeaf(const AntipoleTree& tree, const uchar* code, long begin, long end, float max_dist);
+
+  float minimumDistance(long node, const float* image) const;
+  std::pair<long, float> visitNode(long node, const float* image, const uchar* code, float max_dist, NodeHeap& node_heap) const;
+  void visitNode(long node, const float* image, const uchar* code, long k, CandidateHeap& candidates, NodeHeap& node_heap) const;
+  float minimumDistance(long node, const AntipoleTree& queries, long query_node) const;
+  void dualTreeSearch(const AntipoleTree& queries, long query_node, long node, DualTreeState& state) const;
+  void dualTreeLeaves(const AntipoleTree& queries, long query_node, long node, DualTreeState& state) const;
+
+  long getCodeSize() const
+  {
+    // Codes are padded so that the float levels of the next code stay aligned
+    return (cascade_size * sizeof(float) + dimension * getElementSize() + sizeof(float) - 1) / sizeof(float) * sizeof(float);
+  }
+  const uchar* getCode(long position) const
+  {
+    return code_data + position * getCodeSize();
+  }
+  const float* getCenter(long node) const
+  {
+    return center_data + node * dimension;
+  }
 
-  AntipoleNode* buildNewNode(float minimum_size, const MatchingThumbnails& old_matching);
-  int divideMatching(const MatchingThumbnails& old_matching, std::vector<float>& left_center, std::vector<float>& righ_center, MatchingThumbnails& left_matching, MatchingThumbnails& right_matching);
-  void assignMatching(const MatchingThumbnails& old_matching, std::vector<float>& left_center, std::vector<float>& right_center, MatchingThumbnails& left_matching, MatchingThumbnails& right_matching);
-  float computeMaxRadius(const std::vector<float>& center, const MatchingThumbnails& matching) const;
-  void computeCenter(std::vector<float>& center, const MatchingThumbnails& matching) const;
-  
-  std::vector<float> convert(const QImage& image) const;
-  const std::vector<std::vector<float> >& getThumbnails() const;
-  
-  friend AntipoleLeaf;
-  
 public:
   AntipoleTree(void);
   ~AntipoleTree();
 
   void build(const QVector<QImage>& thumbnails);
+  void build(const std::vector<float>& thumbnails, long dimension, long minimum_size = AntipoleTree::minimum_size);
   void setConversionMethod(int conversion_method);
+  int getConversionMethod() const;
+  /// Selects how the next built or loaded tree stores its thumbnails, quantized storage is only used for dimensions the integer kernels support
+  void setDescriptorStorage(DescriptorStorage descriptor_storage);
+  /// Enables the coarse levels used to reject thumbnails before the full distance is computed
+  void setDescriptorCascade(bool descriptor_cascade);
+  /// Enables the leaf scans specialized on the descriptor dimension, the generic scan is used otherwise
+  void setLeafSpecialization(bool leaf_specialization);
+  std::vector<float> convert(const QImage& image) const;
+  /// Converts an image into a buffer of getDimension() values
+  void convert(const QImage& image, float* descriptor) const;
+  /// Rounds values to the ones the codes store, node bounds and the other indexes are computed from them
+  void quantize(const float* values, float* stored, long size) const;
+
+  /// Adds a thumbnail to the tree, later thumbnails are shifted
+  void insert(const std::vector<float>& thumbnail, long index);
+  /// Removes a thumbnail from the tree, later thumbnails are shifted
+  void remove(long index);
+  /// Stores the thumbnails in leaf order again, dropping the space left by updates
+  void compact();
+
+  /// Saves the built tree to an index file, tagged with the checksum of the database it was built from
+  bool save(const QString& filename, const QByteArray& checksum) const;
+  /// Maps an index file, fails if it was not built from this database with the current conversion method and storage
+  bool load(const QString& filename, const QByteArray& checksum);
+  long getDimension() const
+  {
+    return dimension;
+  }
+  /// Returns the descriptors of the thumbnails in index order
+  std::vector<float> getThumbnails() const;
+  TreeStatistics getStatistics() const;
 
   long getClosestThumbnail(const std::vector<float>& image) const;
   long getClosestThumbnail(const QImage& image) const;
+  long getClosestThumbnail(const QImage& image, SearchContext& context) const;
+  /// Returns the k closest thumbnails and their squared distances, closest first
+  std::vector<std::pair<long, float> > getClosestThumbnails(const std::vector<float>& image, long k) const;
+  /// Matches a whole set of images at once by traversing a tree of the images against this tree
+  std::vector<long> getClosestThumbnails(const std::vector<std::vector<float> >& images) const;
+
+  SearchResult search(const std::vector<float>& image, const SearchOptions& options) const;
+  /// The image holds getDimension() values, the query only allocates while the buffers of the context grow
+  SearchResult search(const float* image, const SearchOptions& options, SearchContext& context) const;
+  /// Scratch memory of the calling thread, used by the queries that do not take a context
+  static SearchContext& getThreadContext();
+  /// Exact searches use the dual-tree traversal, approximate ones are run in parallel
+  std::vector<SearchResult> search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const;
 };
 
 struct HelperFunctions
 {
   static const int tournament_size;
+  static float distance2(const float* image1, const float* image2, long size);
   static float distance2(const std::vector<float>& image1, const std::vector<float>& image2);
-  static long median1(const std::vector<std::vector<float> >& objects);
-  static std::pair<std::vector<float>, std::vector<float> > approxAntipole(const std::vector<std::vector<float> >& objects, const MatchingThumbnails& matching);
+  static long median1(const float* objects, long dimension, const long* tournament, long size);
+  /// Reorders the range, the returned pair is at its front
+  static std::pair<long, long> approxAntipole(const float* objects, long dimension, std::vector<long>::iterator begin, std::vector<long>::iterator end);
 
+  /// Reference conversions, the trees convert through ColorConversion
   static std::vector<float> convert_rgb(const QImage& image);
   static std::vector<float> convert_lab(const QImage& image);
   static std::vector<float> convert_lch(const QImage& image);
@@ -0,0 +1,277 @@
+/**
+ * \file BruteForceIndex.cpp
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <limits>
+#include <stdexcept>
+
+#include <QtConcurrent/QtConcurrentMap>
+
+#include "BruteForceIndex.h"
+#include "DistanceKernels.h"
+
+const long BruteForceIndex::block_size = 256;
+const long BruteForceIndex::query_block_size = 4;
+const long BruteForceIndex::query_group_size = 64;
+
+namespace
+{
+  /// Crossovers measured by the crossover benchmark, at the dimension of 3x3 thumbnails and from the dimension where they level off
+  const long low_dimension = 27;
+  const long low_crossover = 16000;
+  const long high_dimension = 48;
+  const long high_crossover = 32000;
+}
+
+BruteForceIndex::BruteForceIndex()
+  :dimension(0), thumbnail_count(0), max_norm(0)
+{
+}
+
+void BruteForceIndex::build(const std::vector<float>& thumbnails, long dimension)
+{
+  this->dimension = dimension;
+  thumbnail_count = dimension > 0 ? thumbnails.size() / dimension : 0;
+  mean.assign(dimension, 0);
+  for(long i = 0; i < thumbnail_count; ++i)
+  {
+    for(long j = 0; j < dimension; ++j)
+    {
+      mean[j] += thumbnails[i * dimension + j];
+    }
+  }
+  for(long j = 0; j < dimension; ++j)
+  {
+    mean[j] /= std::max(thumbnail_count, 1L);
+  }
+
+  // Centering keeps the norms small, and so the rounding errors of the expansion
+  this->thumbnails.resize(thumbnail_count * dimension);
+  for(long i = 0; i < thumbnail_count * dimension; ++i)
+  {
+    this->thumbnails[i] = thumbnails[i] - mean[i % dimension];
+  }
+  layoutBlocks(0);
+}
+
+void BruteForceIndex::insert(const std::vector<float>& thumbnail, long index)
+{
+  if(thumbnail_count == 0)
+  {
+    build(thumbnail, thumbnail.size());
+    return;
+  }
+  // The mean is kept, it only has to keep the norms small
+  std::vector<float> centered = center(thumbnail);
+  thumbnails.insert(thumbnails.begin() + index * dimension, centered.begin(), centered.end());
+  ++thumbnail_count;
+  layoutBlocks(index);
+}
+
+void BruteForceIndex::remove(long index)
+{
+  if(index < 0 || index >= thumbnail_count)
+  {
+    return;
+  }
+  thumbnails.erase(thumbnails.begin() + index * dimension, thumbnails.begin() + (index + 1) * dimension);
+  --thumbnail_count;
+  layoutBlocks(index);
+}
+
+void BruteForceIndex::layoutBlocks(long first)
+{
+  long block_count = (thumbnail_count + block_size - 1) / block_size;
+  blocks.resize(block_count * block_size * dimension, 0);
+  norms.resize(block_count * block_size, std::numeric_limits<float>::infinity());
+  for(long i = first; i < block_count * block_size; ++i)
+  {
+    float* block = &blocks[(i / block_size) * block_size * dimension + i % block_size];
+    if(i >= thumbnail_count)
+    {
+      for(long j = 0; j < dimension; ++j)
+      {
+        block[j * block_size] = 0;
+      }
+      norms[i] = std::numeric_limits<float>::infinity();
+      continue;
+    }
+    const float* thumbnail = &thumbnails[i * dimension];
+    float norm = 0;
+    for(long j = 0; j < dimension; ++j)
+    {
+      block[j * block_size] = thumbnail[j];
+      norm += thumbnail[j] * thumbnail[j];
+    }
+    norms[i] = norm;
+  }
+  max_norm = 0;
+  for(long i = 0; i < thumbnail_count; ++i)
+  {
+    max_norm = std::max(max_norm, norms[i]);
+  }
+}
+
+std::vector<float> BruteForceIndex::center(const std::vector<float>& image) const
+{
+  if(static_cast<long>(image.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+  std::vector<float> centered(dimension);
+  for(long j = 0; j < dimension; ++j)
+  {
+    centered[j] = image[j] - mean[j];
+  }
+  return centered;
+}
+
+SearchResult BruteForceIndex::search(const std::vector<float>& image, const SearchOptions&) const
+{
+  SearchResult result = {-1, std::numeric_limits<float>::max(), true, SearchStatistics()};
+  if(thumbnail_count == 0)
+  {
+    return result;
+  }
+
+  result.statistics.queries = 1;
+  result.statistics.leaf_members = thumbnail_count;
+  result.statistics.distances = thumbnail_count;
+  std::vector<float> centered = center(image);
+  for(long i = 0; i < thumbnail_count; ++i)
+  {
+    float distance = DistanceKernels::partialDistance2(&centered[0], &thumbnails[i * dimension], dimension, result.distance);
+    if(distance < result.distance)
+    {
+      result.index = i;
+      result.distance = distance;
+    }
+  }
+  return result;
+}
+
+std::vector<SearchResult> BruteForceIndex::search(const std::vector<std::vector<float> >& images, const SearchOptions&) const
+{
+  SearchResult no_result = {-1, std::numeric_limits<float>::max(), true, SearchStatistics()};
+  std::vector<SearchResult> results(images.size(), no_result);
+  if(thumbnail_count == 0 || images.empty())
+  {
+    return results;
+  }
+
+  std::vector<float> queries;
+  queries.reserve(images.size() * dimension);
+  for(std::vector<std::vector<float> >::const_iterator it = images.begin(); it != images.end(); ++it)
+  {
+    std::vector<float> centered = center(*it);
+    queries.insert(queries.end(), centered.begin(), centered.end());
+  }
+
+  std::vector<long> groups((images.size() + query_group_size - 1) / query_group_size);
+  for(std::size_t i = 0; i < groups.size(); ++i)
+  {
+    groups[i] = i * query_group_size;
+  }
+  QtConcurrent::blockingMap(groups, [&](long& group)
+  {
+    searchGroup(&queries[group * dimension], std::min<long>(query_group_size, images.size() - group), &results[group]);
+  });
+  return results;
+}
+
+void BruteForceIndex::searchGroup(const float* queries, long count, SearchResult* results) const
+{
+  // Queries are scaled by -2 and padded to whole query blocks
+  long padded_count = (count + query_block_size - 1) / query_block_size * query_block_size;
+  std::vector<float> scaled_queries(padded_count * dimension, 0);
+  std::vector<float> query_norms(padded_count, 0);
+  std::vector<float> best(padded_count, std::numeric_limits<float>::infinity());
+  std::vector<float> margins(padded_count, 0);
+  std::vector<std::vector<std::pair<float, long> > > candidates(count);
+  for(long i = 0; i < count; ++i)
+  {
+    for(long j = 0; j < dimension; ++j)
+    {
+      scaled_queries[i * dimension + j] = -2 * queries[i * dimension + j];
+      query_norms[i] += queries[i * dimension + j] * queries[i * dimension + j];
+    }
+    margins[i] = 4 * (dimension + 2) * FLT_EPSILON * (query_norms[i] + max_norm);
+  }
+
+  float scores[query_block_size][block_size];
+  long block_count = norms.size() / block_size;
+  for(long block = 0; block < block_count; ++block)
+  {
+    const float* block_data = &blocks[block * block_size * dimension];
+    const float* block_norms = &norms[block * block_size];
+    for(long query = 0; query < padded_count; query += query_block_size)
+    {
+      for(long k = 0; k < query_block_size; ++k)
+      {
+        std::copy(block_norms, block_norms + block_size, scores[k]);
+      }
+      const float* scaled_query = &scaled_queries[query * dimension];
+      for(long j = 0; j < dimension; ++j)
+      {
+        const float* coordinates = block_data + j * block_size;
+        float q0 = scaled_query[j];
+        float q1 = scaled_query[dimension + j];
+        float q2 = scaled_query[2 * dimension + j];
+        float q3 = scaled_query[3 * dimension + j];
+        for(long t = 0; t < block_size; ++t)
+        {
+          scores[0][t] += q0 * coordinates[t];
+          scores[1][t] += q1 * coordinates[t];
+          scores[2][t] += q2 * coordinates[t];
+          scores[3][t] += q3 * coordinates[t];
+        }
+      }
+
+      for(long k = 0; k < query_block_size && query + k < count; ++k)
+      {
+        long current = query + k;
+        const float* query_scores = scores[k];
+        for(long t = 0; t < block_size; ++t)
+        {
+          float distance = query_scores[t] + query_norms[current];
+          if(distance <= best[current] + margins[current])
+          {
+            best[current] = std::min(best[current], distance);
+            candidates[current].push_back(std::make_pair(distance, block * block_size + t));
+          }
+        }
+      }
+    }
+  }
+
+  // The expansion is only accurate up to the margin, the remaining candidates are compared exactly
+  for(long i = 0; i < count; ++i)
+  {
+    SearchResult& result = results[i];
+    result.statistics.queries = 1;
+    result.statistics.leaf_members = thumbnail_count;
+    result.statistics.distances = thumbnail_count;
+    for(std::vector<std::pair<float, long> >::const_iterator it = candidates[i].begin(); it != candidates[i].end(); ++it)
+    {
+      if(it->first <= best[i] + margins[i])
+      {
+        float distance = DistanceKernels::distance2(queries + i * dimension, &thumbnails[it->second * dimension], dimension);
+        ++result.statistics.distances;
+        if(distance < result.distance || (distance == result.distance && it->second < result.index))
+        {
+          result.index = it->second;
+          result.distance = distance;
+        }
+      }
+    }
+  }
+}
+
+bool BruteForceIndex::isPreferred(long size, long dimension)
+{
+  // The tree prunes less as the dimension grows, up to the high dimension, crossovers in between are interpolated
+  long clamped = std::min(std::max(dimension, low_dimension), high_dimension);
+  return size <= low_crossover + (high_crossover - low_crossover) * (clamped - low_dimension) / (high_dimension - low_dimension);
+}
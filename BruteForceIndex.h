@@ -0,0 +1,60 @@
+/**
+ * \file BruteForceIndex.h
+ */
+
+#ifndef BRUTEFORCEINDEX
+#define BRUTEFORCEINDEX
+
+#include <vector>
+
+#include "ThumbnailIndex.h"
+
+/**
+ * Exact linear scan over the thumbnails. Batches are matched as a blocked matrix product:
+ * distances are expanded as |q|^2 + |t|^2 - 2 q.t over blocks of thumbnails that stay in cache,
+ * and the candidates within the rounding error of the best one are checked with exact distances.
+ */
+class BruteForceIndex : public ThumbnailIndex
+{
+  static const long block_size;
+  static const long query_block_size;
+  static const long query_group_size;
+
+  long dimension;
+  long thumbnail_count;
+  std::vector<float> mean;
+  /// Centered thumbnails in index order
+  std::vector<float> thumbnails;
+  /// Centered thumbnails by block, transposed so that a coordinate of a block is contiguous
+  std::vector<float> blocks;
+  /// Squared norms of the centered thumbnails, padded blocks have an infinite norm
+  std::vector<float> norms;
+  float max_norm;
+
+  std::vector<float> center(const std::vector<float>& image) const;
+  /// Copies the thumbnails from a position on into the blocks and updates the norms
+  void layoutBlocks(long first);
+  void searchGroup(const float* queries, long count, SearchResult* results) const;
+
+public:
+  BruteForceIndex();
+
+  void build(const std::vector<float>& thumbnails, long dimension);
+  /// Adds a thumbnail, later thumbnails are shifted
+  void insert(const std::vector<float>& thumbnail, long index);
+  /// Removes a thumbnail, later thumbnails are shifted
+  void remove(long index);
+  long getDimension() const
+  {
+    return dimension;
+  }
+
+  /// Brute force results are always exact, the options are ignored
+  SearchResult search(const std::vector<float>& image, const SearchOptions& options) const;
+  std::vector<SearchResult> search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const;
+
+  /// Tells if a batch scan is expected to be faster than the Antipole tree
+  static bool isPreferred(long size, long dimension);
+};
+
+#endif
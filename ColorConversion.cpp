@@ -0,0 +1,327 @@
+/**
+ * \file ColorConversion.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "ColorConversion.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLORCONVERSION_SSE2
+#include <emmintrin.h>
+#endif
+
+const float ColorConversion::tolerance = 0.01f;
+
+namespace
+{
+  // Pixels converted together, kept on the stack one channel after the other
+  const long chunk_size = 64;
+  const float pi = 3.14159265f;
+  const qint32 cube_root_magic = 709921077;
+  const float pivot_threshold = 0.008856f;
+  const int newton_iterations = 3;
+  // Polynomial of atan on [0, 1] (Abramowitz and Stegun 4.4.49), within 1e-5 radians
+  const float atan_coefficients[5] = {0.0208351f, -0.0851330f, 0.1801410f, -0.3302995f, 0.9998660f};
+
+  /**
+   * Pivoted sRGB values of the 256 levels of a channel, as HelperFunctions computes them for each pixel
+   */
+  struct PivotTable
+  {
+    float values[256];
+
+    PivotTable()
+    {
+      for(int i = 0; i < 256; ++i)
+      {
+        float n = i;
+        values[i] = (n > 0.04045 ? std::pow((n + 0.055) / 1.055, 2.4) : n / 12.92) * 100;
+      }
+    }
+  };
+
+  const PivotTable pivot_table;
+
+  float pivotXYZ(float n)
+  {
+    return n > pivot_threshold ? ColorConversion::cubeRoot(n) : (903.3f * n + 16) / 116;
+  }
+
+  void convertLab(float& x, float& y, float& z)
+  {
+    float fx = pivotXYZ(x) / 95.047f;
+    float fy = pivotXYZ(y) / 100.f;
+    float fz = pivotXYZ(z) / 108.883f;
+    x = std::max(0.f, 116 * fy - 16);
+    y = 500 * (fx - fy);
+    z = 200 * (fy - fz);
+  }
+
+#if defined(COLORCONVERSION_SSE2)
+  __m128 select(__m128 mask, __m128 if_true, __m128 if_false)
+  {
+    return _mm_or_ps(_mm_and_ps(mask, if_true), _mm_andnot_ps(mask, if_false));
+  }
+
+  __m128 cubeRoot(__m128 value)
+  {
+    __m128i bits = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(value)), _mm_set1_ps(1.f / 3)));
+    __m128 root = _mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(cube_root_magic)));
+    for(int i = 0; i < newton_iterations; ++i)
+    {
+      root = _mm_mul_ps(_mm_add_ps(_mm_add_ps(root, root), _mm_div_ps(value, _mm_mul_ps(root, root))), _mm_set1_ps(1.f / 3));
+    }
+    return root;
+  }
+
+  __m128 pivotXYZ(__m128 n)
+  {
+    __m128 linear = _mm_div_ps(_mm_add_ps(_mm_mul_ps(n, _mm_set1_ps(903.3f)), _mm_set1_ps(16.f)), _mm_set1_ps(116.f));
+    return select(_mm_cmpgt_ps(n, _mm_set1_ps(pivot_threshold)), cubeRoot(n), linear);
+  }
+
+  __m128 hue(__m128 y, __m128 x)
+  {
+    __m128 sign = _mm_set1_ps(-0.f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 abs_x = _mm_andnot_ps(sign, x);
+    __m128 abs_y = _mm_andnot_ps(sign, y);
+    __m128 ratio = _mm_div_ps(_mm_min_ps(abs_x, abs_y), _mm_max_ps(_mm_max_ps(abs_x, abs_y), _mm_set1_ps(std::numeric_limits<float>::min())));
+    __m128 square = _mm_mul_ps(ratio, ratio);
+    __m128 angle = _mm_set1_ps(atan_coefficients[0]);
+    for(int i = 1; i < 5; ++i)
+    {
+      angle = _mm_add_ps(_mm_mul_ps(angle, square), _mm_set1_ps(atan_coefficients[i]));
+    }
+    angle = _mm_mul_ps(angle, ratio);
+    angle = select(_mm_cmpgt_ps(abs_y, abs_x), _mm_sub_ps(_mm_set1_ps(pi / 2), angle), angle);
+    angle = select(_mm_cmplt_ps(x, zero), _mm_sub_ps(_mm_set1_ps(pi), angle), angle);
+    angle = _mm_or_ps(angle, _mm_and_ps(_mm_cmplt_ps(y, zero), sign));
+    return _mm_mul_ps(angle, _mm_set1_ps(180 / pi));
+  }
+
+  void convertLab(float* x, float* y, float* z)
+  {
+    __m128 fx = _mm_div_ps(pivotXYZ(_mm_loadu_ps(x)), _mm_set1_ps(95.047f));
+    __m128 fy = _mm_div_ps(pivotXYZ(_mm_loadu_ps(y)), _mm_set1_ps(100.f));
+    __m128 fz = _mm_div_ps(pivotXYZ(_mm_loadu_ps(z)), _mm_set1_ps(108.883f));
+    _mm_storeu_ps(x, _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(116.f), fy), _mm_set1_ps(16.f))));
+    _mm_storeu_ps(y, _mm_mul_ps(_mm_set1_ps(500.f), _mm_sub_ps(fx, fy)));
+    _mm_storeu_ps(z, _mm_mul_ps(_mm_set1_ps(200.f), _mm_sub_ps(fy, fz)));
+  }
+#endif
+
+  /**
+   * Converts at most chunk_size pixels to L*a*b or L*c*h
+   */
+  void convertChunk(const QRgb* pixels, long count, int conversion_method, float* descriptor)
+  {
+    float first[chunk_size];
+    float second[chunk_size];
+    float third[chunk_size];
+    for(long i = 0; i < count; ++i)
+    {
+      float red = pivot_table.values[qRed(pixels[i])];
+      float green = pivot_table.values[qGreen(pixels[i])];
+      float blue = pivot_table.values[qBlue(pixels[i])];
+      first[i] = red * 0.4124f + green * 0.3576f + blue * 0.1805f;
+      second[i] = red * 0.2126f + green * 0.7152f + blue * 0.0722f;
+      third[i] = red * 0.0193f + green * 0.1192f + blue * 0.9505f;
+    }
+
+    long i = 0;
+#if defined(COLORCONVERSION_SSE2)
+    for(; i + 4 <= count; i += 4)
+    {
+      convertLab(first + i, second + i, third + i);
+      if(conversion_method == 2)
+      {
+        __m128 a = _mm_loadu_ps(second + i);
+        __m128 b = _mm_loadu_ps(third + i);
+        _mm_storeu_ps(second + i, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b))));
+        _mm_storeu_ps(third + i, hue(b, a));
+      }
+    }
+#endif
+    for(; i < count; ++i)
+    {
+      convertLab(first[i], second[i], third[i]);
+      if(conversion_method == 2)
+      {
+        float a = second[i];
+        float b = third[i];
+        second[i] = std::sqrt(a * a + b * b);
+        third[i] = ColorConversion::hue(b, a);
+      }
+    }
+
+    for(long j = 0; j < count; ++j)
+    {
+      descriptor[3 * j] = first[j];
+      descriptor[3 * j + 1] = second[j];
+      descriptor[3 * j + 2] = third[j];
+    }
+  }
+}
+
+float ColorConversion::cubeRoot(float value)
+{
+  // Same operations as the vectorized version: a first guess from the exponent, then Newton iterations
+  qint32 bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  bits = static_cast<qint32>(bits * (1.f / 3)) + cube_root_magic;
+  float root;
+  std::memcpy(&root, &bits, sizeof(root));
+  for(int i = 0; i < newton_iterations; ++i)
+  {
+    root = (root + root + value / (root * root)) * (1.f / 3);
+  }
+  return root;
+}
+
+float ColorConversion::hue(float y, float x)
+{
+  float abs_x = std::abs(x);
+  float abs_y = std::abs(y);
+  float ratio = std::min(abs_x, abs_y) / std::max(std::max(abs_x, abs_y), std::numeric_limits<float>::min());
+  float square = ratio * ratio;
+  float angle = atan_coefficients[0];
+  for(int i = 1; i < 5; ++i)
+  {
+    angle = angle * square + atan_coefficients[i];
+  }
+  angle *= ratio;
+  if(abs_y > abs_x)
+  {
+    angle = pi / 2 - angle;
+  }
+  if(x < 0)
+  {
+    angle = pi - angle;
+  }
+  if(y < 0)
+  {
+    angle = -angle;
+  }
+  return angle * (180 / pi);
+}
+
+void ColorConversion::convertScanline(const QRgb* pixels, long count, int conversion_method, float* descriptor)
+{
+  switch(conversion_method)
+  {
+    case 0:
+      // Channels are stored in the order of the reference conversion
+      for(long i = 0; i < count; ++i)
+      {
+        descriptor[3 * i] = qRed(pixels[i]);
+        descriptor[3 * i + 1] = qBlue(pixels[i]);
+        descriptor[3 * i + 2] = qGreen(pixels[i]);
+      }
+      break;
+    case 1:
+    case 2:
+      for(long i = 0; i < count; i += chunk_size)
+      {
+        convertChunk(pixels + i, std::min(chunk_size, count - i), conversion_method, descriptor + 3 * i);
+      }
+      break;
+    default:
+      throw std::runtime_error("Bad conversion method");
+  }
+}
+
+std::vector<float> ColorConversion::convert(const QImage& image, int conversion_method)
+{
+  std::vector<float> descriptor(3 * image.width() * image.height());
+  if(!descriptor.empty())
+  {
+    convert(image, conversion_method, &descriptor[0]);
+  }
+  return descriptor;
+}
+
+void ColorConversion::convert(const QImage& image, int conversion_method, float* descriptor)
+{
+  if(image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+  {
+    convert(image.convertToFormat(QImage::Format_ARGB32), conversion_method, descriptor);
+    return;
+  }
+  for(int j = 0; j < image.height(); ++j)
+  {
+    convertScanline(reinterpret_cast<const QRgb*>(image.constScanLine(j)), image.width(), conversion_method, descriptor + 3 * j * image.width());
+  }
+}
+
+QRgb ColorConversion::computeMean(const QImage& image)
+{
+  if(image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+  {
+    return computeMean(image.convertToFormat(QImage::Format_ARGB32));
+  }
+  qint64 red = 0;
+  qint64 green = 0;
+  qint64 blue = 0;
+  for(int j = 0; j < image.height(); ++j)
+  {
+    const QRgb* pixels = reinterpret_cast<const QRgb*>(image.constScanLine(j));
+    for(int i = 0; i < image.width(); ++i)
+    {
+      red += qRed(pixels[i]);
+      green += qGreen(pixels[i]);
+      blue += qBlue(pixels[i]);
+    }
+  }
+  qint64 count = std::max<qint64>(1, static_cast<qint64>(image.width()) * image.height());
+  return qRgb((red + count / 2) / count, (green + count / 2) / count, (blue + count / 2) / count);
+}
+
+void ColorConversion::getCellRange(int start, int size, int cell, int cells, int& begin, int& end)
+{
+  begin = start + cell * size / cells;
+  end = std::max(begin + 1, start + (cell + 1) * size / cells);
+}
+
+QRgb ColorConversion::averageSums(const qint64* sums, qint64 area)
+{
+  return qRgb((sums[0] + area / 2) / area, (sums[1] + area / 2) / area, (sums[2] + area / 2) / area);
+}
+
+void ColorConversion::averageCells(const QImage& image, const QRect& rect, int cells, QRgb* grid)
+{
+  if(image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+  {
+    averageCells(image.convertToFormat(QImage::Format_ARGB32), rect, cells, grid);
+    return;
+  }
+  for(int c = 0; c < cells; ++c)
+  {
+    int top;
+    int bottom;
+    getCellRange(rect.top(), rect.height(), c, cells, top, bottom);
+    for(int d = 0; d < cells; ++d)
+    {
+      int left;
+      int right;
+      getCellRange(rect.left(), rect.width(), d, cells, left, right);
+      qint64 sums[3] = {0, 0, 0};
+      for(int y = top; y < bottom; ++y)
+      {
+        const QRgb* pixels = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        for(int x = left; x < right; ++x)
+        {
+          sums[0] += qRed(pixels[x]);
+          sums[1] += qGreen(pixels[x]);
+          sums[2] += qBlue(pixels[x]);
+        }
+      }
+      grid[c * cells + d] = averageSums(sums, static_cast<qint64>(bottom - top) * (right - left));
+    }
+  }
+}
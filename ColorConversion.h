@@ -0,0 +1,40 @@
+/**
+ * \file ColorConversion.h
+ */
+
+#ifndef COLORCONVERSION
+#define COLORCONVERSION
+
+#include <vector>
+#include <qimage.h>
+
+/**
+ * Conversion of images to descriptors, a scanline at a time.
+ * The sRGB pivot goes through a 256 entries table, cube roots and hues through approximations computed four pixels at a time.
+ * Results stay within tolerance of the reference conversions of HelperFunctions.
+ */
+struct ColorConversion
+{
+  /// Largest absolute difference allowed with the reference conversions, hues are compared as the length of their arc at the chroma
+  static const float tolerance;
+
+  /// Converts count pixels to interleaved descriptor values, the conversion methods are the ones of AntipoleTree
+  static void convertScanline(const QRgb* pixels, long count, int conversion_method, float* descriptor);
+  static std::vector<float> convert(const QImage& image, int conversion_method);
+  /// Converts into a buffer of 3 values per pixel, RGB32 and ARGB32 images are read in place
+  static void convert(const QImage& image, int conversion_method, float* descriptor);
+  /// Mean color of an image, channels rounded to the nearest
+  static QRgb computeMean(const QImage& image);
+  /// Pixels of a cell of a grid splitting a span evenly, spans thinner than the grid repeat their pixels so that no cell is empty
+  static void getCellRange(int start, int size, int cell, int cells, int& begin, int& end);
+  /// Mean color of area pixels from the sums of their red, green and blue channels, rounded to the nearest
+  static QRgb averageSums(const qint64* sums, qint64 area);
+  /// Mean colors of the cells of a grid splitting a rectangle of an image, the descriptors of the thumbnails and of the parts of a target are averaged alike
+  static void averageCells(const QImage& image, const QRect& rect, int cells, QRgb* grid);
+
+  static float cubeRoot(float value);
+  /// Angle of (x, y) in degrees, as atan2
+  static float hue(float y, float x);
+};
+
+#endif
@@ -0,0 +1,514 @@
+/**
+ * \file DistanceKernels.cpp
+ */
+
+#include "DistanceKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DISTANCEKERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+namespace
+{
+  // Number of elements between two checks of the partial distance
+  const long partial_block = 16;
+
+  struct KernelsInitializer
+  {
+    KernelsInitializer()
+    {
+      DistanceKernels::setInstructionSet(DistanceKernels::detectInstructionSet());
+    }
+  };
+}
+
+// Signed 32 bits sums, the leaf scans of the Antipole tree keep them in qint32
+const long DistanceKernels::max_byte_size = 33025;
+const long DistanceKernels::max_word_size = 512;
+DistanceKernels::InstructionSet DistanceKernels::instruction_set = DistanceKernels::Scalar;
+DistanceKernels::Distance2Function DistanceKernels::distance2_kernel = &DistanceKernels::distance2_scalar;
+DistanceKernels::PartialDistance2Function DistanceKernels::partial_distance2_kernel = &DistanceKernels::partialDistance2_scalar;
+DistanceKernels::ByteDistance2Function DistanceKernels::byte_distance2_kernel = &DistanceKernels::distance2_scalar;
+DistanceKernels::WordDistance2Function DistanceKernels::word_distance2_kernel = &DistanceKernels::distance2_scalar;
+
+static KernelsInitializer kernels_initializer;
+
+DistanceKernels::InstructionSet DistanceKernels::detectInstructionSet()
+{
+#if defined(DISTANCEKERNELS_X86)
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  bool avx2 = false;
+  bool avx512 = false;
+  if(max_leaf >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    avx2 = avx && (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+    avx512 = (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  bool sse2 = __builtin_cpu_supports("sse2");
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool avx512 = __builtin_cpu_supports("avx512f");
+#endif
+  if(avx512)
+  {
+    return AVX512;
+  }
+  if(avx2)
+  {
+    return AVX2;
+  }
+  if(sse2)
+  {
+    return SSE2;
+  }
+#endif
+  return Scalar;
+}
+
+DistanceKernels::InstructionSet DistanceKernels::getInstructionSet()
+{
+  return instruction_set;
+}
+
+void DistanceKernels::setInstructionSet(InstructionSet instruction_set)
+{
+  InstructionSet supported = detectInstructionSet();
+  if(instruction_set > supported)
+  {
+    instruction_set = supported;
+  }
+  DistanceKernels::instruction_set = instruction_set;
+
+  switch(instruction_set)
+  {
+#if defined(DISTANCEKERNELS_X86)
+    case AVX512:
+      distance2_kernel = &distance2_avx512;
+      partial_distance2_kernel = &partialDistance2_avx512;
+      byte_distance2_kernel = &distance2_avx2;
+      word_distance2_kernel = &distance2_avx2;
+      break;
+    case AVX2:
+      distance2_kernel = &distance2_avx2;
+      partial_distance2_kernel = &partialDistance2_avx2;
+      byte_distance2_kernel = &distance2_avx2;
+      word_distance2_kernel = &distance2_avx2;
+      break;
+    case SSE2:
+      distance2_kernel = &distance2_sse2;
+      partial_distance2_kernel = &partialDistance2_sse2;
+      byte_distance2_kernel = &distance2_sse2;
+      word_distance2_kernel = &distance2_sse2;
+      break;
+#endif
+    default:
+      distance2_kernel = &distance2_scalar;
+      partial_distance2_kernel = &partialDistance2_scalar;
+      byte_distance2_kernel = &distance2_scalar;
+      word_distance2_kernel = &distance2_scalar;
+      break;
+  }
+}
+
+const char* DistanceKernels::getInstructionSetName(InstructionSet instruction_set)
+{
+  switch(instruction_set)
+  {
+    case SSE2:
+      return "sse2";
+    case AVX2:
+      return "avx2";
+    case AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+float DistanceKernels::distance2_scalar(const float* object1, const float* object2, long size)
+{
+  float dist = 0;
+
+  for(long i = 0; i < size; ++i)
+  {
+    dist += (object1[i] - object2[i]) * (object1[i] - object2[i]);
+  }
+  return dist;
+}
+
+float DistanceKernels::partialDistance2_scalar(const float* object1, const float* object2, long size, float max_dist)
+{
+  float dist = 0;
+
+  for(long i = 0; i < size; i += partial_block)
+  {
+    long block_end = i + partial_block < size ? i + partial_block : size;
+    for(long j = i; j < block_end; ++j)
+    {
+      dist += (object1[j] - object2[j]) * (object1[j] - object2[j]);
+    }
+    if(dist > max_dist)
+    {
+      return dist;
+    }
+  }
+  return dist;
+}
+
+quint32 DistanceKernels::distance2_scalar(const quint8* object1, const quint8* object2, long size)
+{
+  quint32 dist = 0;
+
+  for(long i = 0; i < size; ++i)
+  {
+    qint32 diff = static_cast<qint32>(object1[i]) - object2[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+quint32 DistanceKernels::distance2_scalar(const qint16* object1, const qint16* object2, long size)
+{
+  quint32 dist = 0;
+
+  for(long i = 0; i < size; ++i)
+  {
+    qint32 diff = static_cast<qint32>(object1[i]) - object2[i];
+    dist += diff * diff;
+  }
+  return dist;
+}
+
+#if defined(DISTANCEKERNELS_X86)
+
+TARGET_SSE2 static float horizontalSum(__m128 sum)
+{
+  __m128 shuffled = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+  sum = _mm_add_ps(sum, shuffled);
+  shuffled = _mm_movehl_ps(shuffled, sum);
+  return _mm_cvtss_f32(_mm_add_ss(sum, shuffled));
+}
+
+TARGET_AVX2 static float horizontalSum(__m256 sum)
+{
+  return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+}
+
+TARGET_SSE2 float DistanceKernels::distance2_sse2(const float* object1, const float* object2, long size)
+{
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  long i = 0;
+  for(; i + 8 <= size; i += 8)
+  {
+    __m128 diff0 = _mm_sub_ps(_mm_loadu_ps(object1 + i), _mm_loadu_ps(object2 + i));
+    __m128 diff1 = _mm_sub_ps(_mm_loadu_ps(object1 + i + 4), _mm_loadu_ps(object2 + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(diff0, diff0));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(diff1, diff1));
+  }
+  if(i + 4 <= size)
+  {
+    __m128 diff = _mm_sub_ps(_mm_loadu_ps(object1 + i), _mm_loadu_ps(object2 + i));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(diff, diff));
+    i += 4;
+  }
+  float dist = horizontalSum(_mm_add_ps(sum0, sum1));
+  for(; i < size; ++i)
+  {
+    dist += (object1[i] - object2[i]) * (object1[i] - object2[i]);
+  }
+  return dist;
+}
+
+TARGET_SSE2 float DistanceKernels::partialDistance2_sse2(const float* object1, const float* object2, long size, float max_dist)
+{
+  float dist = 0;
+  long i = 0;
+  for(; i + partial_block <= size; i += partial_block)
+  {
+    __m128 sum = _mm_setzero_ps();
+    for(long j = i; j < i + partial_block; j += 4)
+    {
+      __m128 diff = _mm_sub_ps(_mm_loadu_ps(object1 + j), _mm_loadu_ps(object2 + j));
+      sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+    }
+    dist += horizontalSum(sum);
+    if(dist > max_dist)
+    {
+      return dist;
+    }
+  }
+  return dist + distance2_sse2(object1 + i, object2 + i, size - i);
+}
+
+TARGET_AVX2 float DistanceKernels::distance2_avx2(const float* object1, const float* object2, long size)
+{
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  long i = 0;
+  for(; i + 16 <= size; i += 16)
+  {
+    __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(object1 + i), _mm256_loadu_ps(object2 + i));
+    __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(object1 + i + 8), _mm256_loadu_ps(object2 + i + 8));
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(diff0, diff0));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(diff1, diff1));
+  }
+  if(i + 8 <= size)
+  {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(object1 + i), _mm256_loadu_ps(object2 + i));
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(diff, diff));
+    i += 8;
+  }
+  sum0 = _mm256_add_ps(sum0, sum1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+  if(i + 4 <= size)
+  {
+    __m128 diff = _mm_sub_ps(_mm_loadu_ps(object1 + i), _mm_loadu_ps(object2 + i));
+    sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+    i += 4;
+  }
+  float dist = horizontalSum(sum);
+  for(; i < size; ++i)
+  {
+    dist += (object1[i] - object2[i]) * (object1[i] - object2[i]);
+  }
+  return dist;
+}
+
+TARGET_AVX2 float DistanceKernels::partialDistance2_avx2(const float* object1, const float* object2, long size, float max_dist)
+{
+  float dist = 0;
+  long i = 0;
+  for(; i + partial_block <= size; i += partial_block)
+  {
+    __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(object1 + i), _mm256_loadu_ps(object2 + i));
+    __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(object1 + i + 8), _mm256_loadu_ps(object2 + i + 8));
+    dist += horizontalSum(_mm256_add_ps(_mm256_mul_ps(diff0, diff0), _mm256_mul_ps(diff1, diff1)));
+    if(dist > max_dist)
+    {
+      return dist;
+    }
+  }
+  return dist + distance2_avx2(object1 + i, object2 + i, size - i);
+}
+
+// _mm512_reduce_add_ps of gcc 12 reads an undefined vector on purpose, which -Wall reports once it is inlined
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+TARGET_AVX512 float DistanceKernels::distance2_avx512(const float* object1, const float* object2, long size)
+{
+  __m512 sum = _mm512_setzero_ps();
+  long i = 0;
+  for(; i + 16 <= size; i += 16)
+  {
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(object1 + i), _mm512_loadu_ps(object2 + i));
+    sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+  }
+  if(i < size)
+  {
+    __mmask16 mask = static_cast<__mmask16>((1u << (size - i)) - 1);
+    __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, object1 + i), _mm512_maskz_loadu_ps(mask, object2 + i));
+    sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+TARGET_AVX512 float DistanceKernels::partialDistance2_avx512(const float* object1, const float* object2, long size, float max_dist)
+{
+  float dist = 0;
+  long i = 0;
+  for(; i + partial_block <= size; i += partial_block)
+  {
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(object1 + i), _mm512_loadu_ps(object2 + i));
+    dist += _mm512_reduce_add_ps(_mm512_mul_ps(diff, diff));
+    if(dist > max_dist)
+    {
+      return dist;
+    }
+  }
+  if(i < size)
+  {
+    __mmask16 mask = static_cast<__mmask16>((1u << (size - i)) - 1);
+    __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, object1 + i), _mm512_maskz_loadu_ps(mask, object2 + i));
+    dist += _mm512_reduce_add_ps(_mm512_mul_ps(diff, diff));
+  }
+  return dist;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+TARGET_SSE2 static quint32 horizontalSum(__m128i sum)
+{
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return static_cast<quint32>(_mm_cvtsi128_si32(sum));
+}
+
+TARGET_AVX2 static quint32 horizontalSum(__m256i sum)
+{
+  return horizontalSum(_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+}
+
+// Bytes are widened to 16 bits, squared differences are summed by pairs with pmaddwd
+TARGET_SSE2 quint32 DistanceKernels::distance2_sse2(const quint8* object1, const quint8* object2, long size)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i sum = _mm_setzero_si128();
+  long i = 0;
+  for(; i + 16 <= size; i += 16)
+  {
+    __m128i block1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(object1 + i));
+    __m128i block2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(object2 + i));
+    __m128i diff_low = _mm_sub_epi16(_mm_unpacklo_epi8(block1, zero), _mm_unpacklo_epi8(block2, zero));
+    __m128i diff_high = _mm_sub_epi16(_mm_unpackhi_epi8(block1, zero), _mm_unpackhi_epi8(block2, zero));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_low, diff_low));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(diff_high, diff_high));
+  }
+  if(i + 8 <= size)
+  {
+    __m128i block1 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(object1 + i)), zero);
+    __m128i block2 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(object2 + i)), zero);
+    __m128i diff = _mm_sub_epi16(block1, block2);
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(diff, diff));
+    i += 8;
+  }
+  return horizontalSum(sum) + distance2_scalar(object1 + i, object2 + i, size - i);
+}
+
+TARGET_SSE2 quint32 DistanceKernels::distance2_sse2(const qint16* object1, const qint16* object2, long size)
+{
+  __m128i sum = _mm_setzero_si128();
+  long i = 0;
+  for(; i + 8 <= size; i += 8)
+  {
+    __m128i diff = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(object1 + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(object2 + i)));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(diff, diff));
+  }
+  return horizontalSum(sum) + distance2_scalar(object1 + i, object2 + i, size - i);
+}
+
+TARGET_AVX2 quint32 DistanceKernels::distance2_avx2(const quint8* object1, const quint8* object2, long size)
+{
+  __m256i sum = _mm256_setzero_si256();
+  long i = 0;
+  for(; i + 16 <= size; i += 16)
+  {
+    __m256i block1 = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(object1 + i)));
+    __m256i block2 = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(object2 + i)));
+    __m256i diff = _mm256_sub_epi16(block1, block2);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(diff, diff));
+  }
+  __m128i tail = _mm_setzero_si128();
+  if(i + 8 <= size)
+  {
+    __m128i block1 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(object1 + i)));
+    __m128i block2 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(object2 + i)));
+    __m128i diff = _mm_sub_epi16(block1, block2);
+    tail = _mm_madd_epi16(diff, diff);
+    i += 8;
+  }
+  return horizontalSum(sum) + horizontalSum(tail) + distance2_scalar(object1 + i, object2 + i, size - i);
+}
+
+TARGET_AVX2 quint32 DistanceKernels::distance2_avx2(const qint16* object1, const qint16* object2, long size)
+{
+  __m256i sum = _mm256_setzero_si256();
+  long i = 0;
+  for(; i + 16 <= size; i += 16)
+  {
+    __m256i diff = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(object1 + i)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(object2 + i)));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(diff, diff));
+  }
+  __m128i tail = _mm_setzero_si128();
+  if(i + 8 <= size)
+  {
+    __m128i diff = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(object1 + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(object2 + i)));
+    tail = _mm_madd_epi16(diff, diff);
+    i += 8;
+  }
+  return horizontalSum(sum) + horizontalSum(tail) + distance2_scalar(object1 + i, object2 + i, size - i);
+}
+
+#else
+
+float DistanceKernels::distance2_sse2(const float* object1, const float* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+float DistanceKernels::partialDistance2_sse2(const float* object1, const float* object2, long size, float max_dist)
+{
+  return partialDistance2_scalar(object1, object2, size, max_dist);
+}
+
+float DistanceKernels::distance2_avx2(const float* object1, const float* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+float DistanceKernels::partialDistance2_avx2(const float* object1, const float* object2, long size, float max_dist)
+{
+  return partialDistance2_scalar(object1, object2, size, max_dist);
+}
+
+float DistanceKernels::distance2_avx512(const float* object1, const float* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+float DistanceKernels::partialDistance2_avx512(const float* object1, const float* object2, long size, float max_dist)
+{
+  return partialDistance2_scalar(object1, object2, size, max_dist);
+}
+
+quint32 DistanceKernels::distance2_sse2(const quint8* object1, const quint8* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+quint32 DistanceKernels::distance2_avx2(const quint8* object1, const quint8* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+quint32 DistanceKernels::distance2_sse2(const qint16* object1, const qint16* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+quint32 DistanceKernels::distance2_avx2(const qint16* object1, const qint16* object2, long size)
+{
+  return distance2_scalar(object1, object2, size);
+}
+
+#endif
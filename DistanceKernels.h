@@ -0,0 +1,84 @@
+/**
+ * \file DistanceKernels.h
+ */
+
+#ifndef DISTANCEKERNELS
+#define DISTANCEKERNELS
+
+#include <QtCore/qglobal.h>
+
+/**
+ * Squared euclidean distances between two float descriptors, or two quantized ones.
+ * The implementation is selected at startup from the instruction sets the CPU supports,
+ * the scalar functions are kept as reference.
+ */
+struct DistanceKernels
+{
+  enum InstructionSet
+  {
+    Scalar = 0,
+    SSE2,
+    AVX2,
+    AVX512
+  };
+
+  typedef float (*Distance2Function)(const float* object1, const float* object2, long size);
+  typedef float (*PartialDistance2Function)(const float* object1, const float* object2, long size, float max_dist);
+  typedef quint32 (*ByteDistance2Function)(const quint8* object1, const quint8* object2, long size);
+  typedef quint32 (*WordDistance2Function)(const qint16* object1, const qint16* object2, long size);
+
+  /// Largest sizes the integer kernels sum in 32 bits, with squared differences of up to 255^2 for bytes and 2046^2 for words
+  static const long max_byte_size;
+  static const long max_word_size;
+
+  static InstructionSet detectInstructionSet();
+  static InstructionSet getInstructionSet();
+  /// Selects a set of kernels, falls back to the best supported one
+  static void setInstructionSet(InstructionSet instruction_set);
+  static const char* getInstructionSetName(InstructionSet instruction_set);
+
+  static float distance2(const float* object1, const float* object2, long size)
+  {
+    return distance2_kernel(object1, object2, size);
+  }
+  /// Returns the distance, or a value greater than max_dist as soon as the partial sum exceeds it
+  static float partialDistance2(const float* object1, const float* object2, long size, float max_dist)
+  {
+    return partial_distance2_kernel(object1, object2, size, max_dist);
+  }
+  /// The size must not exceed max_byte_size
+  static quint32 distance2(const quint8* object1, const quint8* object2, long size)
+  {
+    return byte_distance2_kernel(object1, object2, size);
+  }
+  /// Values must fit in 11 bits and the size must not exceed max_word_size
+  static quint32 distance2(const qint16* object1, const qint16* object2, long size)
+  {
+    return word_distance2_kernel(object1, object2, size);
+  }
+
+  static float distance2_scalar(const float* object1, const float* object2, long size);
+  static float partialDistance2_scalar(const float* object1, const float* object2, long size, float max_dist);
+  static float distance2_sse2(const float* object1, const float* object2, long size);
+  static float partialDistance2_sse2(const float* object1, const float* object2, long size, float max_dist);
+  static float distance2_avx2(const float* object1, const float* object2, long size);
+  static float partialDistance2_avx2(const float* object1, const float* object2, long size, float max_dist);
+  static float distance2_avx512(const float* object1, const float* object2, long size);
+  static float partialDistance2_avx512(const float* object1, const float* object2, long size, float max_dist);
+
+  static quint32 distance2_scalar(const quint8* object1, const quint8* object2, long size);
+  static quint32 distance2_sse2(const quint8* object1, const quint8* object2, long size);
+  static quint32 distance2_avx2(const quint8* object1, const quint8* object2, long size);
+  static quint32 distance2_scalar(const qint16* object1, const qint16* object2, long size);
+  static quint32 distance2_sse2(const qint16* object1, const qint16* object2, long size);
+  static quint32 distance2_avx2(const qint16* object1, const qint16* object2, long size);
+
+private:
+  static InstructionSet instruction_set;
+  static Distance2Function distance2_kernel;
+  static PartialDistance2Function partial_distance2_kernel;
+  static ByteDistance2Function byte_distance2_kernel;
+  static WordDistance2Function word_distance2_kernel;
+};
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ * \file IvfPqIndex.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include <QtConcurrent/QtConcurrentMap>
+
+#include "BruteForceIndex.h"
+#include "DistanceKernels.h"
+#include "IvfPqIndex.h"
+
+const long IvfPqIndex::codebook_size = 256;
+
+IvfPqIndex::Parameters::Parameters()
+  :list_count(0), subspace_count(0), iterations(10), training_size(65536), probe_count(8), rerank_count(0)
+{
+}
+
+IvfPqIndex::IvfPqIndex()
+  :dimension(0), thumbnail_count(0), list_count(0)
+{
+}
+
+void IvfPqIndex::setParameters(const Parameters& parameters)
+{
+  this->parameters = parameters;
+}
+
+bool IvfPqIndex::isPreferred(long size)
+{
+  return size >= 1000000;
+}
+
+std::vector<float> IvfPqIndex::kmeans(const float* data, long count, long dimension, long k, long iterations)
+{
+  k = std::min(k, count);
+  std::vector<float> centroids(k * dimension);
+  for(long i = 0; i < k; ++i)
+  {
+    std::copy(data + (i * count / k) * dimension, data + (i * count / k + 1) * dimension, centroids.begin() + i * dimension);
+  }
+
+  std::vector<std::vector<float> > points;
+  points.reserve(count);
+  for(long i = 0; i < count; ++i)
+  {
+    points.push_back(std::vector<float>(data + i * dimension, data + (i + 1) * dimension));
+  }
+
+  for(long iteration = 0; iteration < iterations; ++iteration)
+  {
+    BruteForceIndex index;
+    index.build(centroids, dimension);
+    std::vector<SearchResult> assignments = index.search(points, SearchOptions());
+
+    std::vector<double> sums(k * dimension, 0);
+    std::vector<long> sizes(k, 0);
+    for(long i = 0; i < count; ++i)
+    {
+      long cluster = assignments[i].index;
+      ++sizes[cluster];
+      for(long j = 0; j < dimension; ++j)
+      {
+        sums[cluster * dimension + j] += data[i * dimension + j];
+      }
+    }
+    // Empty clusters keep their previous centroid
+    for(long i = 0; i < k; ++i)
+    {
+      if(sizes[i] > 0)
+      {
+        for(long j = 0; j < dimension; ++j)
+        {
+          centroids[i * dimension + j] = sums[i * dimension + j] / sizes[i];
+        }
+      }
+    }
+  }
+  return centroids;
+}
+
+void IvfPqIndex::build(const std::vector<float>& thumbnails, long dimension)
+{
+  long count = dimension > 0 ? thumbnails.size() / dimension : 0;
+
+  // The quantizers are trained on evenly spaced thumbnails
+  long training_count = std::min(count, parameters.training_size);
+  std::vector<float> training(training_count * dimension);
+  for(long i = 0; i < training_count; ++i)
+  {
+    const float* thumbnail = &thumbnails[(i * count / training_count) * dimension];
+    std::copy(thumbnail, thumbnail + dimension, training.begin() + i * dimension);
+  }
+  train(training, dimension, count);
+  add(thumbnails);
+}
+
+void IvfPqIndex::train(const std::vector<float>& sample, long dimension, long size)
+{
+  this->dimension = dimension;
+  thumbnail_count = 0;
+  list_codes.clear();
+  list_indices.clear();
+  thumbnails.clear();
+  long training_count = dimension > 0 ? sample.size() / dimension : 0;
+  if(training_count == 0)
+  {
+    list_count = 0;
+    return;
+  }
+  std::vector<float> training = sample;
+
+  long subspace_count = parameters.subspace_count > 0 ? parameters.subspace_count : std::max(1L, dimension / 3);
+  subspace_count = std::min(subspace_count, dimension);
+  subspace_begins.resize(subspace_count + 1);
+  for(long s = 0; s <= subspace_count; ++s)
+  {
+    subspace_begins[s] = s * dimension / subspace_count;
+  }
+
+  list_count = parameters.list_count > 0 ? parameters.list_count : static_cast<long>(std::sqrt(static_cast<double>(std::max(size, training_count))));
+  coarse_centroids = kmeans(&training[0], training_count, dimension, std::max(1L, list_count), parameters.iterations);
+  list_count = coarse_centroids.size() / dimension;
+
+  std::vector<long> training_lists = assignLists(&training[0], training_count);
+  for(long i = 0; i < training_count; ++i)
+  {
+    for(long j = 0; j < dimension; ++j)
+    {
+      training[i * dimension + j] -= coarse_centroids[training_lists[i] * dimension + j];
+    }
+  }
+
+  codebooks.assign(codebook_size * dimension, 0);
+  for(long s = 0; s < subspace_count; ++s)
+  {
+    long subspace_dimension = subspace_begins[s + 1] - subspace_begins[s];
+    std::vector<float> subspace(training_count * subspace_dimension);
+    for(long i = 0; i < training_count; ++i)
+    {
+      std::copy(training.begin() + i * dimension + subspace_begins[s], training.begin() + i * dimension + subspace_begins[s + 1], subspace.begin() + i * subspace_dimension);
+    }
+    std::vector<float> codewords = kmeans(&subspace[0], training_count, subspace_dimension, codebook_size, parameters.iterations);
+    std::copy(codewords.begin(), codewords.end(), codebooks.begin() + codebook_size * subspace_begins[s]);
+  }
+  list_codes.resize(list_count);
+  list_indices.resize(list_count);
+}
+
+void IvfPqIndex::add(const std::vector<float>& thumbnails)
+{
+  long count = dimension > 0 ? thumbnails.size() / dimension : 0;
+  if(list_count == 0 || count == 0)
+  {
+    return;
+  }
+
+  long subspace_count = subspace_begins.size() - 1;
+  std::vector<long> lists = assignLists(&thumbnails[0], count);
+  std::vector<quint8> codes(count * subspace_count);
+  std::vector<long> chunks((count + 4095) / 4096);
+  for(std::size_t i = 0; i < chunks.size(); ++i)
+  {
+    chunks[i] = i * 4096;
+  }
+  QtConcurrent::blockingMap(chunks, [&](long& chunk)
+  {
+    for(long i = chunk; i < std::min(count, chunk + 4096); ++i)
+    {
+      encode(&thumbnails[i * dimension], lists[i], &codes[i * subspace_count]);
+    }
+  });
+
+  for(long i = 0; i < count; ++i)
+  {
+    list_codes[lists[i]].insert(list_codes[lists[i]].end(), codes.begin() + i * subspace_count, codes.begin() + (i + 1) * subspace_count);
+    list_indices[lists[i]].push_back(thumbnail_count + i);
+  }
+  if(parameters.rerank_count > 0)
+  {
+    this->thumbnails.insert(this->thumbnails.end(), thumbnails.begin(), thumbnails.end());
+  }
+  thumbnail_count += count;
+}
+
+std::vector<long> IvfPqIndex::assignLists(const float* thumbnails, long count) const
+{
+  BruteForceIndex index;
+  index.build(coarse_centroids, dimension);
+
+  // Matched by chunks to bound the memory of the query vectors
+  std::vector<long> lists(count);
+  for(long chunk = 0; chunk < count; chunk += 65536)
+  {
+    std::vector<std::vector<float> > queries;
+    for(long i = chunk; i < std::min(count, chunk + 65536); ++i)
+    {
+      queries.push_back(std::vector<float>(thumbnails + i * dimension, thumbnails + (i + 1) * dimension));
+    }
+    std::vector<SearchResult> results = index.search(queries, SearchOptions());
+    for(std::size_t i = 0; i < results.size(); ++i)
+    {
+      lists[chunk + i] = results[i].index;
+    }
+  }
+  return lists;
+}
+
+void IvfPqIndex::encode(const float* thumbnail, long list, quint8* code) const
+{
+  long subspace_count = subspace_begins.size() - 1;
+  std::vector<float> residual(dimension);
+  for(long j = 0; j < dimension; ++j)
+  {
+    residual[j] = thumbnail[j] - coarse_centroids[list * dimension + j];
+  }
+
+  for(long s = 0; s < subspace_count; ++s)
+  {
+    long subspace_dimension = subspace_begins[s + 1] - subspace_begins[s];
+    const float* codewords = &codebooks[codebook_size * subspace_begins[s]];
+    float best = std::numeric_limits<float>::max();
+    for(long k = 0; k < codebook_size; ++k)
+    {
+      float distance = DistanceKernels::distance2(&residual[subspace_begins[s]], codewords + k * subspace_dimension, subspace_dimension);
+      if(distance < best)
+      {
+        best = distance;
+        code[s] = k;
+      }
+    }
+  }
+}
+
+void IvfPqIndex::computeTable(const float* image, long list, std::vector<float>& table) const
+{
+  long subspace_count = subspace_begins.size() - 1;
+  std::vector<float> residual(dimension);
+  for(long j = 0; j < dimension; ++j)
+  {
+    residual[j] = image[j] - coarse_centroids[list * dimension + j];
+  }
+
+  table.resize(subspace_count * codebook_size);
+  for(long s = 0; s < subspace_count; ++s)
+  {
+    long subspace_dimension = subspace_begins[s + 1] - subspace_begins[s];
+    const float* codewords = &codebooks[codebook_size * subspace_begins[s]];
+    for(long k = 0; k < codebook_size; ++k)
+    {
+      table[s * codebook_size + k] = DistanceKernels::distance2(&residual[subspace_begins[s]], codewords + k * subspace_dimension, subspace_dimension);
+    }
+  }
+}
+
+void IvfPqIndex::insert(const std::vector<float>& thumbnail, long index)
+{
+  if(list_count == 0)
+  {
+    build(thumbnail, thumbnail.size());
+    list_indices[0][0] = index;
+    return;
+  }
+  if(static_cast<long>(thumbnail.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+
+  for(std::vector<std::vector<qint32> >::iterator list = list_indices.begin(); list != list_indices.end(); ++list)
+  {
+    for(std::vector<qint32>::iterator it = list->begin(); it != list->end(); ++it)
+    {
+      if(*it >= index)
+      {
+        ++*it;
+      }
+    }
+  }
+
+  long subspace_count = subspace_begins.size() - 1;
+  long list = assignLists(&thumbnail[0], 1)[0];
+  std::vector<quint8> code(subspace_count);
+  encode(&thumbnail[0], list, &code[0]);
+  list_codes[list].insert(list_codes[list].end(), code.begin(), code.end());
+  list_indices[list].push_back(index);
+  if(parameters.rerank_count > 0)
+  {
+    thumbnails.insert(thumbnails.begin() + index * dimension, thumbnail.begin(), thumbnail.end());
+  }
+  ++thumbnail_count;
+}
+
+void IvfPqIndex::remove(long index)
+{
+  long subspace_count = subspace_begins.size() - 1;
+  for(long list = 0; list < list_count; ++list)
+  {
+    std::vector<qint32>& indices = list_indices[list];
+    std::size_t i = 0;
+    while(i < indices.size())
+    {
+      if(indices[i] == index)
+      {
+        // The last entry of the list takes the place of the removed one
+        std::copy(list_codes[list].end() - subspace_count, list_codes[list].end(), list_codes[list].begin() + i * subspace_count);
+        list_codes[list].resize(list_codes[list].size() - subspace_count);
+        indices[i] = indices.back();
+        indices.pop_back();
+        --thumbnail_count;
+        continue;
+      }
+      if(indices[i] > index)
+      {
+        --indices[i];
+      }
+      ++i;
+    }
+  }
+  if(!thumbnails.empty())
+  {
+    thumbnails.erase(thumbnails.begin() + index * dimension, thumbnails.begin() + (index + 1) * dimension);
+  }
+}
+
+SearchResult IvfPqIndex::search(const std::vector<float>& image, const SearchOptions& options) const
+{
+  SearchResult result = {-1, std::numeric_limits<float>::max(), false, SearchStatistics()};
+  if(thumbnail_count == 0)
+  {
+    return result;
+  }
+  if(static_cast<long>(image.size()) != dimension)
+  {
+    throw std::runtime_error("Bad thumbnail size");
+  }
+
+  // Lists emptied by the k-means or by removals are not worth a probe
+  std::vector<std::pair<float, long> > lists;
+  for(long list = 0; list < list_count; ++list)
+  {
+    if(!list_indices[list].empty())
+    {
+      lists.push_back(std::make_pair(DistanceKernels::distance2(&image[0], &coarse_centroids[list * dimension], dimension), list));
+    }
+  }
+  long probe_count = std::min<long>(lists.size(), options.max_leaves > 0 ? options.max_leaves : parameters.probe_count);
+  std::partial_sort(lists.begin(), lists.begin() + probe_count, lists.end());
+  SearchStatistics& statistics = result.statistics;
+  statistics.queries = 1;
+  statistics.visited_nodes = probe_count;
+  statistics.pruned_subtrees = lists.size() - probe_count;
+  statistics.distances = lists.size();
+
+  // Max-heap of the best candidates for the codes
+  long subspace_count = subspace_begins.size() - 1;
+  std::size_t candidate_count = thumbnails.empty() ? 1 : std::max(1L, parameters.rerank_count);
+  std::vector<std::pair<float, long> > candidates;
+  std::vector<float> table;
+  for(long probe = 0; probe < probe_count; ++probe)
+  {
+    long list = lists[probe].second;
+    computeTable(&image[0], list, table);
+    const std::vector<quint8>& codes = list_codes[list];
+    const std::vector<qint32>& indices = list_indices[list];
+    statistics.leaf_members += indices.size();
+    statistics.distances += indices.size();
+    for(std::size_t i = 0; i < indices.size(); ++i)
+    {
+      const quint8* code = &codes[i * subspace_count];
+      float distance = 0;
+      for(long s = 0; s < subspace_count; ++s)
+      {
+        distance += table[s * codebook_size + code[s]];
+      }
+      if(candidates.size() < candidate_count)
+      {
+        candidates.push_back(std::make_pair(distance, static_cast<long>(indices[i])));
+        std::push_heap(candidates.begin(), candidates.end());
+      }
+      else if(distance < candidates.front().first)
+      {
+        std::pop_heap(candidates.begin(), candidates.end());
+        candidates.back() = std::make_pair(distance, static_cast<long>(indices[i]));
+        std::push_heap(candidates.begin(), candidates.end());
+      }
+    }
+  }
+
+  for(std::vector<std::pair<float, long> >::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+  {
+    float distance = thumbnails.empty() ? it->first : DistanceKernels::distance2(&image[0], &thumbnails[it->second * dimension], dimension);
+    statistics.distances += thumbnails.empty() ? 0 : 1;
+    if(distance < result.distance)
+    {
+      result.index = it->second;
+      result.distance = distance;
+    }
+  }
+  return result;
+}
+
+std::vector<SearchResult> IvfPqIndex::search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const
+{
+  std::vector<SearchResult> results(images.size());
+  std::vector<long> positions(images.size());
+  for(std::size_t i = 0; i < positions.size(); ++i)
+  {
+    positions[i] = i;
+  }
+  QtConcurrent::blockingMap(positions, [&](long& position)
+  {
+    results[position] = search(images[position], options);
+  });
+  return results;
+}
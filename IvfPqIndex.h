@@ -0,0 +1,93 @@
+/**
+ * \file IvfPqIndex.h
+ */
+
+#ifndef IVFPQINDEX
+#define IVFPQINDEX
+
+#include <vector>
+
+#include <QtCore/qglobal.h>
+
+#include "ThumbnailIndex.h"
+
+/**
+ * Approximate index for very large databases: an inverted file over a k-means coarse quantizer,
+ * the residuals of the thumbnails to the centroid of their list being product-quantized on one byte per subspace.
+ * Queries probe the closest lists with asymmetric distance tables and may rerank the best candidates exactly.
+ */
+class IvfPqIndex : public ThumbnailIndex
+{
+public:
+  struct Parameters
+  {
+    /// Number of inverted lists, 0 for the square root of the database size
+    long list_count;
+    /// Number of subspaces of the product quantizer, 0 for one per pixel
+    long subspace_count;
+    /// Iterations of the k-means trainings
+    long iterations;
+    /// Maximum number of thumbnails the quantizers are trained on
+    long training_size;
+    /// Lists probed by a query, overridden by SearchOptions::max_leaves
+    long probe_count;
+    /// Candidates compared with exact distances, which keeps a float copy of the thumbnails, 0 to keep only the codes in memory
+    long rerank_count;
+
+    Parameters();
+  };
+
+  IvfPqIndex();
+
+  void setParameters(const Parameters& parameters);
+  const Parameters& getParameters() const
+  {
+    return parameters;
+  }
+  void build(const std::vector<float>& thumbnails, long dimension);
+  /// Trains the quantizers on a sample of a database of the given size and empties the lists
+  void train(const std::vector<float>& sample, long dimension, long size);
+  /// Appends thumbnails with the current quantizers, so that a database can be added a chunk at a time
+  void add(const std::vector<float>& thumbnails);
+  /// Adds a thumbnail with the current quantizers, later thumbnails are shifted
+  void insert(const std::vector<float>& thumbnail, long index);
+  /// Removes a thumbnail, later thumbnails are shifted
+  void remove(long index);
+
+  long getDimension() const
+  {
+    return dimension;
+  }
+
+  /// Results are never flagged as exact
+  SearchResult search(const std::vector<float>& image, const SearchOptions& options) const;
+  std::vector<SearchResult> search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const;
+
+  /// Tells if the database is too large for the exact backends
+  static bool isPreferred(long size);
+  /// Lloyd iterations from evenly spaced samples
+  static std::vector<float> kmeans(const float* data, long count, long dimension, long k, long iterations);
+
+private:
+  static const long codebook_size;
+
+  Parameters parameters;
+  long dimension;
+  long thumbnail_count;
+  long list_count;
+  std::vector<float> coarse_centroids;
+  /// First coordinate of each subspace, followed by the dimension
+  std::vector<long> subspace_begins;
+  /// Codewords of the subspace s start at codebook_size * subspace_begins[s]
+  std::vector<float> codebooks;
+  std::vector<std::vector<quint8> > list_codes;
+  std::vector<std::vector<qint32> > list_indices;
+  /// Thumbnails in index order, only kept for reranking
+  std::vector<float> thumbnails;
+
+  std::vector<long> assignLists(const float* thumbnails, long count) const;
+  void encode(const float* thumbnail, long list, quint8* code) const;
+  void computeTable(const float* image, long list, std::vector<float>& table) const;
+};
+
+#endif
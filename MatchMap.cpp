@@ -0,0 +1,234 @@
+/**
+ * \file MatchMap.cpp
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
+#include <QtCore/qfile.h>
+
+#include "MatchMap.h"
+
+namespace
+{
+  const char match_magic[8] = {'Q', 'T', 'M', 'O', 'S', 'M', 'A', 'P'};
+  const quint32 match_version = 1;
+  const quint32 match_byte_order = 0x01020304;
+
+  /// Followed by the thumbnails (qint32), the distances (float) and the colors (QRgb) of the parts, in rows
+  struct MatchMapHeader
+  {
+    char magic[8];
+    quint32 version;
+    quint32 byte_order;
+    char key[16];
+    char checksum[16];
+    qint32 conversion_method;
+    qint32 width;
+    qint32 height;
+    qint32 tile_height;
+    qint32 tile_width;
+    qint32 reserved;
+    qint64 part_count;
+  };
+
+  const qint64 part_size = sizeof(qint32) + sizeof(float) + sizeof(QRgb);
+
+  void copyField(char* field, std::size_t size, const QByteArray& value)
+  {
+    std::memset(field, 0, size);
+    std::memcpy(field, value.constData(), std::min<std::size_t>(value.size(), size));
+  }
+
+  long getGridSize(int width, int height, int tileHeight, int tileWidth)
+  {
+    if(tileHeight <= 0 || tileWidth <= 0)
+    {
+      return 0;
+    }
+    return static_cast<long>((height + tileHeight - 1) / tileHeight) * ((width + tileWidth - 1) / tileWidth);
+  }
+}
+
+MatchMap::MatchMap()
+  :conversionMethod(0), tileHeight(0), tileWidth(0)
+{
+}
+
+QByteArray MatchMap::computeKey(const QImage& target, const QByteArray& databaseChecksum, int conversionMethod, int tileHeight, int tileWidth, const SearchOptions& options)
+{
+  QImage image = target.format() == QImage::Format_RGB32 || target.format() == QImage::Format_ARGB32 ? target : target.convertToFormat(QImage::Format_ARGB32);
+  QCryptographicHash hash(QCryptographicHash::Md5);
+  qint32 geometry[5] = {image.width(), image.height(), tileHeight, tileWidth, conversionMethod};
+  hash.addData(reinterpret_cast<const char*>(geometry), sizeof(geometry));
+  qint64 limits[2] = {options.max_leaves, options.max_distances};
+  hash.addData(reinterpret_cast<const char*>(limits), sizeof(limits));
+  float thresholds[2] = {options.epsilon, options.accept_distance};
+  hash.addData(reinterpret_cast<const char*>(thresholds), sizeof(thresholds));
+  hash.addData(databaseChecksum.constData(), databaseChecksum.size());
+  for(int j = 0; j < image.height(); ++j)
+  {
+    hash.addData(reinterpret_cast<const char*>(image.constScanLine(j)), image.width() * sizeof(QRgb));
+  }
+  return hash.result();
+}
+
+void MatchMap::assign(const QByteArray& key, const QByteArray& databaseChecksum, int conversionMethod, const QSize& size, int tileHeight, int tileWidth, const QVector<ImagePart>& parts)
+{
+  this->key = key;
+  this->databaseChecksum = databaseChecksum;
+  this->conversionMethod = conversionMethod;
+  this->size = size;
+  this->tileHeight = tileHeight;
+  this->tileWidth = tileWidth;
+
+  thumbnails.resize(parts.size());
+  distances.resize(parts.size());
+  colors.resize(parts.size());
+  for(int i = 0; i < parts.size(); ++i)
+  {
+    thumbnails[i] = static_cast<qint32>(parts[i].thumbnail);
+    distances[i] = parts[i].distance;
+    colors[i] = parts[i].color;
+  }
+}
+
+void MatchMap::restoreParts(QVector<ImagePart>& parts) const
+{
+  int columns = tileWidth > 0 ? (size.width() + tileWidth - 1) / tileWidth : 0;
+  parts.resize(getPartCount());
+  for(int k = 0; k < parts.size(); ++k)
+  {
+    ImagePart& part = parts[k];
+    int i = k % columns;
+    int j = k / columns;
+    part.rect = QRect(i * tileWidth, j * tileHeight, std::min(tileWidth, size.width() - i * tileWidth), std::min(tileHeight, size.height() - j * tileHeight));
+    part.color = colors[k];
+    part.descriptor.clear();
+    part.thumbnail = thumbnails[k];
+    part.distance = distances[k];
+    part.red_shift = 0;
+    part.green_shift = 0;
+    part.blue_shift = 0;
+  }
+}
+
+bool MatchMap::save(const QString& filename) const
+{
+  MatchMapHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, match_magic, sizeof(match_magic));
+  header.version = match_version;
+  header.byte_order = match_byte_order;
+  copyField(header.key, sizeof(header.key), key);
+  copyField(header.checksum, sizeof(header.checksum), databaseChecksum);
+  header.conversion_method = conversionMethod;
+  header.width = size.width();
+  header.height = size.height();
+  header.tile_height = tileHeight;
+  header.tile_width = tileWidth;
+  header.part_count = getPartCount();
+
+  QFile file(filename);
+  if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+  {
+    return false;
+  }
+  qint64 count = header.part_count;
+  bool success = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header);
+  success = success && (count == 0 || file.write(reinterpret_cast<const char*>(&thumbnails[0]), count * sizeof(qint32)) == static_cast<qint64>(count * sizeof(qint32)));
+  success = success && (count == 0 || file.write(reinterpret_cast<const char*>(&distances[0]), count * sizeof(float)) == static_cast<qint64>(count * sizeof(float)));
+  success = success && (count == 0 || file.write(reinterpret_cast<const char*>(&colors[0]), count * sizeof(QRgb)) == static_cast<qint64>(count * sizeof(QRgb)));
+  file.close();
+  if(!success)
+  {
+    file.remove();
+  }
+  return success;
+}
+
+bool MatchMap::load(const QString& filename, const QByteArray& key)
+{
+  QFile file(filename);
+  if(!file.open(QIODevice::ReadOnly) || file.size() < static_cast<qint64>(sizeof(MatchMapHeader)))
+  {
+    return false;
+  }
+  MatchMapHeader header;
+  if(file.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header))
+  {
+    return false;
+  }
+  char expected_key[sizeof(header.key)];
+  copyField(expected_key, sizeof(expected_key), key);
+  if(std::memcmp(header.magic, match_magic, sizeof(match_magic)) != 0 || header.version != match_version || header.byte_order != match_byte_order
+    || std::memcmp(header.key, expected_key, sizeof(expected_key)) != 0 || header.part_count != getGridSize(header.width, header.height, header.tile_height, header.tile_width)
+    || header.part_count <= 0 || file.size() != static_cast<qint64>(sizeof(header)) + header.part_count * part_size)
+  {
+    return false;
+  }
+
+  std::size_t count = static_cast<std::size_t>(header.part_count);
+  thumbnails.resize(count);
+  distances.resize(count);
+  colors.resize(count);
+  bool success = file.read(reinterpret_cast<char*>(&thumbnails[0]), count * sizeof(qint32)) == static_cast<qint64>(count * sizeof(qint32));
+  success = success && file.read(reinterpret_cast<char*>(&distances[0]), count * sizeof(float)) == static_cast<qint64>(count * sizeof(float));
+  success = success && file.read(reinterpret_cast<char*>(&colors[0]), count * sizeof(QRgb)) == static_cast<qint64>(count * sizeof(QRgb));
+  if(!success)
+  {
+    thumbnails.clear();
+    distances.clear();
+    colors.clear();
+    return false;
+  }
+  this->key = key;
+  databaseChecksum = QByteArray(header.checksum, sizeof(header.checksum));
+  conversionMethod = header.conversion_method;
+  size = QSize(header.width, header.height);
+  tileHeight = header.tile_height;
+  tileWidth = header.tile_width;
+  return true;
+}
+
+MatchMapCache::MatchMapCache(const QString& directory, int maximumParts)
+  :directory(directory), maps(maximumParts)
+{
+}
+
+void MatchMapCache::setDirectory(const QString& directory)
+{
+  this->directory = directory;
+}
+
+bool MatchMapCache::find(const QByteArray& key, MatchMap& map)
+{
+  MatchMap* cached = maps.object(key);
+  if(cached != NULL)
+  {
+    map = *cached;
+    return true;
+  }
+  if(directory.isEmpty() || !map.load(getFilename(key), key))
+  {
+    return false;
+  }
+  maps.insert(key, new MatchMap(map), std::max(1L, map.getPartCount()));
+  return true;
+}
+
+void MatchMapCache::insert(const MatchMap& map)
+{
+  maps.insert(map.getKey(), new MatchMap(map), std::max(1L, map.getPartCount()));
+  if(!directory.isEmpty() && QDir().mkpath(directory))
+  {
+    map.save(getFilename(map.getKey()));
+  }
+}
+
+QString MatchMapCache::getFilename(const QByteArray& key) const
+{
+  return QDir(directory).filePath(QString::fromLatin1(key.toHex()) + ".matches");
+}
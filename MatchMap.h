@@ -0,0 +1,81 @@
+/**
+ * \file MatchMap.h
+ */
+
+#ifndef MATCHMAP
+#define MATCHMAP
+
+#include <vector>
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qstring.h>
+
+#include "QtMosaicRenderer.h"
+
+/**
+ * The result of the matching of a target: the grid of its parts, then the thumbnail, distance and mean color of each part.
+ * Renders of the same target with the same database, color space, tile size and search options start from the map
+ * and go straight to the compositing, whatever their output ratio.
+ */
+class MatchMap
+{
+public:
+  MatchMap();
+
+  /// Identifies the inputs of a matching, the target is hashed with its pixels
+  static QByteArray computeKey(const QImage& target, const QByteArray& databaseChecksum, int conversionMethod, int tileHeight, int tileWidth, const SearchOptions& options);
+
+  /// Records the matched parts cut from an image of the given size
+  void assign(const QByteArray& key, const QByteArray& databaseChecksum, int conversionMethod, const QSize& size, int tileHeight, int tileWidth, const QVector<ImagePart>& parts);
+  /// Rebuilds the matched parts, without descriptors and adaptation shifts
+  void restoreParts(QVector<ImagePart>& parts) const;
+
+  bool save(const QString& filename) const;
+  /// Fails if the file is not the map of this key
+  bool load(const QString& filename, const QByteArray& key);
+
+  const QByteArray& getKey() const
+  {
+    return key;
+  }
+  long getPartCount() const
+  {
+    return static_cast<long>(thumbnails.size());
+  }
+
+private:
+  QByteArray key;
+  QByteArray databaseChecksum;
+  int conversionMethod;
+  QSize size;
+  int tileHeight;
+  int tileWidth;
+
+  std::vector<qint32> thumbnails;
+  std::vector<float> distances;
+  std::vector<QRgb> colors;
+};
+
+/**
+ * Match maps kept in memory, least recently used maps are dropped first, and in a directory when one is set
+ */
+class MatchMapCache
+{
+public:
+  /// The maps kept in memory hold at most maximumParts parts together
+  MatchMapCache(const QString& directory = QString(), int maximumParts = 1 << 22);
+
+  void setDirectory(const QString& directory);
+  /// Looks the key up in memory, then in the directory
+  bool find(const QByteArray& key, MatchMap& map);
+  void insert(const MatchMap& map);
+
+private:
+  QString getFilename(const QByteArray& key) const;
+
+  QString directory;
+  QCache<QByteArray, MatchMap> maps;
+};
+
+#endif
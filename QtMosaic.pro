@@ -15,7 +15,17 @@ HEADERS += AntipoleTree.h \
            QtMosaicBuilder.h \
            qtmosaicdatabase.h \
            QtMosaicDatabaseModel.h \
-           QtMosaicOptions.h
+           QtMosaicOptions.h \
+           DistanceKernels.h \
+           ThumbnailIndex.h \
+           BruteForceIndex.h \
+           IvfPqIndex.h \
+           ColorConversion.h \
+           QtMosaicRenderer.h \
+           TiffStripWriter.h \
+           ScanlineReader.h \
+           MatchMap.h \
+           RenderPipeline.h
 FORMS += qtmosaic.ui QtMosaicDatabase.ui
 SOURCES += AntipoleTree.cpp \
            main.cpp \
@@ -23,6 +33,15 @@ SOURCES += AntipoleTree.cpp \
            QtMosaicBuilder.cpp \
            qtmosaicdatabase.cpp \
            QtMosaicDatabaseModel.cpp \
-           QtMosaicOptions.cpp
+           QtMosaicOptions.cpp \
+           DistanceKernels.cpp \
+           BruteForceIndex.cpp \
+           IvfPqIndex.cpp \
+           ColorConversion.cpp \
+           QtMosaicRenderer.cpp \
+           TiffStripWriter.cpp \
+           ScanlineReader.cpp \
+           MatchMap.cpp \
+           RenderPipeline.cpp
 RESOURCES += qtmosaic.qrc
 
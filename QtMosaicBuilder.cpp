@@ -2,161 +2,136 @@
  * \file QtMosaicBuilder.cpp
  */
 
-#include <QtGui/qpainter.h>
+#include <algorithm>
+
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/qdebug.h>
+#include <QtCore/qdir.h>
+#include <QtCore/qstandardpaths.h>
 
 #include "QtMosaicBuilder.h"
 #include "QtMosaicDatabaseModel.h"
 
+namespace
+{
+  /// Parts of the coarse mosaic shown while the mosaic is rendered
+  const long proxy_parts = 1024;
+  /// Interval of the polls of the pipeline, in milliseconds
+  const int poll_interval = 20;
+  /// Repaints are at least that far apart, in milliseconds, and take at most a tenth of the time
+  const qint64 repaint_interval = 250;
+  const qint64 repaint_share = 10;
+}
+
 QtMosaicBuilder::QtMosaicBuilder(QObject* parent)
-  :QObject(parent)
+  :QObject(parent), progress(NULL), restored(false), prepared(true), progressive(true), repaintCost(0)
+{
+  timer = new QTimer(this);
+  connect(timer, SIGNAL(timeout()), this, SLOT(update()));
+  QString cache = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  if(!cache.isEmpty())
+  {
+    matchMaps.setDirectory(QDir(cache).filePath("matches"));
+  }
+}
+
+QtMosaicBuilder::~QtMosaicBuilder()
 {
+  preparation.waitForFinished();
+}
+
+void QtMosaicBuilder::setProgressive(bool progressive)
+{
+  this->progressive = progressive;
 }
 
 void QtMosaicBuilder::build(const QString& database, int conversion_method)
 {
+  preparation.waitForFinished();
+  pipeline.cancel();
+  pipeline.wait();
+  tiles.clear();
   model = new QtMosaicDatabaseModel(database, this);
-  processor.model = model;
+  renderer.setModel(model);
   model->setConversionMethod(conversion_method);
   model->build();
 }
 
-void QtMosaicBuilder::create(const QPixmap* pixmap, int mosaicHeight, int mosaicWidth, float outputRatio)
+void QtMosaicBuilder::create(const QPixmap* pixmap, int mosaicHeight, int mosaicWidth, float outputRatio, const SearchOptions& searchOptions)
 {
   if(pixmap == NULL)
   {
     return; 
   }
 
-  this->mosaicHeight = mosaicHeight;
-  this->mosaicWidth = mosaicWidth;
-  this->outputRatio = outputRatio;
-
-  image = pixmap->toImage();
-  processImage(image);
-}
-
-void QtMosaicBuilder::createParts(QImage& image)
-{
-  QProgressDialog progress("Destruction in progress.", "Cancel", 0, (image.height() + 1) * (image.width() + 1) / (mosaicHeight * mosaicWidth), dynamic_cast<QWidget*>(this->parent()));
-  progress.setWindowModality(Qt::WindowModal);;
+  renderer.setTileSize(mosaicHeight, mosaicWidth);
+  renderer.setOutputRatio(outputRatio);
+  renderer.setSearchOptions(searchOptions);
 
-  imageParts.clear();
-  int k = 0;
-  for(int j = 0; j < image.height(); j += mosaicHeight)
+  // A render still going on is dropped, its workers still use the tiles
+  preparation.waitForFinished();
+  pipeline.cancel();
+  pipeline.wait();
+  timer->stop();
+  if(progress != NULL)
   {
-    for(int i = 0; i < image.width(); i += mosaicWidth)
-    {
-      progress.setValue(k);
-      imageParts.push_back(image.copy(i, j, mosaicWidth, mosaicHeight).scaled(processor.model->scalingFactor, processor.model->scalingFactor));
-      ++k;
-      if(progress.wasCanceled())
-      {
-        return;
-      }
-    }
+    progress->deleteLater();
+    progress = NULL;
   }
-}
 
-void QtMosaicBuilder::processImage(QImage& image)
-{
-  createParts(image);
+  image = pixmap->toImage();
+  searchStatistics = SearchStatistics();
+  tiles.clear();
 
-  future = QtConcurrent::map(imageParts, processor);
-  progress = new QProgressDialog("Operation in progress.", "Cancel", future.progressMinimum(), future.progressMaximum(), dynamic_cast<QWidget*>(this->parent()));
-  progress->setWindowModality(Qt::WindowModal);;
+  // The dialog is not modal, the GUI thread only polls the workers and stays responsive
+  progress = new QProgressDialog("Rendering in progress.", "Cancel", 0, 0, dynamic_cast<QWidget*>(this->parent()));
   connect(progress, SIGNAL(canceled()), this, SLOT(cancel()));
-  timer = new QTimer(this);
-  connect(timer, SIGNAL(timeout()), this, SLOT(update()));
-  timer->start(0);
+  prepared = false;
+  preparation = QtConcurrent::run(this, &QtMosaicBuilder::prepare);
+  timer->start(poll_interval);
 }
 
-void QtMosaicBuilder::QtMosaicProcessor::operator()(QImage& image)
+void QtMosaicBuilder::prepare()
 {
-  QImage thumbnail = image.scaled(model->scalingFactor, model->scalingFactor);
-
-  if(model->getThumbnails().empty())
+  matchKey = renderer.getMatchKey(image);
+  MatchMap map;
+  restored = matchMaps.find(matchKey, map);
+  restoredParts.clear();
+  if(restored)
   {
-    return;
+    renderer.restoreMatches(map, restoredParts);
   }
 
-  int best = model->getTree().getClosestThumbnail(thumbnail);
-  if(best >= 0)
+  QSize size = renderer.getOutputSize(image.size());
+  canvas = progressive && !restored ? renderer.renderProxy(image, proxy_parts) : QImage();
+  if(canvas.isNull())
   {
-    image = adaptImage(model->getParallelDatabase()[best].second, image);
+    canvas = image.scaled(size.width(), size.height()).convertToFormat(QImage::Format_RGB32);
   }
 }
 
-void QtMosaicBuilder::reconstructImage(QImage& image, const QVector<QImage>& vector) const
+void QtMosaicBuilder::startRender()
 {
-  QProgressDialog progress("Reconstruction in progress.", "Cancel", 0, vector.size(), dynamic_cast<QWidget*>(this->parent()));
-  progress.setWindowModality(Qt::WindowModal);;
-
-  image = image.scaled(image.width() * outputRatio, image.height() * outputRatio);
-  QPainter painter(&image);
-
-  int k = 0;
-  int widthOutSize = mosaicWidth * outputRatio;
-  int heightOutSize = mosaicHeight * outputRatio;
-  for(int j = 0; j < image.height(); j += heightOutSize)
+  if(progressive)
   {
-    for(int i = 0; i < image.width(); i += widthOutSize)
-    {
-      progress.setValue(k);
-      painter.drawImage(i, j, vector[k].scaled(mosaicWidth * outputRatio, mosaicHeight * outputRatio));
-      ++k;
-      if(progress.wasCanceled())
-      {
-        return;
-      }
-    }
+    QElapsedTimer cost;
+    cost.start();
+    emit updateMosaic(canvas);
+    repaintCost = cost.elapsed();
+    repaintTimer.start();
   }
-}
-
-void computeMeans(const QImage& image, long& red, long& green, long& blue)
-{
-  red = 0;
-  green = 0;
-  blue = 0;
 
-  for(int j = 0; j < image.height(); ++j)
+  if(restored)
   {
-    for(int i = 0; i < image.width(); ++i)
-    {
-      const QRgb& rgb = image.pixel(i, j);
-      red += qRed(rgb);
-      green += qGreen(rgb);
-      blue += qBlue(rgb);
-    }
+    pipeline.start(renderer, image.size(), restoredParts, canvas, tiles);
+    restoredParts.clear();
   }
-
-  red /= image.height() * image.width();
-  green /= image.height() * image.width();
-  blue /= image.height() * image.width();
-}
-
-QImage adaptImage(const QImage& image, const QImage& reference)
-{
-  long red_ref, blue_ref, green_ref;
-  long red_img, blue_img, green_img;
-  computeMeans(reference, red_ref, green_ref, blue_ref);
-  computeMeans(image, red_img, green_img, blue_img);
-
-  QImage newImage = image;
-  for(int j = 0; j < newImage.height(); ++j)
+  else
   {
-    for(int i = 0; i < newImage.width(); ++i)
-    {
-      const QRgb& rgb = newImage.pixel(i, j);
-      int red = qRed(rgb) + (red_ref - red_img);
-      int blue = qBlue(rgb) + (blue_ref - blue_img);
-      int green = qGreen(rgb) + (green_ref - green_ref);
-      red = std::min(std::max(0, red), 255);
-      blue = std::min(std::max(0, blue), 255);
-      green = std::min(std::max(0, green), 255);
-      newImage.setPixel(i, j, qRgb(red, green, blue));
-    }
+    pipeline.start(renderer, image, canvas, tiles);
   }
-  return newImage;
+  canvas = QImage();
+  progress->setMaximum(pipeline.getProgressMaximum());
 }
 
 float QtMosaicBuilder::QtMosaicProcessor::distance(const QImage& image1, const QImage& image2)
@@ -180,26 +155,114 @@ float QtMosaicBuilder::QtMosaicProcessor::distance(const QRgb& rgb1, const QRgb&
 
 void QtMosaicBuilder::update()
 {
-  if(future.isCanceled() && future.isFinished())
+  if(!prepared)
   {
+    if(!preparation.isFinished())
+    {
+      return;
+    }
+    prepared = true;
+    if(!progress->wasCanceled())
+    {
+      startRender();
+      return;
+    }
     timer->stop();
     progress->deleteLater();
+    progress = NULL;
+    return;
+  }
+
+  bool finished = pipeline.isFinished();
+  if(pipeline.isCanceled())
+  {
+    if(finished)
+    {
+      timer->stop();
+      progress->deleteLater();
+      progress = NULL;
+    }
     return;
   }
 
-  progress->setValue(future.progressValue());
-  if(!future.isCanceled() && future.isFinished())
+  progress->setValue(pipeline.getProgressValue());
+  if(finished)
   {
-    reconstructImage(image, imageParts);
-    emit updateMosaic(image);
+    searchStatistics = pipeline.getSearchStatistics();
+    if(!restored)
+    {
+      MatchMap map;
+      renderer.storeMatches(matchKey, image.size(), pipeline.getParts(), map);
+      matchMaps.insert(map);
+    }
+    emit updateMosaic(pipeline.getMosaic());
+    printStatistics();
     timer->stop();
     progress->deleteLater();
+    progress = NULL;
+    return;
+  }
+
+  // Copying and converting the mosaic for the display takes as long as a few batches on large outputs
+  if(progressive && repaintTimer.elapsed() >= std::max(repaint_interval, repaint_share * repaintCost))
+  {
+    QElapsedTimer cost;
+    cost.start();
+    QImage snapshot = pipeline.takeSnapshot();
+    if(!snapshot.isNull())
+    {
+      emit updateMosaic(snapshot);
+      repaintCost = cost.elapsed();
+      repaintTimer.restart();
+    }
+  }
+}
+
+void QtMosaicBuilder::printStatistics() const
+{
+  if(searchStatistics.queries == 0)
+  {
+    return;
+  }
+  double queries = searchStatistics.queries;
+  // The tree is neither searched nor pruned under the other backends, their counters are printed as they mean
+  const ThumbnailIndex& index = model->getIndex();
+  if(dynamic_cast<const BruteForceIndex*>(&index) != NULL)
+  {
+    qDebug().nospace() << searchStatistics.queries << " tiles matched by brute force, per tile: " << searchStatistics.leaf_members / queries << " thumbnails scanned, "
+      << searchStatistics.distances / queries << " exact distances";
+    return;
+  }
+  if(dynamic_cast<const IvfPqIndex*>(&index) != NULL)
+  {
+    qDebug().nospace() << searchStatistics.queries << " tiles matched by the inverted file, per tile: " << searchStatistics.visited_nodes / queries << " lists probed, "
+      << searchStatistics.leaf_members / queries << " codes scanned, " << searchStatistics.distances / queries << " distances, "
+      << searchStatistics.pruned_subtrees / queries << " lists skipped (" << 100 * searchStatistics.getPruningRatio() << "%)";
+    return;
+  }
+  qDebug().nospace() << searchStatistics.queries << " tiles matched, per tile: " << searchStatistics.visited_nodes / queries << " nodes visited, "
+    << searchStatistics.leaf_members / queries << " leaf members scanned, " << searchStatistics.distances / queries << " distances, "
+    << searchStatistics.pruned_subtrees / queries << " subtrees pruned (" << 100 * searchStatistics.getPruningRatio() << "%)";
+
+  TreeStatistics tree = model->getTree().getStatistics();
+  QStringList leaf_sizes;
+  for(std::size_t i = 0; i < tree.leaf_sizes.size(); ++i)
+  {
+    leaf_sizes << QString("%1+: %2").arg(1L << i).arg(tree.leaf_sizes[i]);
+  }
+  QStringList radii;
+  for(std::size_t i = 0; i < tree.radii.size(); ++i)
+  {
+    radii << QString::number(tree.radii[i], 'f', 1);
   }
+  qDebug().nospace() << "Antipole tree: " << tree.nodes << " nodes, " << tree.leaves << " leaves, depth " << tree.depth;
+  qDebug().nospace() << "  leaf sizes " << qPrintable(leaf_sizes.join(", "));
+  qDebug().nospace() << "  mean radius per depth " << qPrintable(radii.join(" "));
 }
 
 void QtMosaicBuilder::cancel()
 {
-  future.cancel();
+  pipeline.cancel();
 }
 
 long QtMosaicBuilder::getDatabaseSize() const
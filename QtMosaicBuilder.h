@@ -5,12 +5,17 @@
 #ifndef QTMOSAICBUILDER_H
 #define QTMOSAICBUILDER_H
 
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qfuture.h>
 #include <QtCore/qobject.h>
-#include <QtCore/qvector.h>
 #include <QtCore/qtimer.h>
 #include <QtGui/qpixmap.h>
 #include <QtWidgets/qprogressdialog.h>
-#include <QtConcurrent/QtConcurrentMap>
+
+#include "AntipoleTree.h"
+#include "MatchMap.h"
+#include "QtMosaicRenderer.h"
+#include "RenderPipeline.h"
 
 class QtMosaicDatabaseModel;
 
@@ -20,17 +25,18 @@ class QtMosaicBuilder: public QObject
 
 public:
   QtMosaicBuilder(QObject* parent = NULL);
+  /// Waits for the preparation of a render still going on
+  ~QtMosaicBuilder();
 
   void build(const QString& database, int conversion_method = 0);
-  void create(const QPixmap* pixmap, int mosaicHeight, int mosaicWidth, float outputRatio);
+  /// The search options trade the exactness of the matches for speed
+  void create(const QPixmap* pixmap, int mosaicHeight, int mosaicWidth, float outputRatio, const SearchOptions& searchOptions = SearchOptions());
+  /// Shows a coarse mosaic at once, then the rows of the mosaic as they are composited, instead of the mosaic once it is done
+  void setProgressive(bool progressive);
 
   class QtMosaicProcessor
   {
   public:
-    void operator()(QImage& image);
-
-    QtMosaicDatabaseModel* model;
-
     static float distance(const QImage& image1, const QImage& image2);
     static float distance(const QRgb& rgb1, const QRgb& rgb2);
   };
@@ -38,25 +44,45 @@ public:
   long getDatabaseSize() const;
   long getDatabaseDefaultHeight() const;
   long getDatabaseDefaultWidth() const;
+  /// Work done by the queries of the last mosaic
+  const SearchStatistics& getSearchStatistics() const
+  {
+    return searchStatistics;
+  }
 
 private:
-  void processImage(QImage& image);
-  void createParts(QImage& image);
-  void reconstructImage(QImage& image, const QVector<QImage>& vector) const;
+  /// Prints the counters of the last queries as the active backend means them, and the shape of the tree when it was searched
+  void printStatistics() const;
+  /// Hashes the target, looks for its match map and renders the coarse mosaic, on a worker
+  void prepare();
+  /// Shows the prepared canvas and starts the pipeline, once the preparation is done
+  void startRender();
 
-  QFuture<void> future;
   QProgressDialog* progress;
   QTimer* timer;
 
-  QtMosaicProcessor processor;
+  QtMosaicRenderer renderer;
   QtMosaicDatabaseModel* model;
 
   QImage image;
-  QVector<QImage> imageParts;
-
-  int mosaicHeight;
-  int mosaicWidth;
-  float outputRatio;
+  /// Matches of earlier renders, a render of a known target goes straight to the compositing
+  MatchMapCache matchMaps;
+  QByteArray matchKey;
+  bool restored;
+  QFuture<void> preparation;
+  bool prepared;
+  /// Shown until the mosaic is composited, the coarse mosaic or the scaled target
+  QImage canvas;
+  QVector<ImagePart> restoredParts;
+
+  bool progressive;
+  TileCache tiles;
+  /// Describes, matches and composites the target on the workers, the GUI thread only polls it
+  RenderPipeline pipeline;
+  QElapsedTimer repaintTimer;
+  qint64 repaintCost;
+
+  SearchStatistics searchStatistics;
 
 public slots:
   void update();
@@ -66,7 +92,4 @@ signals:
   void updateMosaic(QImage image);
 };
 
-QImage adaptImage(const QImage& image, const QImage& reference);
-void computeMeans(const QImage& image, long& red, long& green, long& blue);
-
 #endif
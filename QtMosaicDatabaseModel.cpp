@@ -2,18 +2,25 @@
  * \file QtModaicDatabaseModel.cpp
  */
 
+#include <QtCore/QCryptographicHash>
 #include <QtCore/qfile.h>
 #include <QtCore/qfileinfo.h>
 #include <QtGui/qpixmap.h>
-#include <QtWidgets/QMessageBox>
 
 #include <algorithm>
 #include <stdexcept>
 
+#include "ColorConversion.h"
 #include "QtMosaicDatabaseModel.h"
 
+namespace
+{
+  /// Thumbnails converted at once when the inverted file is built
+  const long descriptor_chunk_size = 65536;
+}
+
 QtMosaicDatabaseModel::QtMosaicDatabaseModel(const QString& filename, QObject* parent)
-  :QAbstractListModel(parent), conversion_method(0)
+  :QAbstractListModel(parent), backend(TreeBackend), conversion_method(0), built(false), meansComputed(0)
 {
   if(filename != "")
   {
@@ -28,6 +35,7 @@ QtMosaicDatabaseModel::~QtMosaicDatabaseModel(void)
 void QtMosaicDatabaseModel::reset()
 {
   database.clear();
+  resetContentChecksum();
   beginResetModel();
   endResetModel();
 }
@@ -40,13 +48,14 @@ void QtMosaicDatabaseModel::setConversionMethod(int conversion_method)
 void QtMosaicDatabaseModel::open(const QString& filename)
 {
   reset();
+  this->filename = filename;
   QFile file(filename);
   file.open(QIODevice::ReadOnly);
   QDataStream openedFile(&file);
 
-  int version;
+  int version = 0;
   openedFile >> version; // Version
-  int size;
+  int size = 0;
   openedFile >> size;
   for(int i = 0; i < size; ++i)
   {
@@ -60,6 +69,7 @@ void QtMosaicDatabaseModel::open(const QString& filename)
 
 void QtMosaicDatabaseModel::save(const QString& filename)
 {
+  this->filename = filename;
   QFile file(filename);
   file.open(QIODevice::WriteOnly);
   QDataStream openedFile(&file);
@@ -73,9 +83,17 @@ void QtMosaicDatabaseModel::save(const QString& filename)
     openedFile << it->first;
     openedFile << it->second;
   }
+  file.close();
+
+  // The index follows the incremental changes, it is saved against the new file
+  if(built && backend != InvertedFileBackend)
+  {
+    tree.compact();
+    tree.save(indexFilename(), computeChecksum());
+  }
 }
 
-int QtMosaicDatabaseModel::rowCount(const QModelIndex &parent) const
+int QtMosaicDatabaseModel::rowCount(const QModelIndex &) const
 {
   return database.size();
 }
@@ -119,6 +137,38 @@ void QtMosaicDatabaseModel::addElement(const QString& filename)
     return;
   }
   database.append(std::make_pair(filename, createThumbnail(filename)));
+  resetContentChecksum();
+
+  if(built)
+  {
+    const Database::value_type& image = database.back();
+    parallelDatabase.push_back(std::make_pair(image.first, image.second.toImage()));
+    if(meansComputed.loadAcquire())
+    {
+      means.push_back(ColorConversion::computeMean(parallelDatabase.back().second));
+    }
+    std::vector<float> descriptor(descriptorDimension);
+    convertThumbnail(parallelDatabase.size() - 1, &descriptor[0]);
+    if(backend != InvertedFileBackend)
+    {
+      tree.insert(descriptor, database.size() - 1);
+    }
+    // The backend is updated in place, and only selected again when the database crosses a threshold
+    if(getPreferredBackend(parallelDatabase.size()) != backend)
+    {
+      selectIndex();
+    }
+    else if(backend == BruteForceBackend)
+    {
+      // Same values as the ones it is built from, the ones the tree stores
+      tree.quantize(&descriptor[0], &descriptor[0], descriptor.size());
+      bruteForceIndex.insert(descriptor, database.size() - 1);
+    }
+    else if(backend == InvertedFileBackend)
+    {
+      ivfPqIndex.insert(descriptor, database.size() - 1);
+    }
+  }
 }
 
 void QtMosaicDatabaseModel::removeElement(const QString& filename)
@@ -126,7 +176,34 @@ void QtMosaicDatabaseModel::removeElement(const QString& filename)
   Database::iterator it = std::find_if(database.begin(), database.end(), [&](Database::value_type& value){return value.first == filename;});
   if(it != database.end())
   {
+    int index = it - database.begin();
     database.erase(it);
+    resetContentChecksum();
+
+    if(built)
+    {
+      parallelDatabase.removeAt(index);
+      if(meansComputed.loadAcquire())
+      {
+        means.remove(index);
+      }
+      if(backend != InvertedFileBackend)
+      {
+        tree.remove(index);
+      }
+      if(getPreferredBackend(parallelDatabase.size()) != backend)
+      {
+        selectIndex();
+      }
+      else if(backend == BruteForceBackend)
+      {
+        bruteForceIndex.remove(index);
+      }
+      else if(backend == InvertedFileBackend)
+      {
+        ivfPqIndex.remove(index);
+      }
+    }
   }
 }
 
@@ -134,12 +211,187 @@ void QtMosaicDatabaseModel::build()
 {
   Database::value_type image;
   tree.setConversionMethod(conversion_method);
+  tree.setDescriptorStorage(QuantizedStorage);
 
+  // The thumbnails are only scaled down and averaged when an index is built or a mean is needed
   foreach(image, database)
   {
-    QImage temp = image.second.scaled(scalingFactor, scalingFactor).toImage();
-    thumbnails.push_back(temp);
     parallelDatabase.push_back(std::make_pair(image.first, image.second.toImage()));
   }
-  tree.build(thumbnails);
+  means.clear();
+  meansComputed.storeRelease(0);
+  resetContentChecksum();
+
+  if(IvfPqIndex::isPreferred(parallelDatabase.size()))
+  {
+    // Very large databases are only matched through the inverted file, selected below
+  }
+  else if(filename.isEmpty())
+  {
+    tree.build(convertThumbnails(), descriptorDimension);
+  }
+  else
+  {
+    QByteArray checksum = computeChecksum();
+    if(!tree.load(indexFilename(), checksum))
+    {
+      tree.build(convertThumbnails(), descriptorDimension);
+      tree.save(indexFilename(), checksum);
+    }
+  }
+  selectIndex();
+  built = true;
+}
+
+void QtMosaicDatabaseModel::selectIndex()
+{
+  bruteForceIndex = BruteForceIndex();
+  ivfPqIndex = IvfPqIndex();
+  backend = getPreferredBackend(parallelDatabase.size());
+  if(backend == InvertedFileBackend)
+  {
+    buildInvertedFile();
+    // The codes of the inverted file are the only copy of the descriptors
+    tree.build(std::vector<float>(), 0);
+    return;
+  }
+  if(tree.getDimension() == 0 && !parallelDatabase.empty())
+  {
+    tree.build(convertThumbnails(), descriptorDimension);
+  }
+  if(backend == BruteForceBackend)
+  {
+    bruteForceIndex.build(tree.getThumbnails(), tree.getDimension());
+  }
+}
+
+QtMosaicDatabaseModel::Backend QtMosaicDatabaseModel::getPreferredBackend(long size)
+{
+  if(IvfPqIndex::isPreferred(size))
+  {
+    return InvertedFileBackend;
+  }
+  if(BruteForceIndex::isPreferred(size, descriptorDimension))
+  {
+    return BruteForceBackend;
+  }
+  return TreeBackend;
+}
+
+void QtMosaicDatabaseModel::buildInvertedFile()
+{
+  // Descriptors are converted a chunk at a time, so that the database is never held in float
+  long dimension = descriptorDimension;
+  long size = parallelDatabase.size();
+  long training_count = std::min(size, ivfPqIndex.getParameters().training_size);
+  std::vector<float> descriptors(training_count * dimension);
+  for(long i = 0; i < training_count; ++i)
+  {
+    convertThumbnail(i * size / training_count, &descriptors[i * dimension]);
+  }
+  ivfPqIndex.train(descriptors, dimension, size);
+
+  for(long begin = 0; begin < size; begin += descriptor_chunk_size)
+  {
+    long end = std::min(size, begin + descriptor_chunk_size);
+    descriptors.resize((end - begin) * dimension);
+    for(long i = begin; i < end; ++i)
+    {
+      convertThumbnail(i, &descriptors[(i - begin) * dimension]);
+    }
+    ivfPqIndex.add(descriptors);
+  }
+}
+
+void QtMosaicDatabaseModel::convertThumbnail(int index, float* descriptor) const
+{
+  // Area averages, as the parts of the targets are described, instead of the pixels sampled by a scale down
+  const QImage& thumbnail = parallelDatabase[index].second;
+  QRgb grid[scalingFactor * scalingFactor];
+  ColorConversion::averageCells(thumbnail, thumbnail.rect(), scalingFactor, grid);
+  ColorConversion::convertScanline(grid, scalingFactor * scalingFactor, tree.getConversionMethod(), descriptor);
+}
+
+std::vector<float> QtMosaicDatabaseModel::convertThumbnails() const
+{
+  std::vector<float> descriptors(parallelDatabase.size() * descriptorDimension);
+  for(int i = 0; i < parallelDatabase.size(); ++i)
+  {
+    convertThumbnail(i, &descriptors[i * descriptorDimension]);
+  }
+  return descriptors;
+}
+
+const QVector<QRgb>& QtMosaicDatabaseModel::getMeans() const
+{
+  if(!meansComputed.loadAcquire())
+  {
+    QMutexLocker locker(&meansMutex);
+    if(!meansComputed.load())
+    {
+      means.clear();
+      for(int i = 0; i < parallelDatabase.size(); ++i)
+      {
+        means.push_back(ColorConversion::computeMean(parallelDatabase[i].second));
+      }
+      meansComputed.storeRelease(1);
+    }
+  }
+  return means;
+}
+
+QString QtMosaicDatabaseModel::indexFilename() const
+{
+  return filename + ".index";
+}
+
+QByteArray QtMosaicDatabaseModel::computeContentChecksum() const
+{
+  QMutexLocker locker(&contentChecksumMutex);
+  if(!contentChecksum.isEmpty())
+  {
+    return contentChecksum;
+  }
+
+  // Matches follow the descriptors the index compares, a thumbnail replaced under the same name changes them
+  QCryptographicHash hash(QCryptographicHash::Md5);
+  std::vector<float> descriptors = tree.getThumbnails();
+  bool indexed = static_cast<long>(descriptors.size()) == static_cast<long>(parallelDatabase.size()) * descriptorDimension;
+  std::vector<float> descriptor(descriptorDimension);
+  for(int i = 0; i < parallelDatabase.size(); ++i)
+  {
+    QByteArray name = parallelDatabase[i].first.toUtf8();
+    hash.addData(name.constData(), name.size());
+    // The inverted file keeps no descriptors, they are converted again
+    if(!indexed)
+    {
+      convertThumbnail(i, &descriptor[0]);
+    }
+    const float* values = indexed ? &descriptors[i * descriptorDimension] : &descriptor[0];
+    hash.addData(reinterpret_cast<const char*>(values), descriptorDimension * sizeof(float));
+  }
+  int scaling = scalingFactor;
+  hash.addData(reinterpret_cast<const char*>(&scaling), sizeof(scaling));
+  contentChecksum = hash.result();
+  return contentChecksum;
+}
+
+void QtMosaicDatabaseModel::resetContentChecksum()
+{
+  QMutexLocker locker(&contentChecksumMutex);
+  contentChecksum.clear();
+}
+
+QByteArray QtMosaicDatabaseModel::computeChecksum() const
+{
+  // The file was just read by open(), hashing it again reads it from the page cache
+  QCryptographicHash hash(QCryptographicHash::Md5);
+  QFile file(filename);
+  if(file.open(QIODevice::ReadOnly))
+  {
+    hash.addData(&file);
+  }
+  int scaling = scalingFactor;
+  hash.addData(reinterpret_cast<const char*>(&scaling), sizeof(scaling));
+  return hash.result();
 }
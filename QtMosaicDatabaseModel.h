@@ -6,9 +6,13 @@
 #define QTMOSAICDATABASEMODEL_H
 
 #include <QtCore/QAbstractListModel>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
 #include <QtCore/qlist.h>
 
 #include "AntipoleTree.h"
+#include "BruteForceIndex.h"
+#include "IvfPqIndex.h"
 
 class QtMosaicDatabaseModel :
   public QAbstractListModel
@@ -33,15 +37,15 @@ public:
   typedef QList<std::pair<QString, QImage> > ParallelDatabase;
   void build();
   void setConversionMethod(int conversion_method);
+  /// Checksum of the names and descriptors of the thumbnails in their order, computed once per content of the database
+  QByteArray computeContentChecksum() const;
 
-  const QVector<QImage>& getThumbnails() const
-  {
-    return thumbnails;
-  }
   const ParallelDatabase& getParallelDatabase() const
   {
     return parallelDatabase;
   }
+  /// Mean colors of the thumbnails of the parallel database, computed on the first call from any thread
+  const QVector<QRgb>& getMeans() const;
   const Database& getDatabase() const
   {
     return database;
@@ -50,21 +54,68 @@ public:
   {
     return tree;
   }
+  /// The backend used to match images, chosen from the size of the database
+  const ThumbnailIndex& getIndex() const
+  {
+    switch(backend)
+    {
+    case BruteForceBackend:
+      return bruteForceIndex;
+    case InvertedFileBackend:
+      return ivfPqIndex;
+    default:
+      return tree;
+    }
+  }
 
 private:
+  enum Backend
+  {
+    TreeBackend,
+    BruteForceBackend,
+    InvertedFileBackend
+  };
+
+  QString filename;
   Database database;
   ParallelDatabase parallelDatabase;
   AntipoleTree tree;
+  BruteForceIndex bruteForceIndex;
+  IvfPqIndex ivfPqIndex;
+  Backend backend;
   int conversion_method;
+  bool built;
+
+  mutable QVector<QRgb> means;
+  mutable QMutex meansMutex;
+  mutable QAtomicInt meansComputed;
 
-  QVector<QImage> thumbnails;
+  mutable QByteArray contentChecksum;
+  mutable QMutex contentChecksumMutex;
 
   static QPixmap createThumbnail(const QString& filename);
+  QString indexFilename() const;
+  /// Drops the content checksum when the thumbnails change
+  void resetContentChecksum();
+  /**
+   * Checksum of the content of the database file and of the thumbnail size. The file is hashed whole: its size and
+   * modification time would be cheaper, but they are kept by copies and by rewrites within the resolution of the time
+   */
+  QByteArray computeChecksum() const;
+  /// Converts the area averages of a grid of the descriptor size over a thumbnail of the parallel database
+  void convertThumbnail(int index, float* descriptor) const;
+  std::vector<float> convertThumbnails() const;
+  void selectIndex();
+  /// The backend matching a database of the given size
+  static Backend getPreferredBackend(long size);
+  void buildInvertedFile();
 
 public:
   static const int scalingFactor = 3;
   static const int widthFactor = 16;
   static const int heightFactor = 12;
+  /// Values of the descriptor of a thumbnail, three per pixel
+  static const int descriptorDimension = 3 * scalingFactor * scalingFactor;
 };
 
 #endif // QTMOSAICDATABASEMODEL_H
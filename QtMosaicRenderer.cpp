@@ -0,0 +1,616 @@
+/**
+ * \file QtMosaicRenderer.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QThreadPool>
+
+#include "ColorConversion.h"
+#include "MatchMap.h"
+#include "QtMosaicDatabaseModel.h"
+#include "QtMosaicRenderer.h"
+#include "ScanlineReader.h"
+#include "TiffStripWriter.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QTMOSAICRENDERER_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+  /// Bytes of scaled thumbnails kept from one strip to the next
+  const qint64 strip_cache_size = 256 << 20;
+
+  int clampChannel(int value)
+  {
+    return std::min(std::max(0, value), 255);
+  }
+
+  /// Copies pixels shifting their channels, saturating at 0 and 255
+  void shiftPixels(const QRgb* source, QRgb* target, int count, int red_shift, int green_shift, int blue_shift)
+  {
+    int x = 0;
+#if defined(QTMOSAICRENDERER_SSE2)
+    // Positive shifts are added and negative ones subtracted, both with unsigned saturation, the alpha byte is left as is
+    QRgb add = qRgba(std::max(0, red_shift), std::max(0, green_shift), std::max(0, blue_shift), 0);
+    QRgb subtract = qRgba(std::max(0, -red_shift), std::max(0, -green_shift), std::max(0, -blue_shift), 0);
+    __m128i adds = _mm_set1_epi32(static_cast<int>(add));
+    __m128i subtracts = _mm_set1_epi32(static_cast<int>(subtract));
+    for(; x + 4 <= count; x += 4)
+    {
+      __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+      pixels = _mm_subs_epu8(_mm_adds_epu8(pixels, adds), subtracts);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + x), pixels);
+    }
+#endif
+    for(; x < count; ++x)
+    {
+      target[x] = qRgb(clampChannel(qRed(source[x]) + red_shift), clampChannel(qGreen(source[x]) + green_shift), clampChannel(qBlue(source[x]) + blue_shift));
+    }
+  }
+
+  /// Copies the adapted thumbnails of a row of parts into the output, size is the size of the output and of its tiles
+  void composeRow(uchar* bits, int bytes_per_line, const QSize& size, const QSize& tile, const ImagePart* parts, int columns, int top, const TileCache& tiles)
+  {
+    int bottom = std::min(size.height(), top + tile.height());
+    for(int i = 0; i < columns; ++i)
+    {
+      const ImagePart& part = parts[i];
+      int left = i * tile.width();
+      int count = std::min(size.width(), left + tile.width()) - left;
+      if(part.thumbnail < 0 || count <= 0)
+      {
+        continue;
+      }
+      const QImage* thumbnail = tiles.get(part.thumbnail);
+      if(thumbnail == NULL)
+      {
+        continue;
+      }
+      bool shifted = part.red_shift != 0 || part.green_shift != 0 || part.blue_shift != 0;
+      for(int y = top; y < bottom; ++y)
+      {
+        const QRgb* source = reinterpret_cast<const QRgb*>(thumbnail->constScanLine(y - top));
+        QRgb* target = reinterpret_cast<QRgb*>(bits + static_cast<qint64>(y) * bytes_per_line) + left;
+        if(shifted)
+        {
+          shiftPixels(source, target, count, part.red_shift, part.green_shift, part.blue_shift);
+        }
+        else
+        {
+          std::memcpy(target, source, count * sizeof(QRgb));
+        }
+      }
+    }
+  }
+}
+
+TileCache::TileCache()
+  :height(0), width(0), maximum_size(0)
+{
+}
+
+void TileCache::prepare(const QtMosaicDatabaseModel& model, const ImagePart* parts, int count, int height, int width)
+{
+  if(height != this->height || width != this->width)
+  {
+    clear();
+    this->height = height;
+    this->width = width;
+  }
+
+  std::vector<std::pair<long, QImage> > missing;
+  addMissing(parts, count, missing);
+  if(maximum_size > 0 && 4LL * width * height * tiles.size() > maximum_size)
+  {
+    clear();
+    missing.clear();
+    addMissing(parts, count, missing);
+  }
+  const QtMosaicDatabaseModel::ParallelDatabase& database = model.getParallelDatabase();
+  QtConcurrent::blockingMap(missing, [&](std::pair<long, QImage>& tile)
+  {
+    tile.second = database[tile.first].second.scaled(width, height).convertToFormat(QImage::Format_RGB32);
+  });
+  for(std::vector<std::pair<long, QImage> >::const_iterator it = missing.begin(); it != missing.end(); ++it)
+  {
+    tiles.insert(it->first, it->second);
+  }
+}
+
+void TileCache::addMissing(const ImagePart* parts, int count, std::vector<std::pair<long, QImage> >& missing)
+{
+  for(const ImagePart* it = parts; it != parts + count; ++it)
+  {
+    if(it->thumbnail >= 0 && !tiles.contains(it->thumbnail))
+    {
+      tiles.insert(it->thumbnail, QImage());
+      missing.push_back(std::make_pair(it->thumbnail, QImage()));
+    }
+  }
+}
+
+const QImage* TileCache::get(long thumbnail) const
+{
+  QHash<long, QImage>::const_iterator it = tiles.constFind(thumbnail);
+  return it != tiles.constEnd() && !it->isNull() ? &*it : NULL;
+}
+
+bool TileCache::contains(const ImagePart* parts, int count) const
+{
+  for(const ImagePart* it = parts; it != parts + count; ++it)
+  {
+    if(it->thumbnail >= 0 && !tiles.contains(it->thumbnail))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TileCache::clear()
+{
+  tiles.clear();
+}
+
+void TileCache::setMaximumSize(qint64 maximum_size)
+{
+  this->maximum_size = maximum_size;
+}
+
+QtMosaicRenderer::QtMosaicRenderer(const QtMosaicDatabaseModel* model)
+  :model(model), mosaicHeight(1), mosaicWidth(1), outputRatio(1)
+{
+}
+
+void QtMosaicRenderer::setModel(const QtMosaicDatabaseModel* model)
+{
+  this->model = model;
+}
+
+void QtMosaicRenderer::setTileSize(int mosaicHeight, int mosaicWidth)
+{
+  this->mosaicHeight = mosaicHeight;
+  this->mosaicWidth = mosaicWidth;
+}
+
+void QtMosaicRenderer::setOutputRatio(float outputRatio)
+{
+  this->outputRatio = outputRatio;
+}
+
+void QtMosaicRenderer::setSearchOptions(const SearchOptions& searchOptions)
+{
+  this->searchOptions = searchOptions;
+}
+
+long QtMosaicRenderer::getPartCount(const QImage& image) const
+{
+  return static_cast<long>((image.height() + mosaicHeight - 1) / mosaicHeight) * getColumnCount(image);
+}
+
+int QtMosaicRenderer::getColumnCount(const QImage& image) const
+{
+  return getColumnCount(image.size());
+}
+
+int QtMosaicRenderer::getColumnCount(const QSize& size) const
+{
+  return (size.width() + mosaicWidth - 1) / mosaicWidth;
+}
+
+QSize QtMosaicRenderer::getOutputSize(const QSize& size) const
+{
+  return QSize(size.width() * outputRatio, size.height() * outputRatio);
+}
+
+QSize QtMosaicRenderer::getTileOutputSize() const
+{
+  return QSize(mosaicWidth * outputRatio, mosaicHeight * outputRatio);
+}
+
+QByteArray QtMosaicRenderer::getMatchKey(const QImage& image) const
+{
+  return MatchMap::computeKey(image, model->computeContentChecksum(), model->getTree().getConversionMethod(), mosaicHeight, mosaicWidth, searchOptions);
+}
+
+void QtMosaicRenderer::storeMatches(const QByteArray& key, const QSize& size, const QVector<ImagePart>& parts, MatchMap& map) const
+{
+  map.assign(key, model->computeContentChecksum(), model->getTree().getConversionMethod(), size, mosaicHeight, mosaicWidth, parts);
+}
+
+void QtMosaicRenderer::restoreMatches(const MatchMap& map, QVector<ImagePart>& parts) const
+{
+  map.restoreParts(parts);
+  adaptParts(parts);
+}
+
+void QtMosaicRenderer::cutParts(const QSize& size, QVector<ImagePart>& parts) const
+{
+  int rows = (size.height() + mosaicHeight - 1) / mosaicHeight;
+  int columns = (size.width() + mosaicWidth - 1) / mosaicWidth;
+  parts.resize(rows * columns);
+  ImagePart* data = parts.data();
+  for(int j = 0; j < rows; ++j)
+  {
+    for(int i = 0; i < columns; ++i)
+    {
+      ImagePart& part = data[j * columns + i];
+      part.rect = QRect(i * mosaicWidth, j * mosaicHeight, std::min(mosaicWidth, size.width() - i * mosaicWidth), std::min(mosaicHeight, size.height() - j * mosaicHeight));
+      part.thumbnail = -1;
+      part.distance = 0;
+      part.red_shift = 0;
+      part.green_shift = 0;
+      part.blue_shift = 0;
+    }
+  }
+}
+
+bool QtMosaicRenderer::createParts(const QImage& image, QVector<ImagePart>& parts, const Progress& progress) const
+{
+  cutParts(image.size(), parts);
+  int columns = getColumnCount(image);
+  int rows = columns > 0 ? parts.size() / columns : 0;
+  ImagePart* data = parts.data();
+  std::vector<int> ranges;
+  getCellColumns(data, columns, ranges);
+
+  // Rows are described in parallel, by batches so that the progress is reported from the calling thread
+  QImage pixels = image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32 ? image : image.convertToFormat(QImage::Format_ARGB32);
+  int batch_size = 4 * std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+  std::vector<int> batch;
+  for(int j = 0; j < rows; j += batch_size)
+  {
+    if(progress && !progress(j * columns))
+    {
+      return false;
+    }
+    batch.clear();
+    for(int k = j; k < std::min(rows, j + batch_size); ++k)
+    {
+      batch.push_back(k);
+    }
+    QtConcurrent::blockingMap(batch, [&](int row)
+    {
+      describeRow(pixels, data + row * columns, ranges);
+    });
+  }
+  return true;
+}
+
+void QtMosaicRenderer::describeRows(const QImage& image, ImagePart* parts, int columns, int count) const
+{
+  std::vector<int> ranges;
+  getCellColumns(parts, columns, ranges);
+  for(int j = 0; j < count; ++j)
+  {
+    describeRow(image, parts + j * columns, ranges);
+  }
+}
+
+void QtMosaicRenderer::getCellColumns(const ImagePart* parts, int columns, std::vector<int>& ranges) const
+{
+  // The pixel ranges of the cells are the same for all the rows of parts
+  const int cells = QtMosaicDatabaseModel::scalingFactor;
+  ranges.resize(2 * columns * cells);
+  for(int i = 0; i < columns; ++i)
+  {
+    for(int c = 0; c < cells; ++c)
+    {
+      ColorConversion::getCellRange(parts[i].rect.left(), parts[i].rect.width(), c, cells, ranges[2 * (i * cells + c)], ranges[2 * (i * cells + c) + 1]);
+    }
+  }
+}
+
+void QtMosaicRenderer::describeRow(const QImage& image, ImagePart* parts, const std::vector<int>& columns) const
+{
+  const int cells = QtMosaicDatabaseModel::scalingFactor;
+  long spans = columns.size() / 2;
+  long count = spans / cells;
+  int top = parts[0].rect.top();
+  int bottom = top + parts[0].rect.height();
+  int rows[2 * cells];
+  for(int c = 0; c < cells; ++c)
+  {
+    ColorConversion::getCellRange(top, bottom - top, c, cells, rows[2 * c], rows[2 * c + 1]);
+  }
+
+  // Sums of the channels of the cells of the row, and of the spans of the current scanline
+  std::vector<qint64> sums(3 * spans * cells, 0);
+  std::vector<qint64> line(3 * spans);
+  for(int y = top; y < bottom; ++y)
+  {
+    const QRgb* pixels = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+    for(long k = 0; k < spans; ++k)
+    {
+      qint64 red = 0;
+      qint64 green = 0;
+      qint64 blue = 0;
+      for(int x = columns[2 * k]; x < columns[2 * k + 1]; ++x)
+      {
+        red += qRed(pixels[x]);
+        green += qGreen(pixels[x]);
+        blue += qBlue(pixels[x]);
+      }
+      line[3 * k] = red;
+      line[3 * k + 1] = green;
+      line[3 * k + 2] = blue;
+    }
+    for(int c = 0; c < cells; ++c)
+    {
+      if(y < rows[2 * c] || y >= rows[2 * c + 1])
+      {
+        continue;
+      }
+      for(long k = 0; k < spans; ++k)
+      {
+        qint64* cell = &sums[3 * (((k / cells) * cells + c) * cells + k % cells)];
+        cell[0] += line[3 * k];
+        cell[1] += line[3 * k + 1];
+        cell[2] += line[3 * k + 2];
+      }
+    }
+  }
+
+  // Rounded as ColorConversion::averageCells rounds the cells of the thumbnails
+  int conversion_method = model->getTree().getConversionMethod();
+  QRgb grid[cells * cells];
+  for(long i = 0; i < count; ++i)
+  {
+    qint64 total[3] = {0, 0, 0};
+    qint64 area = 0;
+    for(int c = 0; c < cells; ++c)
+    {
+      for(int d = 0; d < cells; ++d)
+      {
+        long k = i * cells + d;
+        qint64 size = static_cast<qint64>(rows[2 * c + 1] - rows[2 * c]) * (columns[2 * k + 1] - columns[2 * k]);
+        const qint64* cell = &sums[3 * ((i * cells + c) * cells + d)];
+        grid[c * cells + d] = ColorConversion::averageSums(cell, size);
+        total[0] += cell[0];
+        total[1] += cell[1];
+        total[2] += cell[2];
+        area += size;
+      }
+    }
+    parts[i].color = ColorConversion::averageSums(total, area);
+    parts[i].descriptor.resize(3 * cells * cells);
+    ColorConversion::convertScanline(grid, cells * cells, conversion_method, &parts[i].descriptor[0]);
+  }
+}
+
+SearchStatistics QtMosaicRenderer::matchParts(QVector<ImagePart>& parts) const
+{
+  return matchParts(parts.data(), parts.size());
+}
+
+SearchStatistics QtMosaicRenderer::matchParts(ImagePart* parts, int count) const
+{
+  SearchStatistics statistics;
+  if(model->getDatabase().empty() || count == 0)
+  {
+    return statistics;
+  }
+
+  // The descriptors are moved to the queries, they are not needed once the parts are matched
+  std::vector<std::vector<float> > descriptors(count);
+  for(int i = 0; i < count; ++i)
+  {
+    descriptors[i].swap(parts[i].descriptor);
+  }
+
+  std::vector<SearchResult> matches = model->getIndex().search(descriptors, searchOptions);
+  for(int i = 0; i < count; ++i)
+  {
+    parts[i].thumbnail = matches[i].index;
+    parts[i].distance = matches[i].distance;
+    statistics += matches[i].statistics;
+  }
+  return statistics;
+}
+
+void QtMosaicRenderer::adaptPart(ImagePart& part) const
+{
+  if(part.thumbnail >= 0)
+  {
+    QRgb mean = model->getMeans()[part.thumbnail];
+    part.red_shift = qRed(part.color) - qRed(mean);
+    part.green_shift = qGreen(part.color) - qGreen(mean);
+    part.blue_shift = qBlue(part.color) - qBlue(mean);
+  }
+}
+
+void QtMosaicRenderer::adaptParts(QVector<ImagePart>& parts) const
+{
+  QtConcurrent::blockingMap(parts, [&](ImagePart& part)
+  {
+    adaptPart(part);
+  });
+}
+
+bool QtMosaicRenderer::reconstructImage(QImage& image, const QVector<ImagePart>& parts, const Progress& progress, TileCache* cache) const
+{
+  QSize target = image.size();
+  QSize size = getOutputSize(target);
+  QSize tile = getTileOutputSize();
+  int rows = (image.height() + mosaicHeight - 1) / mosaicHeight;
+  int columns = getColumnCount(image);
+
+  // The scaled target only shows where no thumbnail is copied
+  bool covered = !tile.isEmpty() && columns * tile.width() >= size.width() && rows * tile.height() >= size.height();
+  for(QVector<ImagePart>::const_iterator it = parts.begin(); covered && it != parts.end(); ++it)
+  {
+    covered = it->thumbnail >= 0;
+  }
+  image = covered ? QImage(size, QImage::Format_RGB32) : image.scaled(size.width(), size.height()).convertToFormat(QImage::Format_RGB32);
+
+  TileCache local_cache;
+  return composeRows(image, target, parts, 0, rows, cache != NULL ? *cache : local_cache, progress);
+}
+
+bool QtMosaicRenderer::composeRows(QImage& canvas, const QSize& size, const QVector<ImagePart>& parts, int begin, int end, TileCache& tiles, const Progress& progress) const
+{
+  QSize tile = getTileOutputSize();
+  int rows = (size.height() + mosaicHeight - 1) / mosaicHeight;
+  int columns = (size.width() + mosaicWidth - 1) / mosaicWidth;
+  begin = std::max(0, begin);
+  end = std::min(rows, end);
+  if(tile.isEmpty() || parts.size() != rows * columns || canvas.format() != QImage::Format_RGB32 || begin >= end)
+  {
+    return true;
+  }
+  prepareTiles(parts.constData() + begin * columns, (end - begin) * columns, tiles);
+
+  // Rows of parts cover disjoint bands of the output, the bits are taken once as scanLine() would detach from each thread
+  QSize output = canvas.size();
+  uchar* bits = canvas.bits();
+  int bytes_per_line = canvas.bytesPerLine();
+  int batch_size = 4 * std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+  std::vector<int> batch;
+  for(int j = begin; j < end; j += batch_size)
+  {
+    if(progress && !progress(j * columns))
+    {
+      return false;
+    }
+    batch.clear();
+    for(int k = j; k < std::min(end, j + batch_size); ++k)
+    {
+      batch.push_back(k);
+    }
+    QtConcurrent::blockingMap(batch, [&](int row)
+    {
+      composeRow(bits, bytes_per_line, output, tile, parts.constData() + row * columns, columns, row * tile.height(), tiles);
+    });
+  }
+  return true;
+}
+
+void QtMosaicRenderer::prepareTiles(const ImagePart* parts, int count, TileCache& tiles) const
+{
+  QSize tile = getTileOutputSize();
+  tiles.prepare(*model, parts, count, tile.height(), tile.width());
+}
+
+void QtMosaicRenderer::composeRows(uchar* bits, int bytesPerLine, const QSize& output, const ImagePart* parts, int columns, int begin, int end, const TileCache& tiles) const
+{
+  QSize tile = getTileOutputSize();
+  for(int j = begin; j < end && !tile.isEmpty(); ++j)
+  {
+    composeRow(bits, bytesPerLine, output, tile, parts + j * columns, columns, j * tile.height(), tiles);
+  }
+}
+
+QImage QtMosaicRenderer::renderProxy(const QImage& image, long maximumParts) const
+{
+  // The target is shrunk so that the same tiles cut it in few parts, the output ratio grows to compensate
+  double factor = std::ceil(std::sqrt(static_cast<double>(getPartCount(image)) / std::max(1L, maximumParts)));
+  if(factor <= 1)
+  {
+    return QImage();
+  }
+  QImage proxy = image.scaled(std::max(1, static_cast<int>(image.width() / factor)), std::max(1, static_cast<int>(image.height() / factor)), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+  QtMosaicRenderer coarse(*this);
+  coarse.setOutputRatio(static_cast<float>(outputRatio * factor));
+  QVector<ImagePart> parts;
+  coarse.createParts(proxy, parts);
+  coarse.matchParts(parts);
+  coarse.adaptParts(parts);
+  coarse.reconstructImage(proxy, parts);
+
+  QSize size = getOutputSize(image.size());
+  return proxy.scaled(size.width(), size.height()).convertToFormat(QImage::Format_RGB32);
+}
+
+bool QtMosaicRenderer::renderStrips(const QString& target, const QString& output, int stripRows, RenderTimes* times, const Progress& progress) const
+{
+  RenderTimes local_times;
+  RenderTimes& stage_times = times != NULL ? *times : local_times;
+  QElapsedTimer timer;
+  timer.start();
+  // Strips only share the thumbnails that fit in the cache, large databases are not all scaled in memory
+  TileCache tiles;
+  tiles.setMaximumSize(strip_cache_size);
+
+  // The target is read once from top to bottom, a strip at a time
+  ScanlineReader reader;
+  if(!reader.open(target))
+  {
+    return false;
+  }
+  QSize size = reader.size();
+  if(!size.isValid() || size.isEmpty())
+  {
+    return false;
+  }
+  stage_times.read += timer.nsecsElapsed();
+
+  // Strips are scaled like whole images, so the mosaic has the same size as one reconstructed in memory
+  int stripHeight = std::max(1, stripRows) * mosaicHeight;
+  long outputHeight = 0;
+  for(int y = 0; y < size.height(); y += stripHeight)
+  {
+    outputHeight += static_cast<int>(std::min(stripHeight, size.height() - y) * outputRatio);
+  }
+  // A render that fails or is cancelled removes its output
+  TiffStripWriter writer;
+  if(!writer.open(output, static_cast<int>(size.width() * outputRatio), outputHeight, static_cast<int>(stripHeight * outputRatio)))
+  {
+    writer.abort();
+    return false;
+  }
+
+  int k = 0;
+  for(int y = 0; y < size.height(); y += stripHeight)
+  {
+    if(progress && !progress(k))
+    {
+      writer.abort();
+      return false;
+    }
+    timer.restart();
+    QImage strip = reader.read(std::min(stripHeight, size.height() - y));
+    if(strip.isNull())
+    {
+      writer.abort();
+      return false;
+    }
+    stage_times.read += timer.nsecsElapsed();
+
+    QVector<ImagePart> parts;
+    timer.restart();
+    createParts(strip, parts);
+    stage_times.cut += timer.nsecsElapsed();
+    timer.restart();
+    matchParts(parts);
+    stage_times.match += timer.nsecsElapsed();
+    timer.restart();
+    adaptParts(parts);
+    stage_times.adapt += timer.nsecsElapsed();
+    timer.restart();
+    reconstructImage(strip, parts, Progress(), &tiles);
+    stage_times.composite += timer.nsecsElapsed();
+    timer.restart();
+    if(!writer.write(strip))
+    {
+      writer.abort();
+      return false;
+    }
+    stage_times.write += timer.nsecsElapsed();
+    k += parts.size();
+  }
+  timer.restart();
+  bool closed = writer.close();
+  stage_times.write += timer.nsecsElapsed();
+  if(!closed)
+  {
+    QFile::remove(output);
+  }
+  return closed;
+}
@@ -0,0 +1,180 @@
+/**
+ * \file QtMosaicRenderer.h
+ */
+
+#ifndef QTMOSAICRENDERER
+#define QTMOSAICRENDERER
+
+#include <functional>
+#include <vector>
+
+#include <QtCore/qhash.h>
+#include <QtCore/qrect.h>
+#include <QtCore/qvector.h>
+#include <QtGui/qimage.h>
+
+#include "ThumbnailIndex.h"
+
+class MatchMap;
+class QtMosaicDatabaseModel;
+
+/**
+ * A tile of the target, referenced by its area: the pixels of the target are never copied into the parts
+ */
+struct ImagePart
+{
+  QRect rect;
+  /// Mean color of the area
+  QRgb color;
+  /// Area averages of the grid of the database, consumed by the matching
+  std::vector<float> descriptor;
+  long thumbnail;
+  /// Distance between the descriptors of the part and of its thumbnail
+  float distance;
+  /// Channel shifts that adapt the thumbnail to the color of the area
+  int red_shift;
+  int green_shift;
+  int blue_shift;
+};
+
+/**
+ * Thumbnails of the database scaled to the size of the output tiles: a thumbnail is scaled once, however many parts use it.
+ * A cache can be kept over the reconstructions of a render, as long as the database does not change.
+ * A cache with a maximum size starts again from the thumbnails being prepared when it would exceed it.
+ */
+class TileCache
+{
+public:
+  TileCache();
+
+  /// Scales in parallel the thumbnails of the parts that are not cached yet, the cache is emptied when the size changes
+  void prepare(const QtMosaicDatabaseModel& model, const ImagePart* parts, int count, int height, int width);
+  /// A thumbnail prepared for one of the parts, NULL if it was not prepared
+  const QImage* get(long thumbnail) const;
+  /// Whether the thumbnails of all the matched parts are prepared
+  bool contains(const ImagePart* parts, int count) const;
+  void clear();
+  /// Bytes the scaled thumbnails may take, 0 for no limit
+  void setMaximumSize(qint64 maximum_size);
+
+private:
+  /// Adds empty entries for the thumbnails of the parts that are not cached yet
+  void addMissing(const ImagePart* parts, int count, std::vector<std::pair<long, QImage> >& missing);
+
+  QHash<long, QImage> tiles;
+  int height;
+  int width;
+  qint64 maximum_size;
+};
+
+/**
+ * Time spent in each stage of a render, in nanoseconds
+ */
+struct RenderTimes
+{
+  qint64 read;
+  qint64 cut;
+  qint64 match;
+  qint64 adapt;
+  qint64 composite;
+  qint64 write;
+
+  RenderTimes()
+    :read(0), cut(0), match(0), adapt(0), composite(0), write(0)
+  {
+  }
+};
+
+/**
+ * The stages of a mosaic, without any user interface: the target image is cut in parts, the parts are matched
+ * against the database, the matched thumbnails are adapted to the colors of their part and composited.
+ */
+class QtMosaicRenderer
+{
+public:
+  /// Receives the number of parts done, returns false to cancel the stage
+  typedef std::function<bool(int)> Progress;
+
+  QtMosaicRenderer(const QtMosaicDatabaseModel* model = NULL);
+
+  void setModel(const QtMosaicDatabaseModel* model);
+  void setTileSize(int mosaicHeight, int mosaicWidth);
+  void setOutputRatio(float outputRatio);
+  void setSearchOptions(const SearchOptions& searchOptions);
+
+  /**
+   * Cuts the image in parts and computes their descriptors in a single pass over the scanlines, rows of parts in parallel.
+   * Returns false if the stage was cancelled
+   */
+  bool createParts(const QImage& image, QVector<ImagePart>& parts, const Progress& progress = Progress()) const;
+  /// Cuts an image of the given size in parts, without describing them
+  void cutParts(const QSize& size, QVector<ImagePart>& parts) const;
+  /// Describes count rows of columns parts from the calling thread, the image is RGB32 or ARGB32
+  void describeRows(const QImage& image, ImagePart* parts, int columns, int count) const;
+  /// Matches all the parts at once, returns the work done by the queries
+  SearchStatistics matchParts(QVector<ImagePart>& parts) const;
+  SearchStatistics matchParts(ImagePart* parts, int count) const;
+  /// Computes the shifts that adapt the thumbnail of a matched part to the color of the part
+  void adaptPart(ImagePart& part) const;
+  void adaptParts(QVector<ImagePart>& parts) const;
+  /**
+   * Scales the image by the output ratio and copies the adapted thumbnails of the parts in it, rows of parts in parallel.
+   * The scaled thumbnails are taken from the cache when one is given. Returns false if the stage was cancelled
+   */
+  bool reconstructImage(QImage& image, const QVector<ImagePart>& parts, const Progress& progress = Progress(), TileCache* cache = NULL) const;
+  /**
+   * Copies the adapted thumbnails of the rows [begin, end) of parts into an RGB32 canvas of the output size,
+   * size is the size of the image the parts were cut from. Returns false if the stage was cancelled
+   */
+  bool composeRows(QImage& canvas, const QSize& size, const QVector<ImagePart>& parts, int begin, int end, TileCache& tiles, const Progress& progress = Progress()) const;
+  /// Scales the thumbnails of matched parts that are not in the cache yet
+  void prepareTiles(const ImagePart* parts, int count, TileCache& tiles) const;
+  /**
+   * Copies the adapted thumbnails of the rows [begin, end) of parts from the calling thread into the bits of an RGB32 canvas
+   * of the output size, the tiles of the rows must be prepared
+   */
+  void composeRows(uchar* bits, int bytesPerLine, const QSize& output, const ImagePart* parts, int columns, int begin, int end, const TileCache& tiles) const;
+  /**
+   * Renders a coarse mosaic of the output size from a shrunk target, cut in at most about maximumParts parts.
+   * Returns a null image when the target has fewer parts than that
+   */
+  QImage renderProxy(const QImage& image, long maximumParts) const;
+
+  /**
+   * Renders a target without holding it or the mosaic in memory: the target is read a strip of tile rows at a time,
+   * each strip is matched, composited and appended to a TIFF file before the next one is read.
+   * Binary PPM/PGM and uncompressed TIFF targets are streamed, other formats are decoded once and only the mosaic is streamed then.
+   * The output is removed when the render fails or is cancelled.
+   */
+  bool renderStrips(const QString& target, const QString& output, int stripRows, RenderTimes* times = NULL, const Progress& progress = Progress()) const;
+
+  /// Key of the match map of an image with the current database, color space, tile size and search options
+  QByteArray getMatchKey(const QImage& image) const;
+  /// Records the matched parts of an image of the given size and match key in a match map
+  void storeMatches(const QByteArray& key, const QSize& size, const QVector<ImagePart>& parts, MatchMap& map) const;
+  /// Rebuilds the matched parts from a match map and adapts them, ready to be composited
+  void restoreMatches(const MatchMap& map, QVector<ImagePart>& parts) const;
+
+  /// Number of parts cut from an image
+  long getPartCount(const QImage& image) const;
+  /// Number of parts in a row of parts of an image
+  int getColumnCount(const QImage& image) const;
+  int getColumnCount(const QSize& size) const;
+  QSize getOutputSize(const QSize& size) const;
+  /// Size of the thumbnails in the output
+  QSize getTileOutputSize() const;
+
+private:
+  /// Averages the areas of a row of parts, columns holds the pixel ranges of the cells of the row
+  void describeRow(const QImage& image, ImagePart* parts, const std::vector<int>& columns) const;
+  /// Pixel ranges of the cells of a row of parts
+  void getCellColumns(const ImagePart* parts, int columns, std::vector<int>& ranges) const;
+
+  const QtMosaicDatabaseModel* model;
+  int mosaicHeight;
+  int mosaicWidth;
+  float outputRatio;
+  SearchOptions searchOptions;
+};
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * \file RenderPipeline.cpp
+ */
+
+#include <algorithm>
+
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QThreadPool>
+
+#include "RenderPipeline.h"
+
+namespace
+{
+  /// Parts in a batch, large enough for the batch searches of the indexes
+  const int batch_parts = 512;
+  /// Batches waiting in each queue, per worker
+  const int queue_batches = 2;
+}
+
+RenderPipeline::RenderPipeline()
+  :data(NULL), columns(0), rows(0), batchRows(1), batchCount(0), capacity(1), bits(NULL), bytesPerLine(0), tiles(NULL),
+  running(0), canceled(false), nextBatch(0), composedSinceSnapshot(false)
+{
+  std::fill(busy, busy + 3, 0);
+  std::fill(done, done + 3, 0);
+}
+
+RenderPipeline::~RenderPipeline()
+{
+  cancel();
+  wait();
+}
+
+void RenderPipeline::start(const QtMosaicRenderer& renderer, const QImage& image, const QImage& canvas, TileCache& tiles)
+{
+  cancel();
+  wait();
+  this->renderer = renderer;
+  this->image = image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32 ? image : image.convertToFormat(QImage::Format_ARGB32);
+  this->tiles = &tiles;
+  renderer.cutParts(image.size(), parts);
+  columns = renderer.getColumnCount(image.size());
+  run(canvas, false);
+}
+
+void RenderPipeline::start(const QtMosaicRenderer& renderer, const QSize& size, const QVector<ImagePart>& parts, const QImage& canvas, TileCache& tiles)
+{
+  cancel();
+  wait();
+  this->renderer = renderer;
+  image = QImage();
+  this->tiles = &tiles;
+  this->parts = parts;
+  columns = renderer.getColumnCount(size);
+  run(canvas, true);
+}
+
+void RenderPipeline::run(const QImage& canvas, bool restored)
+{
+  // The canvas is detached here, the copies shown while the render goes on are not written to
+  this->canvas = canvas.format() == QImage::Format_RGB32 ? canvas : canvas.convertToFormat(QImage::Format_RGB32);
+  bits = this->canvas.bits();
+  bytesPerLine = this->canvas.bytesPerLine();
+  data = parts.data();
+  rows = columns > 0 ? parts.size() / columns : 0;
+  batchRows = std::max(1, (batch_parts + columns - 1) / std::max(1, columns));
+  batchCount = (rows + batchRows - 1) / batchRows;
+
+  int threads = std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+  capacity = queue_batches * threads;
+  canceled = false;
+  composedSinceSnapshot = false;
+  statistics = SearchStatistics();
+  times = RenderTimes();
+  described.clear();
+  matched.clear();
+  std::fill(busy, busy + 3, 0);
+  done[Describe] = restored ? parts.size() : 0;
+  done[Match] = done[Describe];
+  done[Compose] = 0;
+  // Parts restored from a match map go straight to the compositing
+  nextBatch = restored ? batchCount : 0;
+  for(int batch = 0; restored && batch < batchCount; ++batch)
+  {
+    matched.push_back(batch);
+  }
+
+  workers.clear();
+  int count = std::min(threads, std::max(1, batchCount));
+  running = count;
+  for(int i = 0; i < count; ++i)
+  {
+    workers.push_back(QtConcurrent::run(this, &RenderPipeline::work));
+  }
+}
+
+void RenderPipeline::cancel()
+{
+  QMutexLocker locker(&mutex);
+  canceled = true;
+  condition.wakeAll();
+}
+
+void RenderPipeline::wait()
+{
+  for(QVector<QFuture<void> >::iterator it = workers.begin(); it != workers.end(); ++it)
+  {
+    it->waitForFinished();
+  }
+}
+
+bool RenderPipeline::isFinished() const
+{
+  QMutexLocker locker(&mutex);
+  return running == 0;
+}
+
+bool RenderPipeline::isCanceled() const
+{
+  QMutexLocker locker(&mutex);
+  return canceled;
+}
+
+int RenderPipeline::getProgressValue() const
+{
+  QMutexLocker locker(&mutex);
+  return done[Describe] + done[Match] + done[Compose];
+}
+
+int RenderPipeline::getProgressMaximum() const
+{
+  return 3 * parts.size();
+}
+
+QImage RenderPipeline::takeSnapshot()
+{
+  {
+    QMutexLocker locker(&mutex);
+    if(!composedSinceSnapshot)
+    {
+      return QImage();
+    }
+    composedSinceSnapshot = false;
+  }
+  QWriteLocker locker(&canvasLock);
+  return canvas.copy();
+}
+
+SearchStatistics RenderPipeline::getSearchStatistics() const
+{
+  QMutexLocker locker(&mutex);
+  return statistics;
+}
+
+RenderTimes RenderPipeline::getTimes() const
+{
+  QMutexLocker locker(&mutex);
+  return times;
+}
+
+void RenderPipeline::work()
+{
+  QMutexLocker locker(&mutex);
+  while(!canceled && done[Compose] < parts.size())
+  {
+    // Batches further down the pipeline go first, so that the queues drain before new batches are described
+    Stage stage;
+    int batch;
+    if(!matched.empty())
+    {
+      stage = Compose;
+      batch = matched.front();
+      matched.pop_front();
+    }
+    else if(!described.empty() && static_cast<int>(matched.size()) + busy[Match] < capacity)
+    {
+      stage = Match;
+      batch = described.front();
+      described.pop_front();
+    }
+    else if(nextBatch < batchCount && static_cast<int>(described.size()) + busy[Describe] < capacity)
+    {
+      stage = Describe;
+      batch = nextBatch++;
+    }
+    else
+    {
+      condition.wait(&mutex);
+      continue;
+    }
+    ++busy[stage];
+    locker.unlock();
+    process(stage, batch);
+    locker.relock();
+    --busy[stage];
+    condition.wakeAll();
+  }
+  --running;
+  condition.wakeAll();
+}
+
+void RenderPipeline::process(Stage stage, int batch)
+{
+  int begin = batch * batchRows;
+  int end = std::min(rows, begin + batchRows);
+  ImagePart* batchParts = data + begin * columns;
+  int count = (end - begin) * columns;
+  QElapsedTimer timer;
+  timer.start();
+
+  if(stage == Describe)
+  {
+    renderer.describeRows(image, batchParts, columns, end - begin);
+    qint64 elapsed = timer.nsecsElapsed();
+    QMutexLocker locker(&mutex);
+    times.cut += elapsed;
+    done[Describe] += count;
+    described.push_back(batch);
+  }
+  else if(stage == Match)
+  {
+    SearchStatistics batchStatistics = renderer.matchParts(batchParts, count);
+    qint64 match = timer.nsecsElapsed();
+    for(int i = 0; i < count; ++i)
+    {
+      renderer.adaptPart(batchParts[i]);
+    }
+    qint64 adapt = timer.nsecsElapsed() - match;
+    QMutexLocker locker(&mutex);
+    statistics += batchStatistics;
+    times.match += match;
+    times.adapt += adapt;
+    done[Match] += count;
+    matched.push_back(batch);
+  }
+  else
+  {
+    // Scaling missing thumbnails changes the cache, which the other batches read while they are composited:
+    // the write lock is only taken when the batch needs thumbnails that are not cached yet
+    {
+      QReadLocker locker(&canvasLock);
+      while(!tiles->contains(batchParts, count))
+      {
+        locker.unlock();
+        {
+          QWriteLocker writer(&canvasLock);
+          renderer.prepareTiles(batchParts, count, *tiles);
+        }
+        locker.relock();
+      }
+      renderer.composeRows(bits, bytesPerLine, canvas.size(), data, columns, begin, end, *tiles);
+    }
+    qint64 elapsed = timer.nsecsElapsed();
+    QMutexLocker locker(&mutex);
+    times.composite += elapsed;
+    done[Compose] += count;
+    composedSinceSnapshot = true;
+  }
+}
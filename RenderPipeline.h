@@ -0,0 +1,109 @@
+/**
+ * \file RenderPipeline.h
+ */
+
+#ifndef RENDERPIPELINE
+#define RENDERPIPELINE
+
+#include <deque>
+
+#include <QtCore/qfuture.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qreadwritelock.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qwaitcondition.h>
+
+#include "QtMosaicRenderer.h"
+
+/**
+ * Renders a mosaic in batches of rows of parts that flow through the describe, match and compose stages concurrently.
+ * Each worker takes a batch from the last stage that has one waiting, and a stage only takes a batch while the queue
+ * after it has room: the batches in flight are bounded and no stage waits for the whole target to go through another.
+ */
+class RenderPipeline
+{
+public:
+  RenderPipeline();
+  /// Cancels the render and waits for the workers
+  ~RenderPipeline();
+
+  /**
+   * Starts rendering an image on the global thread pool and returns at once. The canvas has the output size,
+   * it shows where no thumbnail is copied, the tiles are kept by the caller and must outlive the render
+   */
+  void start(const QtMosaicRenderer& renderer, const QImage& image, const QImage& canvas, TileCache& tiles);
+  /// Starts compositing the parts of an image of the given size, which are matched and adapted already
+  void start(const QtMosaicRenderer& renderer, const QSize& size, const QVector<ImagePart>& parts, const QImage& canvas, TileCache& tiles);
+  void cancel();
+  void wait();
+  bool isFinished() const;
+  bool isCanceled() const;
+
+  /// Parts through each stage so far, out of three times the number of parts
+  int getProgressValue() const;
+  int getProgressMaximum() const;
+  /// Copies the canvas between two batches, returns a null image if no batch was composited since the last copy
+  QImage takeSnapshot();
+
+  /// The mosaic, once the render is finished
+  const QImage& getMosaic() const
+  {
+    return canvas;
+  }
+  /// The matched and adapted parts, once the render is finished
+  const QVector<ImagePart>& getParts() const
+  {
+    return parts;
+  }
+  SearchStatistics getSearchStatistics() const;
+  /// Time spent by the workers in each stage, the description is counted as the cut
+  RenderTimes getTimes() const;
+
+private:
+  enum Stage
+  {
+    Describe,
+    Match,
+    Compose
+  };
+
+  void run(const QImage& canvas, bool restored);
+  /// Loop of a worker, until all the batches are composited or the render is cancelled
+  void work();
+  void process(Stage stage, int batch);
+
+  QtMosaicRenderer renderer;
+  QImage image;
+  QVector<ImagePart> parts;
+  /// The workers write their own parts through this pointer, parts is not detached from their threads
+  ImagePart* data;
+  int columns;
+  int rows;
+  int batchRows;
+  int batchCount;
+  int capacity;
+
+  /// Taken for reading to composite a batch or look for its tiles, and for writing to scale missing tiles or copy the canvas
+  QReadWriteLock canvasLock;
+  QImage canvas;
+  uchar* bits;
+  int bytesPerLine;
+  TileCache* tiles;
+
+  /// Guards the queues and the counters
+  mutable QMutex mutex;
+  QWaitCondition condition;
+  QVector<QFuture<void> > workers;
+  int running;
+  bool canceled;
+  int nextBatch;
+  std::deque<int> described;
+  std::deque<int> matched;
+  int busy[3];
+  int done[3];
+  bool composedSinceSnapshot;
+  SearchStatistics statistics;
+  RenderTimes times;
+};
+
+#endif
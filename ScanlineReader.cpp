@@ -0,0 +1,320 @@
+/**
+ * \file ScanlineReader.cpp
+ */
+
+#include <algorithm>
+
+#include <QtGui/QImageReader>
+
+#include "ScanlineReader.h"
+
+namespace
+{
+  /// Largest width or height accepted from a header, so that the bytes of a row fit in an int
+  const long max_size = 1L << 24;
+
+  enum FieldType
+  {
+    Byte = 1,
+    Short = 3,
+    Long = 4,
+    Long8 = 16
+  };
+
+  /// Values of TIFF files are stored in the byte order of the file
+  quint64 readValue(const uchar* data, int size, bool big_endian)
+  {
+    quint64 value = 0;
+    for(int i = 0; i < size; ++i)
+    {
+      value |= static_cast<quint64>(data[big_endian ? size - 1 - i : i]) << (8 * i);
+    }
+    return value;
+  }
+
+  int getTypeSize(quint64 type)
+  {
+    switch(type)
+    {
+    case Byte:
+      return 1;
+    case Short:
+      return 2;
+    case Long:
+      return 4;
+    case Long8:
+      return 8;
+    default:
+      return 0;
+    }
+  }
+
+  bool isBlank(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+  }
+}
+
+ScanlineReader::ScanlineReader()
+  :file(NULL), width(0), height(0), rows_read(0), samples(0), rows_per_strip(0)
+{
+  std::fill(levels, levels + 256, 0);
+}
+
+ScanlineReader::~ScanlineReader()
+{
+  delete file;
+}
+
+bool ScanlineReader::open(const QString& filename)
+{
+  delete file;
+  file = new QFile(filename);
+  whole = QImage();
+  rows_read = 0;
+  if(!file->open(QIODevice::ReadOnly))
+  {
+    return false;
+  }
+  if(openPnm() || (file->seek(0) && openTiff()))
+  {
+    return true;
+  }
+
+  // Formats that cannot be read a few rows at a time are decoded at once
+  delete file;
+  file = NULL;
+  strip_offsets.clear();
+  whole = QImageReader(filename).read();
+  width = whole.width();
+  height = whole.height();
+  return !whole.isNull();
+}
+
+bool ScanlineReader::openPnm()
+{
+  // Magic number, width, height and maximum value, separated by blanks and comments, then a single blank
+  QByteArray magic = file->read(2);
+  if(magic != "P5" && magic != "P6")
+  {
+    return false;
+  }
+  samples = magic == "P6" ? 3 : 1;
+  long values[3];
+  for(int i = 0; i < 3; ++i)
+  {
+    char c;
+    do
+    {
+      if(!file->getChar(&c))
+      {
+        return false;
+      }
+      if(c == '#')
+      {
+        file->readLine();
+        c = '\n';
+      }
+    }
+    while(isBlank(c));
+    values[i] = 0;
+    while(c >= '0' && c <= '9' && values[i] <= max_size)
+    {
+      values[i] = 10 * values[i] + c - '0';
+      if(!file->getChar(&c))
+      {
+        return false;
+      }
+    }
+    if(!isBlank(c))
+    {
+      return false;
+    }
+  }
+
+  // Files with 16 bits values are left to QImageReader
+  width = values[0];
+  height = values[1];
+  if(width <= 0 || height <= 0 || width > max_size || height > max_size || values[2] <= 0 || values[2] > 255)
+  {
+    return false;
+  }
+  strip_offsets.assign(1, file->pos());
+  rows_per_strip = height;
+  // Samples above the maximum value are invalid, they are kept white
+  for(int i = 0; i < 256; ++i)
+  {
+    levels[i] = static_cast<uchar>(std::min<long>(255, (255 * i + values[2] / 2) / values[2]));
+  }
+  return true;
+}
+
+bool ScanlineReader::openTiff()
+{
+  uchar header[16];
+  if(file->read(reinterpret_cast<char*>(header), sizeof(header)) != sizeof(header) || header[0] != header[1] || (header[0] != 'I' && header[0] != 'M'))
+  {
+    return false;
+  }
+  bool big_endian = header[0] == 'M';
+  quint64 version = readValue(header + 2, 2, big_endian);
+  bool big_tiff = version == 43;
+  if(version != 42 && !big_tiff)
+  {
+    return false;
+  }
+  int offset_size = big_tiff ? 8 : 4;
+  int count_size = big_tiff ? 8 : 2;
+  int entry_size = big_tiff ? 20 : 12;
+  quint64 directory = readValue(header + (big_tiff ? 8 : 4), offset_size, big_endian);
+  uchar count_data[8];
+  if(!file->seek(directory) || file->read(reinterpret_cast<char*>(count_data), count_size) != count_size)
+  {
+    return false;
+  }
+  quint64 entry_count = readValue(count_data, count_size, big_endian);
+  if(entry_count * entry_size > static_cast<quint64>(file->size()))
+  {
+    return false;
+  }
+  QByteArray entries = file->read(entry_count * entry_size);
+  if(static_cast<quint64>(entries.size()) != entry_count * entry_size)
+  {
+    return false;
+  }
+
+  // Only the first image is read, and only if its rows are stored as they are decoded
+  quint64 compression = 1;
+  quint64 photometric = 0;
+  quint64 planar = 1;
+  bool bytes = true;
+  width = 0;
+  height = 0;
+  samples = 1;
+  rows_per_strip = 0;
+  strip_offsets.clear();
+  for(quint64 i = 0; i < entry_count; ++i)
+  {
+    const uchar* entry = reinterpret_cast<const uchar*>(entries.constData()) + i * entry_size;
+    quint64 tag = readValue(entry, 2, big_endian);
+    int type_size = getTypeSize(readValue(entry + 2, 2, big_endian));
+    quint64 count = readValue(entry + 4, offset_size, big_endian);
+    if(type_size == 0 || count == 0 || count * type_size > static_cast<quint64>(file->size()))
+    {
+      continue;
+    }
+    // Values that do not fit in their entry are stored elsewhere in the file
+    const uchar* value = entry + 4 + offset_size;
+    QByteArray values;
+    if(count * type_size > static_cast<quint64>(offset_size))
+    {
+      if(!file->seek(readValue(value, offset_size, big_endian)))
+      {
+        return false;
+      }
+      values = file->read(count * type_size);
+      if(static_cast<quint64>(values.size()) != count * type_size)
+      {
+        return false;
+      }
+      value = reinterpret_cast<const uchar*>(values.constData());
+    }
+    switch(tag)
+    {
+    case 256:
+      width = readValue(value, type_size, big_endian);
+      break;
+    case 257:
+      height = readValue(value, type_size, big_endian);
+      break;
+    case 258:
+      for(quint64 j = 0; j < count; ++j)
+      {
+        bytes = bytes && readValue(value + j * type_size, type_size, big_endian) == 8;
+      }
+      break;
+    case 259:
+      compression = readValue(value, type_size, big_endian);
+      break;
+    case 262:
+      photometric = readValue(value, type_size, big_endian);
+      break;
+    case 273:
+      strip_offsets.resize(count);
+      for(quint64 j = 0; j < count; ++j)
+      {
+        strip_offsets[j] = readValue(value + j * type_size, type_size, big_endian);
+      }
+      break;
+    case 277:
+      samples = readValue(value, type_size, big_endian);
+      break;
+    case 278:
+      rows_per_strip = readValue(value, type_size, big_endian);
+      break;
+    case 284:
+      planar = readValue(value, type_size, big_endian);
+      break;
+    }
+  }
+
+  // Gray images are black at 0, RGB images have at least three samples
+  if(width <= 0 || height <= 0 || width > max_size || height > max_size || compression != 1 || !bytes || (planar != 1 && samples != 1) || samples < 1 || samples > 8)
+  {
+    return false;
+  }
+  if(!(photometric == 1 || (photometric == 2 && samples >= 3)))
+  {
+    return false;
+  }
+  if(rows_per_strip <= 0 || rows_per_strip > height)
+  {
+    rows_per_strip = height;
+  }
+  for(int i = 0; i < 256; ++i)
+  {
+    levels[i] = static_cast<uchar>(i);
+  }
+  return static_cast<long>(strip_offsets.size()) >= (height + rows_per_strip - 1) / rows_per_strip;
+}
+
+QSize ScanlineReader::size() const
+{
+  return QSize(width, height);
+}
+
+QImage ScanlineReader::read(int rows)
+{
+  rows = static_cast<int>(std::min<long>(rows, height - rows_read));
+  if(rows <= 0)
+  {
+    return QImage();
+  }
+  if(file == NULL)
+  {
+    QImage image = whole.copy(0, rows_read, width, rows).convertToFormat(QImage::Format_RGB32);
+    rows_read += rows;
+    return image;
+  }
+
+  QImage image(width, rows, QImage::Format_RGB32);
+  QByteArray line(samples * width, '\0');
+  for(int j = 0; j < rows; ++j)
+  {
+    long row = rows_read + j;
+    quint64 offset = strip_offsets[row / rows_per_strip] + static_cast<quint64>(row % rows_per_strip) * samples * width;
+    if(!file->seek(offset) || file->read(line.data(), line.size()) != line.size())
+    {
+      return QImage();
+    }
+    const uchar* data = reinterpret_cast<const uchar*>(line.constData());
+    QRgb* pixels = reinterpret_cast<QRgb*>(image.scanLine(j));
+    for(long i = 0; i < width; ++i)
+    {
+      const uchar* pixel = data + i * samples;
+      pixels[i] = samples >= 3 ? qRgb(levels[pixel[0]], levels[pixel[1]], levels[pixel[2]]) : qRgb(levels[pixel[0]], levels[pixel[0]], levels[pixel[0]]);
+    }
+  }
+  rows_read += rows;
+  return image;
+}
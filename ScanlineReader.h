@@ -0,0 +1,49 @@
+/**
+ * \file ScanlineReader.h
+ */
+
+#ifndef SCANLINEREADER
+#define SCANLINEREADER
+
+#include <vector>
+
+#include <QtCore/qfile.h>
+#include <QtGui/qimage.h>
+
+/**
+ * Reads an image a few rows at a time from top to bottom, so that images larger than memory can be read.
+ * Binary PPM and PGM files and uncompressed 8 bits TIFF files, as TiffStripWriter writes them, are decoded as their rows are read.
+ * Other formats are decoded once when the file is opened, and their rows are copied from the decoded image.
+ */
+class ScanlineReader
+{
+public:
+  ScanlineReader();
+  ~ScanlineReader();
+
+  bool open(const QString& filename);
+  QSize size() const;
+  /// Reads the next rows as an RGB32 image, fewer at the bottom of the image, a null image on errors
+  QImage read(int rows);
+
+private:
+  ScanlineReader(const ScanlineReader&);
+  ScanlineReader& operator=(const ScanlineReader&);
+
+  bool openPnm();
+  bool openTiff();
+
+  QFile* file;
+  QImage whole;
+  long width;
+  long height;
+  long rows_read;
+  int samples;
+  /// Offsets of the strips of a TIFF file, a single strip holds the rows of a PNM file
+  std::vector<quint64> strip_offsets;
+  long rows_per_strip;
+  /// Maps the samples of the file to 0..255, PNM files may have a maximum value below 255
+  uchar levels[256];
+};
+
+#endif
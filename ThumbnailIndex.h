@@ -0,0 +1,99 @@
+/**
+ * \file ThumbnailIndex.h
+ */
+
+#ifndef THUMBNAILINDEX
+#define THUMBNAILINDEX
+
+#include <vector>
+
+/**
+ * Limits of an approximate query, the default values give exact queries
+ */
+struct SearchOptions
+{
+  /// Maximum number of leaves scanned, 0 for no limit
+  long max_leaves;
+  /// Maximum number of distance evaluations, checked between nodes, 0 for no limit
+  long max_distances;
+  /// A node is pruned when its lower bound is within a factor (1 + epsilon) of the best distance
+  float epsilon;
+  /// The query stops as soon as a thumbnail is closer than this squared distance
+  float accept_distance;
+
+  SearchOptions()
+    :max_leaves(0), max_distances(0), epsilon(0), accept_distance(0)
+  {
+  }
+
+  bool isExact() const
+  {
+    return max_leaves <= 0 && max_distances <= 0 && epsilon <= 0 && accept_distance <= 0;
+  }
+};
+
+/**
+ * Work done by queries, for a single query or summed over a batch.
+ * Nodes are the ones of the Antipole tree or the lists of the inverted file.
+ */
+struct SearchStatistics
+{
+  long queries;
+  /// Nodes taken from the queue of nodes to visit
+  long visited_nodes;
+  /// Thumbnails of the scanned leaves or lists
+  long leaf_members;
+  /// Distance evaluations, to thumbnails and to node centers
+  long distances;
+  /// Subtrees left unvisited, because of their lower bound or of the limits of an approximate query
+  long pruned_subtrees;
+
+  SearchStatistics()
+    :queries(0), visited_nodes(0), leaf_members(0), distances(0), pruned_subtrees(0)
+  {
+  }
+
+  SearchStatistics& operator+=(const SearchStatistics& other)
+  {
+    queries += other.queries;
+    visited_nodes += other.visited_nodes;
+    leaf_members += other.leaf_members;
+    distances += other.distances;
+    pruned_subtrees += other.pruned_subtrees;
+    return *this;
+  }
+
+  /// Fraction of the visited subtrees that were pruned
+  float getPruningRatio() const
+  {
+    return visited_nodes + pruned_subtrees > 0 ? static_cast<float>(pruned_subtrees) / (visited_nodes + pruned_subtrees) : 0;
+  }
+};
+
+/**
+ * A match and its squared distance, exact is true when no closer thumbnail can exist
+ */
+struct SearchResult
+{
+  long index;
+  float distance;
+  bool exact;
+  SearchStatistics statistics;
+};
+
+/**
+ * Common interface of the matching backends
+ */
+class ThumbnailIndex
+{
+public:
+  virtual ~ThumbnailIndex()
+  {
+  }
+
+  virtual long getDimension() const = 0;
+  virtual SearchResult search(const std::vector<float>& image, const SearchOptions& options) const = 0;
+  virtual std::vector<SearchResult> search(const std::vector<std::vector<float> >& images, const SearchOptions& options) const = 0;
+};
+
+#endif
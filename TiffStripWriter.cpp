@@ -0,0 +1,205 @@
+/**
+ * \file TiffStripWriter.cpp
+ */
+
+#include <algorithm>
+
+#include "TiffStripWriter.h"
+
+namespace
+{
+  const long header_size = 8;
+  const long big_header_size = 16;
+
+  enum FieldType
+  {
+    Short = 3,
+    Long = 4,
+    Long8 = 16
+  };
+
+  struct Entry
+  {
+    quint16 tag;
+    quint16 type;
+    quint64 count;
+    quint64 value;
+  };
+
+  /// TIFF files are written little endian
+  void append(QByteArray& data, quint64 value, int size)
+  {
+    for(int i = 0; i < size; ++i)
+    {
+      data.append(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+
+  void align(QByteArray& data, quint64 position, int alignment)
+  {
+    while((position + data.size()) % alignment != 0)
+    {
+      data.append('\0');
+    }
+  }
+}
+
+TiffStripWriter::TiffStripWriter()
+  :file(NULL), width(0), height(0), rows_per_strip(0), rows_written(0), big_tiff(false)
+{
+}
+
+TiffStripWriter::~TiffStripWriter()
+{
+  delete file;
+}
+
+bool TiffStripWriter::open(const QString& filename, long width, long height, long rows_per_strip)
+{
+  delete file;
+  file = new QFile(filename);
+  if(width <= 0 || height <= 0 || rows_per_strip <= 0 || !file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+  {
+    return false;
+  }
+  this->width = width;
+  this->height = height;
+  this->rows_per_strip = rows_per_strip;
+  rows_written = 0;
+
+  // The directory takes at most two arrays of 8 bytes per strip besides the image
+  quint64 strip_count = (height + rows_per_strip - 1) / rows_per_strip;
+  quint64 size = static_cast<quint64>(width) * height * 3 + 16 * strip_count + 1024;
+  big_tiff = size >= (Q_UINT64_C(1) << 32);
+
+  // The offset of the directory is patched when the file is closed
+  QByteArray header("II");
+  if(big_tiff)
+  {
+    append(header, 43, 2);
+    append(header, 8, 2);
+    append(header, 0, 2);
+    append(header, 0, 8);
+  }
+  else
+  {
+    append(header, 42, 2);
+    append(header, 0, 4);
+  }
+  return file->write(header) == header.size();
+}
+
+bool TiffStripWriter::write(const QImage& rows)
+{
+  if(file == NULL || rows.width() != width || rows_written + rows.height() > height)
+  {
+    return false;
+  }
+  QImage image = rows.format() == QImage::Format_RGB32 || rows.format() == QImage::Format_ARGB32 ? rows : rows.convertToFormat(QImage::Format_ARGB32);
+  QByteArray line(3 * width, '\0');
+  for(int j = 0; j < image.height(); ++j)
+  {
+    const QRgb* pixels = reinterpret_cast<const QRgb*>(image.constScanLine(j));
+    char* data = line.data();
+    for(long i = 0; i < width; ++i)
+    {
+      data[3 * i] = static_cast<char>(qRed(pixels[i]));
+      data[3 * i + 1] = static_cast<char>(qGreen(pixels[i]));
+      data[3 * i + 2] = static_cast<char>(qBlue(pixels[i]));
+    }
+    if(file->write(line) != line.size())
+    {
+      return false;
+    }
+  }
+  rows_written += image.height();
+  return true;
+}
+
+bool TiffStripWriter::close()
+{
+  if(file == NULL || rows_written != height)
+  {
+    return false;
+  }
+
+  int offset_size = big_tiff ? 8 : 4;
+  quint64 position = file->pos();
+  quint64 data_start = big_tiff ? big_header_size : header_size;
+  quint64 strip_size = static_cast<quint64>(rows_per_strip) * width * 3;
+  long strip_count = (height + rows_per_strip - 1) / rows_per_strip;
+
+  // Values that do not fit in their entry are stored in front of the directory
+  QByteArray values;
+  align(values, position, 8);
+  quint64 bits_value = 8 | (8 << 16) | (Q_UINT64_C(8) << 32);
+  if(3 * 2 > offset_size)
+  {
+    bits_value = position + values.size();
+    for(int i = 0; i < 3; ++i)
+    {
+      append(values, 8, 2);
+    }
+  }
+  quint64 offsets_value = data_start;
+  quint64 counts_value = static_cast<quint64>(height) * width * 3;
+  if(strip_count > 1)
+  {
+    align(values, position, 8);
+    offsets_value = position + values.size();
+    for(long i = 0; i < strip_count; ++i)
+    {
+      append(values, data_start + i * strip_size, offset_size);
+    }
+    counts_value = position + values.size();
+    for(long i = 0; i < strip_count; ++i)
+    {
+      long rows = std::min<long>(rows_per_strip, height - i * rows_per_strip);
+      append(values, static_cast<quint64>(rows) * width * 3, offset_size);
+    }
+  }
+  align(values, position, 8);
+  quint64 directory = position + values.size();
+
+  FieldType offset_type = big_tiff ? Long8 : Long;
+  const Entry entries[] = {
+    {256, Long, 1, static_cast<quint64>(width)},
+    {257, Long, 1, static_cast<quint64>(height)},
+    {258, Short, 3, bits_value},
+    {259, Short, 1, 1},
+    {262, Short, 1, 2},
+    {273, static_cast<quint16>(offset_type), static_cast<quint64>(strip_count), offsets_value},
+    {277, Short, 1, 3},
+    {278, Long, 1, static_cast<quint64>(rows_per_strip)},
+    {279, static_cast<quint16>(offset_type), static_cast<quint64>(strip_count), counts_value},
+    {284, Short, 1, 1}
+  };
+  const int entry_count = sizeof(entries) / sizeof(entries[0]);
+  append(values, entry_count, big_tiff ? 8 : 2);
+  for(int i = 0; i < entry_count; ++i)
+  {
+    append(values, entries[i].tag, 2);
+    append(values, entries[i].type, 2);
+    append(values, entries[i].count, offset_size);
+    append(values, entries[i].value, offset_size);
+  }
+  append(values, 0, offset_size);
+
+  QByteArray directory_offset;
+  append(directory_offset, directory, offset_size);
+  bool written = file->write(values) == values.size() && file->seek(big_tiff ? 8 : 4) && file->write(directory_offset) == directory_offset.size();
+  file->close();
+  delete file;
+  file = NULL;
+  return written;
+}
+
+void TiffStripWriter::abort()
+{
+  if(file != NULL)
+  {
+    file->remove();
+    delete file;
+    file = NULL;
+  }
+}
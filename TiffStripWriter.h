@@ -0,0 +1,41 @@
+/**
+ * \file TiffStripWriter.h
+ */
+
+#ifndef TIFFSTRIPWRITER
+#define TIFFSTRIPWRITER
+
+#include <QtCore/qfile.h>
+#include <QtGui/qimage.h>
+
+/**
+ * Writes an uncompressed RGB TIFF a few rows at a time, so that images larger than memory can be written.
+ * Rows are stored in strips of a fixed number of rows, files that would not fit in 4 GB are written as BigTIFF.
+ */
+class TiffStripWriter
+{
+public:
+  TiffStripWriter();
+  ~TiffStripWriter();
+
+  bool open(const QString& filename, long width, long height, long rows_per_strip);
+  /// Appends the rows of an image of the width of the file
+  bool write(const QImage& rows);
+  /// Writes the directory of the file, fails if rows are missing
+  bool close();
+  /// Closes and removes the file, so that a failed write leaves no truncated image
+  void abort();
+
+private:
+  TiffStripWriter(const TiffStripWriter&);
+  TiffStripWriter& operator=(const TiffStripWriter&);
+
+  QFile* file;
+  long width;
+  long height;
+  long rows_per_strip;
+  long rows_written;
+  bool big_tiff;
+};
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * \file ApproximateBenchmark.cpp
+ */
+
+#include <cmath>
+#include <cstdio>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "IvfPqIndex.h"
+#include "SyntheticData.h"
+
+namespace
+{
+  void runQueries(const ThumbnailIndex& index, const std::vector<std::vector<float> >& queries, const std::vector<SearchResult>& reference, const char* name, const SearchOptions& options)
+  {
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<SearchResult> results;
+    results.reserve(queries.size());
+    for(std::vector<std::vector<float> >::const_iterator it = queries.begin(); it != queries.end(); ++it)
+    {
+      results.push_back(index.search(*it, options));
+    }
+    double time = timer.nsecsElapsed() / 1000. / queries.size();
+
+    double ratio = 0;
+    long exact_count = 0;
+    long guaranteed_count = 0;
+    for(std::size_t i = 0; i < results.size(); ++i)
+    {
+      ratio += reference[i].distance > 0 ? std::sqrt(results[i].distance / reference[i].distance) : 1;
+      exact_count += results[i].distance <= reference[i].distance;
+      guaranteed_count += results[i].exact;
+    }
+    std::printf("%-24s %8.2f us %8.4f distance ratio %6.1f%% exact %6.1f%% guaranteed\n", name, time, ratio / results.size(), 100. * exact_count / results.size(), 100. * guaranteed_count / results.size());
+  }
+}
+
+int benchmarkApproximate(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("size", "Thumbnails in the tree", "size", "100000"));
+  parser.addOption(QCommandLineOption("queries", "Queries", "queries", "2000"));
+  parser.addOption(QCommandLineOption("dimension", "Descriptor dimension", "dimension", "27"));
+  parser.process(arguments);
+
+  long size = parser.value("size").toLong();
+  long query_count = parser.value("queries").toLong();
+  long dimension = parser.value("dimension").toLong();
+
+  std::vector<float> thumbnails = SyntheticData::generateDescriptors(size, dimension, 64, 20, 1);
+  AntipoleTree tree;
+  tree.build(thumbnails, dimension);
+  std::vector<float> descriptors = SyntheticData::generateDescriptors(query_count, dimension, 64, 20, 2);
+  std::vector<std::vector<float> > queries;
+  for(long i = 0; i < query_count; ++i)
+  {
+    queries.push_back(std::vector<float>(descriptors.begin() + i * dimension, descriptors.begin() + (i + 1) * dimension));
+  }
+  std::vector<SearchResult> reference = tree.search(queries, SearchOptions());
+
+  runQueries(tree, queries, reference, "exact", SearchOptions());
+  AntipoleTree quantized_tree;
+  quantized_tree.setDescriptorStorage(QuantizedStorage);
+  quantized_tree.build(thumbnails, dimension);
+  runQueries(quantized_tree, queries, reference, "quantized", SearchOptions());
+  AntipoleTree flat_tree;
+  flat_tree.setDescriptorCascade(false);
+  flat_tree.build(thumbnails, dimension);
+  runQueries(flat_tree, queries, reference, "no cascade", SearchOptions());
+  AntipoleTree generic_tree;
+  generic_tree.setDescriptorStorage(QuantizedStorage);
+  generic_tree.setLeafSpecialization(false);
+  generic_tree.build(thumbnails, dimension);
+  runQueries(generic_tree, queries, reference, "quantized, generic scans", SearchOptions());
+  const float epsilons[] = {0.05f, 0.1f, 0.25f, 0.5f};
+  for(int i = 0; i < 4; ++i)
+  {
+    SearchOptions options;
+    options.epsilon = epsilons[i];
+    char name[32];
+    std::sprintf(name, "epsilon %.2f", epsilons[i]);
+    runQueries(tree, queries, reference, name, options);
+  }
+  const long leaves[] = {1, 2, 4, 8, 16};
+  for(int i = 0; i < 5; ++i)
+  {
+    SearchOptions options;
+    options.max_leaves = leaves[i];
+    char name[32];
+    std::sprintf(name, "max leaves %ld", leaves[i]);
+    runQueries(tree, queries, reference, name, options);
+  }
+
+  // Codes only, as the database model uses it, then with the best candidates reranked on a float copy
+  IvfPqIndex ivf_pq_index;
+  ivf_pq_index.build(thumbnails, dimension);
+  IvfPqIndex::Parameters parameters;
+  parameters.rerank_count = 32;
+  IvfPqIndex reranked_index;
+  reranked_index.setParameters(parameters);
+  reranked_index.build(thumbnails, dimension);
+  const long probes[] = {1, 4, 16};
+  for(int i = 0; i < 3; ++i)
+  {
+    SearchOptions options;
+    options.max_leaves = probes[i];
+    char name[48];
+    std::sprintf(name, "ivf-pq %ld probes", probes[i]);
+    runQueries(ivf_pq_index, queries, reference, name, options);
+    std::sprintf(name, "ivf-pq %ld probes, rerank 32", probes[i]);
+    runQueries(reranked_index, queries, reference, name, options);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * \file Benchmarks.h
+ */
+
+#ifndef BENCHMARKS
+#define BENCHMARKS
+
+#include <QtCore/QStringList>
+
+int benchmarkApproximate(const QStringList& arguments);
+int benchmarkBuild(const QStringList& arguments);
+int benchmarkConversion(const QStringList& arguments);
+int benchmarkCrossover(const QStringList& arguments);
+int benchmarkIncremental(const QStringList& arguments);
+int benchmarkRender(const QStringList& arguments);
+
+#endif
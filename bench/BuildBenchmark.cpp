@@ -0,0 +1,57 @@
+/**
+ * \file BuildBenchmark.cpp
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "SyntheticData.h"
+
+int benchmarkBuild(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("size", "Thumbnails in the tree", "size", "1000000"));
+  parser.addOption(QCommandLineOption("dimension", "Descriptor dimension", "dimension", "27"));
+  parser.addOption(QCommandLineOption("threads", "Largest thread count", "threads", QString::number(QThread::idealThreadCount())));
+  parser.process(arguments);
+
+  long size = parser.value("size").toLong();
+  long dimension = parser.value("dimension").toLong();
+  long max_threads = std::max(1L, parser.value("threads").toLong());
+
+  std::vector<float> descriptors = SyntheticData::generateDescriptors(size, dimension, 64, 20, 1);
+
+  // Powers of two below the largest thread count, then the largest count itself
+  std::vector<long> thread_counts;
+  for(long threads = 1; threads < max_threads; threads *= 2)
+  {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
+
+  double reference = 0;
+  for(std::vector<long>::const_iterator it = thread_counts.begin(); it != thread_counts.end(); ++it)
+  {
+    long threads = *it;
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+    QElapsedTimer timer;
+    timer.start();
+    AntipoleTree tree;
+    tree.build(descriptors, dimension);
+    double time = timer.nsecsElapsed() / 1e6;
+    if(threads == 1)
+    {
+      reference = time;
+    }
+    std::printf("build with %ld threads: %.1f ms, speedup %.2f\n", threads, time, reference / time);
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * \file ConversionBenchmark.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "ColorConversion.h"
+
+namespace
+{
+  const char* color_spaces[] = {"RGB", "L*a*b", "L*c*h"};
+
+  std::vector<float> convertReference(const QImage& image, int conversion_method)
+  {
+    switch(conversion_method)
+    {
+      case 1:
+        return HelperFunctions::convert_lab(image);
+      case 2:
+        return HelperFunctions::convert_lch(image);
+    }
+    return HelperFunctions::convert_rgb(image);
+  }
+
+  /// Largest difference with the reference over the colors of an image, hues are compared as arcs at their chroma
+  float maximumError(const QImage& image, int conversion_method)
+  {
+    std::vector<float> reference = convertReference(image, conversion_method);
+    std::vector<float> converted = ColorConversion::convert(image, conversion_method);
+    float error = 0;
+    for(std::size_t i = 0; i < reference.size(); ++i)
+    {
+      float difference = std::abs(reference[i] - converted[i]);
+      if(conversion_method == 2 && i % 3 == 2)
+      {
+        difference = std::min(difference, 360 - difference) * 3.14159265f / 180 * reference[i - 1];
+      }
+      error = std::max(error, difference);
+    }
+    return error;
+  }
+
+  double conversionTime(const QVector<QImage>& images, int conversion_method, bool reference)
+  {
+    QElapsedTimer timer;
+    timer.start();
+    for(QVector<QImage>::const_iterator it = images.begin(); it != images.end(); ++it)
+    {
+      std::vector<float> descriptor = reference ? convertReference(*it, conversion_method) : ColorConversion::convert(*it, conversion_method);
+    }
+    return timer.nsecsElapsed();
+  }
+}
+
+int benchmarkConversion(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("step", "Step between the tested levels of each channel", "step", "1"));
+  parser.addOption(QCommandLineOption("tiles", "3x3 tiles converted for the timings", "tiles", "100000"));
+  parser.process(arguments);
+
+  int step = std::max(1, parser.value("step").toInt());
+  long tile_count = parser.value("tiles").toLong();
+
+  // Every tested color, one image per red level
+  QVector<QImage> colors;
+  for(int red = 0; red < 256; red += step)
+  {
+    QImage image((256 + step - 1) / step, (256 + step - 1) / step, QImage::Format_RGB32);
+    for(int green = 0; green < 256; green += step)
+    {
+      for(int blue = 0; blue < 256; blue += step)
+      {
+        image.setPixel(blue / step, green / step, qRgb(red, green, blue));
+      }
+    }
+    colors.push_back(image);
+  }
+
+  QVector<QImage> tiles;
+  for(long i = 0; i < tile_count; ++i)
+  {
+    QImage tile(3, 3, QImage::Format_RGB32);
+    for(int j = 0; j < 9; ++j)
+    {
+      tile.setPixel(j % 3, j / 3, qRgb((i * 7 + j * 31) % 256, (i * 13 + j * 17) % 256, (i * 29 + j * 5) % 256));
+    }
+    tiles.push_back(tile);
+  }
+
+  int status = 0;
+  for(int method = 0; method < 3; ++method)
+  {
+    float error = 0;
+    for(QVector<QImage>::const_iterator it = colors.begin(); it != colors.end(); ++it)
+    {
+      error = std::max(error, maximumError(*it, method));
+    }
+    double pixels = colors.size() * colors[0].width() * colors[0].height();
+    double reference_time = conversionTime(colors, method, true) / pixels;
+    double time = conversionTime(colors, method, false) / pixels;
+    double reference_tile_time = conversionTime(tiles, method, true) / 1000. / tile_count;
+    double tile_time = conversionTime(tiles, method, false) / 1000. / tile_count;
+    bool valid = error <= ColorConversion::tolerance;
+    std::printf("%-6s max error %.5f (%s), scanlines %7.2f ns/pixel (reference %7.2f), 3x3 tiles %6.3f us (reference %6.3f)\n", color_spaces[method], error, valid ? "ok" : "FAILED", time, reference_time, tile_time, reference_tile_time);
+    if(!valid)
+    {
+      status = 1;
+    }
+  }
+  return status;
+}
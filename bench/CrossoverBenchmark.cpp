@@ -0,0 +1,75 @@
+/**
+ * \file CrossoverBenchmark.cpp
+ */
+
+#include <cstdio>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "BruteForceIndex.h"
+#include "SyntheticData.h"
+
+namespace
+{
+  double searchTime(const ThumbnailIndex& index, const std::vector<std::vector<float> >& queries, std::vector<SearchResult>& results)
+  {
+    QElapsedTimer timer;
+    timer.start();
+    results = index.search(queries, SearchOptions());
+    return timer.nsecsElapsed() / 1e6;
+  }
+}
+
+int benchmarkCrossover(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("queries", "Queries, i.e. tiles of a mosaic", "queries", "2000"));
+  parser.addOption(QCommandLineOption("max-size", "Largest database", "max-size", "100000"));
+  parser.process(arguments);
+
+  long query_count = parser.value("queries").toLong();
+  long max_size = parser.value("max-size").toLong();
+
+  // Descriptors of 2x2, 3x3, 4x4 and 6x6 thumbnails
+  const long dimensions[] = {12, 27, 48, 108};
+  for(int d = 0; d < 4; ++d)
+  {
+    long dimension = dimensions[d];
+    std::vector<float> descriptors = SyntheticData::generateDescriptors(query_count, dimension, 64, 20, 2);
+    std::vector<std::vector<float> > queries;
+    for(long i = 0; i < query_count; ++i)
+    {
+      queries.push_back(std::vector<float>(descriptors.begin() + i * dimension, descriptors.begin() + (i + 1) * dimension));
+    }
+
+    long crossover = 0;
+    for(long size = 1000; size <= max_size; size *= 2)
+    {
+      std::vector<float> thumbnails = SyntheticData::generateDescriptors(size, dimension, 64, 20, 1);
+      AntipoleTree tree;
+      tree.build(thumbnails, dimension);
+      BruteForceIndex brute_force;
+      brute_force.build(thumbnails, dimension);
+
+      std::vector<SearchResult> tree_results;
+      std::vector<SearchResult> brute_force_results;
+      double tree_time = searchTime(tree, queries, tree_results);
+      double brute_force_time = searchTime(brute_force, queries, brute_force_results);
+      long mismatches = 0;
+      for(long i = 0; i < query_count; ++i)
+      {
+        mismatches += tree_results[i].distance < brute_force_results[i].distance * (1 - 1e-5f);
+      }
+      std::printf("dimension %3ld size %7ld: tree %9.2f ms brute force %9.2f ms (%ld worse matches)\n", dimension, size, tree_time, brute_force_time, mismatches);
+      if(brute_force_time < tree_time)
+      {
+        crossover = size;
+      }
+    }
+    std::printf("dimension %3ld: brute force is faster up to %ld thumbnails\n", dimension, crossover);
+  }
+  return 0;
+}
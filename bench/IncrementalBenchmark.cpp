@@ -0,0 +1,91 @@
+/**
+ * \file IncrementalBenchmark.cpp
+ */
+
+#include <cstdio>
+#include <random>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "SyntheticData.h"
+
+namespace
+{
+  double queryTime(const AntipoleTree& tree, const std::vector<float>& queries, long dimension)
+  {
+    long count = queries.size() / dimension;
+    QElapsedTimer timer;
+    timer.start();
+    for(long i = 0; i < count; ++i)
+    {
+      tree.getClosestThumbnail(std::vector<float>(queries.begin() + i * dimension, queries.begin() + (i + 1) * dimension));
+    }
+    return timer.nsecsElapsed() / 1000. / count;
+  }
+}
+
+int benchmarkIncremental(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("size", "Thumbnails in the initial tree", "size", "100000"));
+  parser.addOption(QCommandLineOption("updates", "Incremental updates", "updates", "10000"));
+  parser.addOption(QCommandLineOption("queries", "Queries", "queries", "2000"));
+  parser.addOption(QCommandLineOption("dimension", "Descriptor dimension", "dimension", "27"));
+  parser.process(arguments);
+
+  long size = parser.value("size").toLong();
+  long update_count = parser.value("updates").toLong();
+  long query_count = parser.value("queries").toLong();
+  long dimension = parser.value("dimension").toLong();
+
+  std::vector<float> descriptors = SyntheticData::generateDescriptors(size + update_count, dimension, 64, 20, 1);
+  std::vector<float> queries = SyntheticData::generateDescriptors(query_count, dimension, 64, 20, 2);
+  std::vector<float> database(descriptors.begin(), descriptors.begin() + size * dimension);
+
+  QElapsedTimer timer;
+  timer.start();
+  AntipoleTree tree;
+  tree.build(database, dimension);
+  std::printf("initial build: %.1f ms\n", timer.nsecsElapsed() / 1e6);
+  std::printf("initial query: %.2f us\n", queryTime(tree, queries, dimension));
+
+  // Three inserts for each removal, as a growing database would see
+  std::mt19937 generator(3);
+  long inserted = 0;
+  qint64 update_time = 0;
+  for(long i = 0; i < update_count; ++i)
+  {
+    long count = database.size() / dimension;
+    if(i % 4 == 3)
+    {
+      long index = generator() % count;
+      database.erase(database.begin() + index * dimension, database.begin() + (index + 1) * dimension);
+      timer.restart();
+      tree.remove(index);
+      update_time += timer.nsecsElapsed();
+    }
+    else
+    {
+      const float* thumbnail = &descriptors[(size + inserted) * dimension];
+      database.insert(database.end(), thumbnail, thumbnail + dimension);
+      std::vector<float> new_thumbnail(thumbnail, thumbnail + dimension);
+      timer.restart();
+      tree.insert(new_thumbnail, count);
+      update_time += timer.nsecsElapsed();
+      ++inserted;
+    }
+  }
+  std::printf("incremental updates: %.2f us per update\n", update_time / 1000. / update_count);
+  std::printf("query after %ld updates: %.2f us\n", update_count, queryTime(tree, queries, dimension));
+
+  timer.restart();
+  AntipoleTree fresh_tree;
+  fresh_tree.build(database, dimension);
+  std::printf("fresh build: %.1f ms\n", timer.nsecsElapsed() / 1e6);
+  std::printf("query after fresh build: %.2f us\n", queryTime(fresh_tree, queries, dimension));
+
+  return 0;
+}
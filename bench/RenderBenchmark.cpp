@@ -0,0 +1,312 @@
+/**
+ * \file RenderBenchmark.cpp
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QSysInfo>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+#include "AntipoleTree.h"
+#include "Benchmarks.h"
+#include "ColorConversion.h"
+#include "DistanceKernels.h"
+#include "QtMosaicDatabaseModel.h"
+#include "QtMosaicRenderer.h"
+#include "RenderPipeline.h"
+#include "SyntheticData.h"
+
+namespace
+{
+  const char* color_spaces[] = {"rgb", "lab", "lch"};
+
+  double median(std::vector<double> values)
+  {
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+  }
+
+  /// Median of the repeated timings of a stage, in milliseconds
+  double measure(int repeat, const std::function<void()>& body)
+  {
+    std::vector<double> times;
+    for(int i = 0; i < repeat; ++i)
+    {
+      QElapsedTimer timer;
+      timer.start();
+      body();
+      times.push_back(timer.nsecsElapsed() / 1e6);
+    }
+    return median(times);
+  }
+
+  QString getCpuName()
+  {
+    QFile file("/proc/cpuinfo");
+    if(file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+      while(!file.atEnd())
+      {
+        QString line = QString::fromLatin1(file.readLine());
+        if(line.startsWith("model name"))
+        {
+          return line.section(':', 1).trimmed();
+        }
+      }
+    }
+    return QSysInfo::currentCpuArchitecture();
+  }
+
+  QJsonObject getEnvironment()
+  {
+    QJsonObject hardware;
+    hardware["cpu"] = getCpuName();
+    hardware["architecture"] = QSysInfo::currentCpuArchitecture();
+    hardware["logical_cores"] = QThread::idealThreadCount();
+    hardware["os"] = QSysInfo::prettyProductName();
+    hardware["kernel"] = QSysInfo::kernelVersion();
+    hardware["distance_kernels"] = DistanceKernels::getInstructionSetName(DistanceKernels::getInstructionSet());
+
+    QJsonObject build;
+    build["qt"] = qVersion();
+#if defined(__clang__)
+    build["compiler"] = QString("clang %1").arg(__clang_version__);
+#elif defined(__GNUC__)
+    build["compiler"] = QString("gcc %1").arg(__VERSION__);
+#elif defined(_MSC_VER)
+    build["compiler"] = QString("msvc %1").arg(_MSC_VER);
+#endif
+#if defined(QT_NO_DEBUG)
+    build["debug"] = false;
+#else
+    build["debug"] = true;
+#endif
+
+    QJsonObject environment;
+    environment["hardware"] = hardware;
+    environment["build"] = build;
+    return environment;
+  }
+
+  void addResult(QJsonArray& results, const QString& stage, const char* color_space, long threads, double time, const QJsonObject& extra = QJsonObject())
+  {
+    QJsonObject result = extra;
+    result["stage"] = stage;
+    if(color_space != NULL)
+    {
+      result["color_space"] = color_space;
+    }
+    if(threads > 0)
+    {
+      result["threads"] = static_cast<int>(threads);
+    }
+    result["ms"] = time;
+    results.append(result);
+    std::printf("%-10s %-4s %3s threads %10.2f ms\n", qPrintable(stage), color_space != NULL ? color_space : "-", threads > 0 ? qPrintable(QString::number(threads)) : "-", time);
+    std::fflush(stdout);
+  }
+}
+
+int benchmarkRender(const QStringList& arguments)
+{
+  QCommandLineParser parser;
+  parser.addOption(QCommandLineOption("thumbnails", "Thumbnails in the synthetic database", "count", "20000"));
+  parser.addOption(QCommandLineOption("thumbnail-width", "Width of the thumbnails", "pixels", QString::number(QtMosaicDatabaseModel::scalingFactor * QtMosaicDatabaseModel::widthFactor)));
+  parser.addOption(QCommandLineOption("thumbnail-height", "Height of the thumbnails", "pixels", QString::number(QtMosaicDatabaseModel::scalingFactor * QtMosaicDatabaseModel::heightFactor)));
+  parser.addOption(QCommandLineOption("clusters", "Color clusters of the thumbnails, 0 for uniform colors", "count", "64"));
+  parser.addOption(QCommandLineOption("spread", "Spread of the colors around their cluster and across a thumbnail", "spread", "20"));
+  parser.addOption(QCommandLineOption("seed", "Seed of the synthetic database and target", "seed", "1"));
+  parser.addOption(QCommandLineOption("target-width", "Width of the synthetic target", "pixels", "1920"));
+  parser.addOption(QCommandLineOption("target-height", "Height of the synthetic target", "pixels", "1080"));
+  parser.addOption(QCommandLineOption("tile-width", "Width of the parts of the target", "pixels", "16"));
+  parser.addOption(QCommandLineOption("tile-height", "Height of the parts of the target", "pixels", "12"));
+  parser.addOption(QCommandLineOption("ratio", "Size of the mosaic relative to the target", "ratio", "3"));
+  parser.addOption(QCommandLineOption("color-spaces", "Color spaces of the matching", "spaces", "rgb,lab,lch"));
+  parser.addOption(QCommandLineOption("threads", "Largest thread count", "threads", QString::number(QThread::idealThreadCount())));
+  parser.addOption(QCommandLineOption("repeat", "Runs of each stage, the median is reported", "count", "3"));
+  parser.addOption(QCommandLineOption("label", "Name of the build in the results", "label"));
+  parser.addOption(QCommandLineOption("json", "File the results are written to", "file"));
+  parser.process(arguments);
+
+  long thumbnail_count = parser.value("thumbnails").toLong();
+  int thumbnail_width = parser.value("thumbnail-width").toInt();
+  int thumbnail_height = parser.value("thumbnail-height").toInt();
+  long clusters = parser.value("clusters").toLong();
+  float spread = parser.value("spread").toFloat();
+  unsigned int seed = parser.value("seed").toUInt();
+  int target_width = parser.value("target-width").toInt();
+  int target_height = parser.value("target-height").toInt();
+  int tile_width = std::max(1, parser.value("tile-width").toInt());
+  int tile_height = std::max(1, parser.value("tile-height").toInt());
+  float ratio = parser.value("ratio").toFloat();
+  long max_threads = std::max(1L, parser.value("threads").toLong());
+  int repeat = std::max(1, parser.value("repeat").toInt());
+  if(thumbnail_count <= 0 || thumbnail_width <= 0 || thumbnail_height <= 0 || target_width <= 0 || target_height <= 0)
+  {
+    std::fprintf(stderr, "Empty database or target\n");
+    return 1;
+  }
+  std::vector<int> methods;
+  QStringList spaces = parser.value("color-spaces").split(',');
+  for(int i = 0; i < 3; ++i)
+  {
+    if(spaces.contains(color_spaces[i]))
+    {
+      methods.push_back(i);
+    }
+  }
+  // Powers of two below the largest thread count, then the largest count itself
+  std::vector<long> thread_counts;
+  for(long threads = 1; threads < max_threads; threads *= 2)
+  {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
+
+  QJsonObject configuration;
+  configuration["thumbnails"] = static_cast<double>(thumbnail_count);
+  configuration["thumbnail_width"] = thumbnail_width;
+  configuration["thumbnail_height"] = thumbnail_height;
+  configuration["clusters"] = static_cast<double>(clusters);
+  configuration["spread"] = spread;
+  configuration["seed"] = static_cast<double>(seed);
+  configuration["target_width"] = target_width;
+  configuration["target_height"] = target_height;
+  configuration["tile_width"] = tile_width;
+  configuration["tile_height"] = tile_height;
+  configuration["ratio"] = ratio;
+  configuration["repeat"] = repeat;
+  QJsonArray results;
+
+  // The database goes through a file, so that its load is timed like the one of a real database
+  QTemporaryDir directory;
+  QString database = directory.filePath("synthetic.mosaic");
+  QVector<QImage> thumbnails = SyntheticData::generateThumbnails(thumbnail_count, thumbnail_width, thumbnail_height, clusters, spread, seed);
+  if(!directory.isValid() || !SyntheticData::saveDatabase(database, thumbnails))
+  {
+    std::fprintf(stderr, "Cannot write the synthetic database\n");
+    return 1;
+  }
+  thumbnails.clear();
+  QImage target = SyntheticData::generateTarget(target_width, target_height, seed);
+
+  addResult(results, "load", NULL, 0, measure(repeat, [&]()
+  {
+    QtMosaicDatabaseModel model(database);
+  }));
+
+  for(std::vector<int>::const_iterator method = methods.begin(); method != methods.end(); ++method)
+  {
+    const char* space = color_spaces[*method];
+    QtMosaicDatabaseModel model(database);
+    model.setConversionMethod(*method);
+    model.build();
+
+    // The descriptors of the thumbnails, averaged over the grid and converted as when the tree is built
+    const int cells = QtMosaicDatabaseModel::scalingFactor;
+    long dimension = QtMosaicDatabaseModel::descriptorDimension;
+    const QtMosaicDatabaseModel::ParallelDatabase& images = model.getParallelDatabase();
+    std::vector<float> descriptors;
+    addResult(results, "convert", space, 0, measure(repeat, [&]()
+    {
+      descriptors.resize(images.size() * dimension);
+      QRgb grid[cells * cells];
+      for(int i = 0; i < images.size(); ++i)
+      {
+        ColorConversion::averageCells(images[i].second, images[i].second.rect(), cells, grid);
+        ColorConversion::convertScanline(grid, cells * cells, *method, &descriptors[i * dimension]);
+      }
+    }));
+
+    QtMosaicRenderer renderer(&model);
+    renderer.setTileSize(tile_height, tile_width);
+    renderer.setOutputRatio(ratio);
+    QSize size = renderer.getOutputSize(target.size());
+    QImage background = target.scaled(size.width(), size.height()).convertToFormat(QImage::Format_RGB32);
+
+    for(std::vector<long>::const_iterator it = thread_counts.begin(); it != thread_counts.end(); ++it)
+    {
+      long threads = *it;
+      QThreadPool::globalInstance()->setMaxThreadCount(threads);
+      addResult(results, "build", space, threads, measure(repeat, [&]()
+      {
+        AntipoleTree tree;
+        tree.setConversionMethod(*method);
+        tree.setDescriptorStorage(QuantizedStorage);
+        tree.build(descriptors, dimension);
+      }));
+
+      // Each run matches parts described again, the matching consumes the descriptors
+      std::vector<double> describe_times;
+      std::vector<double> match_times;
+      std::vector<double> adapt_times;
+      std::vector<double> composite_times;
+      SearchStatistics statistics;
+      for(int i = 0; i < repeat; ++i)
+      {
+        QVector<ImagePart> parts;
+        QElapsedTimer timer;
+        timer.start();
+        renderer.createParts(target, parts);
+        describe_times.push_back(timer.nsecsElapsed() / 1e6);
+        timer.restart();
+        statistics = renderer.matchParts(parts);
+        match_times.push_back(timer.nsecsElapsed() / 1e6);
+        timer.restart();
+        renderer.adaptParts(parts);
+        adapt_times.push_back(timer.nsecsElapsed() / 1e6);
+        QImage image = target;
+        timer.restart();
+        renderer.reconstructImage(image, parts);
+        composite_times.push_back(timer.nsecsElapsed() / 1e6);
+      }
+      QJsonObject parts;
+      parts["parts"] = static_cast<double>(renderer.getPartCount(target));
+      addResult(results, "describe", space, threads, median(describe_times), parts);
+      QJsonObject queries = parts;
+      queries["distances_per_query"] = statistics.queries > 0 ? static_cast<double>(statistics.distances) / statistics.queries : 0.;
+      addResult(results, "query", space, threads, median(match_times), queries);
+      addResult(results, "adapt", space, threads, median(adapt_times), parts);
+      addResult(results, "composite", space, threads, median(composite_times), parts);
+
+      // The stages overlap in the pipeline, its time is the one of a whole render from the GUI
+      addResult(results, "pipeline", space, threads, measure(repeat, [&]()
+      {
+        TileCache tiles;
+        RenderPipeline pipeline;
+        pipeline.start(renderer, target, background, tiles);
+        pipeline.wait();
+      }), parts);
+    }
+    QThreadPool::globalInstance()->setMaxThreadCount(QThread::idealThreadCount());
+  }
+
+  if(parser.isSet("json"))
+  {
+    QJsonObject document = getEnvironment();
+    document["benchmark"] = QString("render");
+    document["label"] = parser.value("label");
+    document["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    document["configuration"] = configuration;
+    document["results"] = results;
+    QFile file(parser.value("json"));
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(QJsonDocument(document).toJson()) < 0)
+    {
+      std::fprintf(stderr, "Cannot write %s\n", qPrintable(parser.value("json")));
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * \file SyntheticData.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+
+#include "SyntheticData.h"
+
+namespace
+{
+  /// Uniform in [0, 1)
+  double uniform(std::mt19937& generator)
+  {
+    return generator() / 4294967296.;
+  }
+
+  /// Box-Muller transform of two uniform draws
+  double normal(std::mt19937& generator)
+  {
+    double radius = std::sqrt(-2 * std::log(1 - uniform(generator)));
+    return radius * std::cos(2 * 3.14159265358979 * uniform(generator));
+  }
+
+  int clampChannel(double value)
+  {
+    return std::min(255, std::max(0, static_cast<int>(value + .5)));
+  }
+}
+
+QVector<QImage> SyntheticData::generateThumbnails(long count, int width, int height, long clusters, float spread, unsigned int seed)
+{
+  std::mt19937 generator(seed);
+  std::vector<double> centers(3 * clusters);
+  for(std::vector<double>::iterator it = centers.begin(); it != centers.end(); ++it)
+  {
+    *it = 255 * uniform(generator);
+  }
+
+  QVector<QImage> thumbnails;
+  thumbnails.reserve(count);
+  for(long i = 0; i < count; ++i)
+  {
+    // A base color, and a gradient across the thumbnail so that the cells of its grid differ
+    double color[3];
+    double slope[3];
+    long cluster = clusters > 0 ? generator() % clusters : -1;
+    for(int c = 0; c < 3; ++c)
+    {
+      color[c] = cluster >= 0 ? centers[3 * cluster + c] + spread * normal(generator) : 255 * uniform(generator);
+      slope[c] = spread * normal(generator);
+    }
+    double angle = 2 * 3.14159265358979 * uniform(generator);
+    double dx = std::cos(angle) / std::max(1, width - 1);
+    double dy = std::sin(angle) / std::max(1, height - 1);
+
+    QImage thumbnail(width, height, QImage::Format_RGB32);
+    for(int y = 0; y < height; ++y)
+    {
+      QRgb* line = reinterpret_cast<QRgb*>(thumbnail.scanLine(y));
+      for(int x = 0; x < width; ++x)
+      {
+        double position = (x - width / 2.) * dx + (y - height / 2.) * dy;
+        line[x] = qRgb(clampChannel(color[0] + slope[0] * position), clampChannel(color[1] + slope[1] * position), clampChannel(color[2] + slope[2] * position));
+      }
+    }
+    thumbnails.push_back(thumbnail);
+  }
+  return thumbnails;
+}
+
+QImage SyntheticData::generateTarget(int width, int height, unsigned int seed)
+{
+  const int waves = 4;
+  std::mt19937 generator(seed);
+  double frequencies[3 * waves][3];
+  for(int k = 0; k < 3 * waves; ++k)
+  {
+    frequencies[k][0] = 12 * uniform(generator) / std::max(1, width);
+    frequencies[k][1] = 12 * uniform(generator) / std::max(1, height);
+    frequencies[k][2] = 2 * 3.14159265358979 * uniform(generator);
+  }
+
+  QImage target(width, height, QImage::Format_RGB32);
+  for(int y = 0; y < height; ++y)
+  {
+    QRgb* line = reinterpret_cast<QRgb*>(target.scanLine(y));
+    for(int x = 0; x < width; ++x)
+    {
+      double channels[3];
+      for(int c = 0; c < 3; ++c)
+      {
+        channels[c] = 128 + 8 * (uniform(generator) - .5);
+        for(int k = c * waves; k < (c + 1) * waves; ++k)
+        {
+          channels[c] += 120. / waves * std::sin(frequencies[k][0] * x + frequencies[k][1] * y + frequencies[k][2]);
+        }
+      }
+      line[x] = qRgb(clampChannel(channels[0]), clampChannel(channels[1]), clampChannel(channels[2]));
+    }
+  }
+  return target;
+}
+
+bool SyntheticData::saveDatabase(const QString& filename, const QVector<QImage>& thumbnails)
+{
+  QFile file(filename);
+  if(!file.open(QIODevice::WriteOnly))
+  {
+    return false;
+  }
+  // The layout of QtMosaicDatabaseModel::save, pixmaps are streamed as images
+  QDataStream stream(&file);
+  int version = 1;
+  stream << version;
+  stream << thumbnails.size();
+  for(int i = 0; i < thumbnails.size(); ++i)
+  {
+    stream << QString("synthetic/%1.png").arg(i);
+    stream << thumbnails[i];
+  }
+  return stream.status() == QDataStream::Ok;
+}
+
+std::vector<float> SyntheticData::generateDescriptors(long count, long dimension, long clusters, float spread, unsigned int seed)
+{
+  std::mt19937 generator(seed);
+  std::vector<float> centers(clusters * dimension);
+  for(std::vector<float>::iterator it = centers.begin(); it != centers.end(); ++it)
+  {
+    *it = static_cast<float>(255 * uniform(generator));
+  }
+
+  std::vector<float> descriptors(count * dimension);
+  for(long i = 0; i < count; ++i)
+  {
+    long cluster = generator() % clusters;
+    for(long j = 0; j < dimension; ++j)
+    {
+      descriptors[i * dimension + j] = centers[cluster * dimension + j] + static_cast<float>(spread * normal(generator));
+    }
+  }
+  return descriptors;
+}
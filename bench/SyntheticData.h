@@ -0,0 +1,30 @@
+/**
+ * \file SyntheticData.h
+ */
+
+#ifndef SYNTHETICDATA
+#define SYNTHETICDATA
+
+#include <vector>
+
+#include <QtCore/QString>
+#include <QtCore/QVector>
+#include <QtGui/QImage>
+
+/**
+ * Deterministic clustered descriptors, the same seed always gives the same data. The random numbers are drawn from
+ * the raw output of the generator, not from the distributions of the standard library, which differ between implementations
+ */
+struct SyntheticData
+{
+  static std::vector<float> generateDescriptors(long count, long dimension, long clusters, float spread, unsigned int seed);
+
+  /// Thumbnails shaded around colors drawn in clusters, or uniformly without clusters, the images only depend on the seed and the sizes
+  static QVector<QImage> generateThumbnails(long count, int width, int height, long clusters, float spread, unsigned int seed);
+  /// Smooth color waves with some noise, so that neighbour parts match different thumbnails
+  static QImage generateTarget(int width, int height, unsigned int seed);
+  /// Writes thumbnails as a database that QtMosaicDatabaseModel opens
+  static bool saveDatabase(const QString& filename, const QVector<QImage>& thumbnails);
+};
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * \file main.cpp
+ */
+
+#include <cstdio>
+
+#include <QtGui/QGuiApplication>
+
+#include "Benchmarks.h"
+
+int main(int argc, char *argv[])
+{
+  // The render benchmark opens databases of pixmaps, which need a platform plugin, the offscreen one needs no display
+  if(qgetenv("QT_QPA_PLATFORM").isEmpty())
+  {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  QGuiApplication application(argc, argv);
+  QStringList arguments = application.arguments();
+
+  QString benchmark = arguments.size() > 1 ? arguments.takeAt(1) : QString();
+  if(benchmark == "approximate")
+  {
+    return benchmarkApproximate(arguments);
+  }
+  if(benchmark == "build")
+  {
+    return benchmarkBuild(arguments);
+  }
+  if(benchmark == "conversion")
+  {
+    return benchmarkConversion(arguments);
+  }
+  if(benchmark == "crossover")
+  {
+    return benchmarkCrossover(arguments);
+  }
+  if(benchmark == "incremental")
+  {
+    return benchmarkIncremental(arguments);
+  }
+  if(benchmark == "render")
+  {
+    return benchmarkRender(arguments);
+  }
+
+  std::fprintf(stderr, "Usage: qtmosaic-bench approximate|build|conversion|crossover|incremental|render [options]\n");
+  return 1;
+}
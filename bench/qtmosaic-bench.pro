@@ -0,0 +1,41 @@
+TEMPLATE = app
+TARGET = qtmosaic-bench
+INCLUDEPATH += . ..
+
+QT += core gui concurrent
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+HEADERS += ../AntipoleTree.h \
+           ../BruteForceIndex.h \
+           ../ColorConversion.h \
+           ../DistanceKernels.h \
+           ../IvfPqIndex.h \
+           ../MatchMap.h \
+           ../QtMosaicDatabaseModel.h \
+           ../QtMosaicRenderer.h \
+           ../RenderPipeline.h \
+           ../ThumbnailIndex.h \
+           ../TiffStripWriter.h \
+           ../ScanlineReader.h \
+           Benchmarks.h \
+           SyntheticData.h
+SOURCES += ../AntipoleTree.cpp \
+           ../BruteForceIndex.cpp \
+           ../ColorConversion.cpp \
+           ../DistanceKernels.cpp \
+           ../IvfPqIndex.cpp \
+           ../MatchMap.cpp \
+           ../QtMosaicDatabaseModel.cpp \
+           ../QtMosaicRenderer.cpp \
+           ../RenderPipeline.cpp \
+           ../TiffStripWriter.cpp \
+           ../ScanlineReader.cpp \
+           ApproximateBenchmark.cpp \
+           BuildBenchmark.cpp \
+           ConversionBenchmark.cpp \
+           CrossoverBenchmark.cpp \
+           IncrementalBenchmark.cpp \
+           RenderBenchmark.cpp \
+           SyntheticData.cpp \
+           main.cpp
@@ -0,0 +1,201 @@
+/**
+ * \file main.cpp
+ */
+
+#include <cstdio>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
+#include <QtCore/QThreadPool>
+#include <QtGui/QGuiApplication>
+
+#include "MatchMap.h"
+#include "QtMosaicDatabaseModel.h"
+#include "QtMosaicRenderer.h"
+
+namespace
+{
+  const char* color_spaces[] = {"rgb", "lab", "lch"};
+
+  /// Timings are printed on stdout as tab separated lines: target, stage, milliseconds
+  void printTiming(const QString& target, const char* stage, qint64 nsecs)
+  {
+    std::printf("%s\t%s\t%.3f\n", qPrintable(target), stage, nsecs / 1e6);
+    std::fflush(stdout);
+  }
+
+  void printTiming(const QString& target, const char* stage, const QElapsedTimer& timer)
+  {
+    printTiming(target, stage, timer.nsecsElapsed());
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // The database stores pixmaps, which need a platform plugin, the offscreen one needs no display
+  if(qgetenv("QT_QPA_PLATFORM").isEmpty())
+  {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  QGuiApplication application(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Renders mosaics of target images from a QtMosaic database");
+  parser.addHelpOption();
+  parser.addPositionalArgument("database", "Database of thumbnails (.mosaic)");
+  parser.addPositionalArgument("targets", "Images to render", "targets...");
+  parser.addOption(QCommandLineOption("tile-height", "Height of the parts of the target, the thumbnail height by default", "pixels", "0"));
+  parser.addOption(QCommandLineOption("tile-width", "Width of the parts of the target, the thumbnail width by default", "pixels", "0"));
+  parser.addOption(QCommandLineOption("ratio", "Size of the mosaic relative to the target", "ratio", "1"));
+  parser.addOption(QCommandLineOption("color-space", "Color space of the matching: rgb, lab or lch", "space", "rgb"));
+  parser.addOption(QCommandLineOption("threads", "Worker threads, 0 for one per core", "count", "0"));
+  parser.addOption(QCommandLineOption("epsilon", "Approximation factor of the matching, 0 for exact matches", "epsilon", "0"));
+  parser.addOption(QCommandLineOption("max-leaves", "Leaves scanned per match, 0 for no limit", "count", "0"));
+  parser.addOption(QCommandLineOption("output", "Directory of the mosaics, the directory of each target by default", "directory"));
+  parser.addOption(QCommandLineOption("suffix", "Suffix added to the target names", "suffix", "_mosaic"));
+  parser.addOption(QCommandLineOption("format", "Image format of the mosaics", "format", "png"));
+  parser.addOption(QCommandLineOption("match-cache", "Directory of the match maps, renders of known targets skip the matching", "directory"));
+  parser.addOption(QCommandLineOption("strips", "Renders the mosaics a strip of tile rows at a time to TIFF files, 0 to render them in memory", "rows", "0"));
+  parser.process(application);
+
+  QStringList positional = parser.positionalArguments();
+  if(positional.size() < 2)
+  {
+    parser.showHelp(1);
+  }
+  int conversion_method = -1;
+  for(int i = 0; i < 3; ++i)
+  {
+    if(parser.value("color-space") == color_spaces[i])
+    {
+      conversion_method = i;
+    }
+  }
+  if(conversion_method < 0)
+  {
+    std::fprintf(stderr, "Unknown color space %s\n", qPrintable(parser.value("color-space")));
+    return 1;
+  }
+  int threads = parser.value("threads").toInt();
+  if(threads > 0)
+  {
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+  }
+  QString database = positional.takeFirst();
+  if(!QFileInfo(database).isFile())
+  {
+    std::fprintf(stderr, "Cannot open database %s\n", qPrintable(database));
+    return 1;
+  }
+
+  std::printf("target\tstage\tms\n");
+  QElapsedTimer timer;
+  timer.start();
+  QtMosaicDatabaseModel model(database);
+  printTiming("-", "load", timer);
+  if(model.getDatabase().empty())
+  {
+    std::fprintf(stderr, "Empty database %s\n", qPrintable(database));
+    return 1;
+  }
+  timer.restart();
+  model.setConversionMethod(conversion_method);
+  model.build();
+  printTiming("-", "index", timer);
+
+  const QPixmap& thumbnail = model.getDatabase()[0].second;
+  int tile_height = parser.value("tile-height").toInt();
+  int tile_width = parser.value("tile-width").toInt();
+  SearchOptions options;
+  options.epsilon = parser.value("epsilon").toFloat();
+  options.max_leaves = parser.value("max-leaves").toLong();
+  QtMosaicRenderer renderer(&model);
+  renderer.setTileSize(tile_height > 0 ? tile_height : thumbnail.height(), tile_width > 0 ? tile_width : thumbnail.width());
+  renderer.setOutputRatio(parser.value("ratio").toFloat());
+  renderer.setSearchOptions(options);
+
+  int strips = parser.value("strips").toInt();
+  MatchMapCache matchMaps(parser.value("match-cache"));
+  QString format = strips > 0 ? QString("tif") : parser.value("format");
+
+  int status = 0;
+  for(QStringList::const_iterator it = positional.begin(); it != positional.end(); ++it)
+  {
+    QElapsedTimer total;
+    total.start();
+    QFileInfo target(*it);
+    QDir directory = parser.isSet("output") ? QDir(parser.value("output")) : target.dir();
+    QString output = directory.filePath(target.completeBaseName() + parser.value("suffix") + "." + format);
+
+    if(strips > 0)
+    {
+      RenderTimes times;
+      if(!renderer.renderStrips(*it, output, strips, &times))
+      {
+        std::fprintf(stderr, "Cannot render %s to %s\n", qPrintable(*it), qPrintable(output));
+        status = 1;
+        continue;
+      }
+      printTiming(*it, "read", times.read);
+      printTiming(*it, "cut", times.cut);
+      printTiming(*it, "match", times.match);
+      printTiming(*it, "adapt", times.adapt);
+      printTiming(*it, "composite", times.composite);
+      printTiming(*it, "write", times.write);
+      printTiming(*it, "total", total);
+      continue;
+    }
+
+    timer.restart();
+    QImage image(*it);
+    if(image.isNull())
+    {
+      std::fprintf(stderr, "Cannot read %s\n", qPrintable(*it));
+      status = 1;
+      continue;
+    }
+    printTiming(*it, "read", timer);
+
+    QVector<ImagePart> parts;
+    MatchMap map;
+    timer.restart();
+    QByteArray key = parser.isSet("match-cache") ? renderer.getMatchKey(image) : QByteArray();
+    if(!key.isEmpty() && matchMaps.find(key, map))
+    {
+      renderer.restoreMatches(map, parts);
+      printTiming(*it, "restore", timer);
+    }
+    else
+    {
+      renderer.createParts(image, parts);
+      printTiming(*it, "cut", timer);
+      timer.restart();
+      renderer.matchParts(parts);
+      printTiming(*it, "match", timer);
+      timer.restart();
+      renderer.adaptParts(parts);
+      printTiming(*it, "adapt", timer);
+      if(!key.isEmpty())
+      {
+        renderer.storeMatches(key, image.size(), parts, map);
+        matchMaps.insert(map);
+      }
+    }
+    timer.restart();
+    renderer.reconstructImage(image, parts);
+    printTiming(*it, "composite", timer);
+
+    timer.restart();
+    if(!image.save(output, qPrintable(format)))
+    {
+      std::fprintf(stderr, "Cannot write %s\n", qPrintable(output));
+      status = 1;
+      continue;
+    }
+    printTiming(*it, "write", timer);
+    printTiming(*it, "total", total);
+  }
+  return status;
+}
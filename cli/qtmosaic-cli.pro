@@ -0,0 +1,30 @@
+TEMPLATE = app
+TARGET = qtmosaic-cli
+INCLUDEPATH += . ..
+
+QT += core gui concurrent
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+HEADERS += ../AntipoleTree.h \
+           ../BruteForceIndex.h \
+           ../ColorConversion.h \
+           ../DistanceKernels.h \
+           ../IvfPqIndex.h \
+           ../MatchMap.h \
+           ../QtMosaicDatabaseModel.h \
+           ../QtMosaicRenderer.h \
+           ../TiffStripWriter.h \
+           ../ScanlineReader.h \
+           ../ThumbnailIndex.h
+SOURCES += ../AntipoleTree.cpp \
+           ../BruteForceIndex.cpp \
+           ../ColorConversion.cpp \
+           ../DistanceKernels.cpp \
+           ../IvfPqIndex.cpp \
+           ../MatchMap.cpp \
+           ../QtMosaicDatabaseModel.cpp \
+           ../QtMosaicRenderer.cpp \
+           ../TiffStripWriter.cpp \
+           ../ScanlineReader.cpp \
+           main.cpp
@@ -199,7 +199,7 @@ void QtMosaic::exec()
 {
   if(database != "")
   {
-    connect(builder, SIGNAL(updateMosaic(QImage)), this, SLOT(updateMosaic(QImage)));
+    connect(builder, SIGNAL(updateMosaic(QImage)), this, SLOT(updateMosaic(QImage)), Qt::UniqueConnection);
     builder->create(ui.originalImage->pixmap(), ui.mosaicHeight->value(), ui.mosaicWidth->value(), ui.outputRatio->value());
   }
   else
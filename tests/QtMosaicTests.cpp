@@ -0,0 +1,340 @@
+/**
+ * \file QtMosaicTests.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <QtCore/QTemporaryDir>
+#include <QtTest/QtTest>
+
+#include "AntipoleTree.h"
+#include "BruteForceIndex.h"
+#include "ColorConversion.h"
+#include "DistanceKernels.h"
+#include "MatchMap.h"
+#include "QtMosaicDatabaseModel.h"
+#include "QtMosaicRenderer.h"
+#include "ScanlineReader.h"
+#include "SyntheticData.h"
+#include "TiffStripWriter.h"
+
+namespace
+{
+  /// Relative error allowed between float distances summed in different orders
+  const float distance_tolerance = 1e-4f;
+
+  bool closeEnough(float value, float reference)
+  {
+    return std::abs(value - reference) <= distance_tolerance * std::max(1.f, std::abs(reference));
+  }
+}
+
+/**
+ * Behaviour the optimized code paths must keep: the kernels and color conversions against the reference ones, the files
+ * written and read back, and the exact searches of the tree against an exhaustive search
+ */
+class QtMosaicTests: public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void kernelsMatchScalar();
+  void conversionMatchesReference();
+  void tiffRoundTrip();
+  void pnmMaximumValue();
+  void matchMapRoundTrip();
+  void treeMatchesBruteForce();
+  void thumbnailsDescribedAsParts();
+};
+
+void QtMosaicTests::kernelsMatchScalar()
+{
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> floats(-255, 255);
+  std::uniform_int_distribution<int> bytes(0, 255);
+  std::uniform_int_distribution<int> words(-1023, 1023);
+
+  // Sizes around the vector widths, so that the tails of the kernels are covered
+  std::vector<long> sizes;
+  for(long size = 0; size <= 67; ++size)
+  {
+    sizes.push_back(size);
+  }
+  sizes.push_back(243);
+  sizes.push_back(DistanceKernels::max_word_size);
+  sizes.push_back(DistanceKernels::max_byte_size);
+
+  DistanceKernels::InstructionSet detected = DistanceKernels::detectInstructionSet();
+  DistanceKernels::InstructionSet selected = DistanceKernels::getInstructionSet();
+  for(int set = DistanceKernels::Scalar; set <= detected; ++set)
+  {
+    DistanceKernels::setInstructionSet(static_cast<DistanceKernels::InstructionSet>(set));
+    for(std::size_t k = 0; k < sizes.size(); ++k)
+    {
+      long size = sizes[k];
+      std::vector<float> float1(size), float2(size);
+      std::vector<quint8> byte1(size), byte2(size);
+      std::vector<qint16> word1(size), word2(size);
+      for(long i = 0; i < size; ++i)
+      {
+        float1[i] = floats(generator);
+        float2[i] = floats(generator);
+        byte1[i] = static_cast<quint8>(bytes(generator));
+        byte2[i] = static_cast<quint8>(bytes(generator));
+        word1[i] = static_cast<qint16>(words(generator));
+        word2[i] = static_cast<qint16>(words(generator));
+      }
+
+      float reference = DistanceKernels::distance2_scalar(float1.data(), float2.data(), size);
+      QVERIFY2(closeEnough(DistanceKernels::distance2(float1.data(), float2.data(), size), reference), DistanceKernels::getInstructionSetName(DistanceKernels::getInstructionSet()));
+      // Partial distances are exact below the bound and only have to exceed it above
+      float partial = DistanceKernels::partialDistance2(float1.data(), float2.data(), size, 2 * reference);
+      QVERIFY(closeEnough(partial, reference));
+      partial = DistanceKernels::partialDistance2(float1.data(), float2.data(), size, reference / 2);
+      QVERIFY(size == 0 || partial > reference / 2);
+
+      QCOMPARE(DistanceKernels::distance2(byte1.data(), byte2.data(), size), DistanceKernels::distance2_scalar(byte1.data(), byte2.data(), size));
+      if(size <= DistanceKernels::max_word_size)
+      {
+        QCOMPARE(DistanceKernels::distance2(word1.data(), word2.data(), size), DistanceKernels::distance2_scalar(word1.data(), word2.data(), size));
+      }
+    }
+  }
+  DistanceKernels::setInstructionSet(selected);
+}
+
+void QtMosaicTests::conversionMatchesReference()
+{
+  // Levels of each channel five apart, 0 and 255 included, one image per red level
+  const int step = 5;
+  const int levels = 256 / step + 1;
+  for(int method = 0; method < 3; ++method)
+  {
+    for(int red = 0; red < 256; red += step)
+    {
+      QImage image(levels, levels, QImage::Format_RGB32);
+      for(int green = 0; green < 256; green += step)
+      {
+        for(int blue = 0; blue < 256; blue += step)
+        {
+          image.setPixel(blue / step, green / step, qRgb(red, green, blue));
+        }
+      }
+
+      std::vector<float> reference = method == 1 ? HelperFunctions::convert_lab(image) : method == 2 ? HelperFunctions::convert_lch(image) : HelperFunctions::convert_rgb(image);
+      std::vector<float> converted = ColorConversion::convert(image, method);
+      QCOMPARE(converted.size(), reference.size());
+      for(std::size_t i = 0; i < reference.size(); ++i)
+      {
+        // Hues are compared as the length of their arc at the chroma
+        float difference = std::abs(reference[i] - converted[i]);
+        if(method == 2 && i % 3 == 2)
+        {
+          difference = std::min(difference, 360 - difference) * 3.14159265f / 180 * reference[i - 1];
+        }
+        QVERIFY(difference <= ColorConversion::tolerance);
+      }
+    }
+  }
+}
+
+void QtMosaicTests::tiffRoundTrip()
+{
+  QTemporaryDir directory;
+  QVERIFY(directory.isValid());
+  QString filename = directory.filePath("strips.tif");
+
+  // Strips of the file and rows of the writes and reads all differ, and the last ones are shorter
+  QImage target = SyntheticData::generateTarget(53, 41, 7).convertToFormat(QImage::Format_RGB32);
+  TiffStripWriter writer;
+  QVERIFY(writer.open(filename, target.width(), target.height(), 6));
+  for(int y = 0; y < target.height(); y += 9)
+  {
+    QVERIFY(writer.write(target.copy(0, y, target.width(), std::min(9, target.height() - y))));
+  }
+  QVERIFY(writer.close());
+
+  ScanlineReader reader;
+  QVERIFY(reader.open(filename));
+  QCOMPARE(reader.size(), target.size());
+  for(int y = 0; y < target.height(); y += 4)
+  {
+    QImage rows = reader.read(4);
+    QCOMPARE(rows.height(), std::min(4, target.height() - y));
+    for(int j = 0; j < rows.height(); ++j)
+    {
+      for(int i = 0; i < rows.width(); ++i)
+      {
+        QCOMPARE(rows.pixel(i, j), target.pixel(i, y + j));
+      }
+    }
+  }
+  QVERIFY(reader.read(4).isNull());
+
+  // An aborted write leaves no file behind
+  TiffStripWriter aborted;
+  QVERIFY(aborted.open(filename, target.width(), target.height(), 6));
+  QVERIFY(aborted.write(target.copy(0, 0, target.width(), 9)));
+  aborted.abort();
+  QVERIFY(!QFile::exists(filename));
+}
+
+void QtMosaicTests::pnmMaximumValue()
+{
+  QTemporaryDir directory;
+  QVERIFY(directory.isValid());
+  QString filename = directory.filePath("levels.pgm");
+
+  // Samples are scaled from the maximum value of the file to 0..255
+  QFile file(filename);
+  QVERIFY(file.open(QIODevice::WriteOnly));
+  const char header[] = "P5\n# levels\n3 1\n15\n";
+  const char samples[] = {0, 7, 15};
+  QVERIFY(file.write(header, sizeof(header) - 1) == sizeof(header) - 1);
+  QVERIFY(file.write(samples, sizeof(samples)) == sizeof(samples));
+  file.close();
+
+  ScanlineReader reader;
+  QVERIFY(reader.open(filename));
+  QImage row = reader.read(1);
+  QCOMPARE(row.width(), 3);
+  QCOMPARE(row.pixel(0, 0), qRgb(0, 0, 0));
+  QCOMPARE(row.pixel(1, 0), qRgb(119, 119, 119));
+  QCOMPARE(row.pixel(2, 0), qRgb(255, 255, 255));
+}
+
+void QtMosaicTests::matchMapRoundTrip()
+{
+  QTemporaryDir directory;
+  QVERIFY(directory.isValid());
+  QString filename = directory.filePath("map");
+
+  QImage target = SyntheticData::generateTarget(50, 30, 3);
+  QByteArray checksum("database");
+  int tileHeight = 6;
+  int tileWidth = 8;
+  int columns = (target.width() + tileWidth - 1) / tileWidth;
+  int rows = (target.height() + tileHeight - 1) / tileHeight;
+  QVector<ImagePart> parts(columns * rows);
+  for(int k = 0; k < parts.size(); ++k)
+  {
+    int i = k % columns;
+    int j = k / columns;
+    parts[k].rect = QRect(i * tileWidth, j * tileHeight, std::min(tileWidth, target.width() - i * tileWidth), std::min(tileHeight, target.height() - j * tileHeight));
+    parts[k].color = qRgb(k, 2 * k, 255 - k);
+    parts[k].thumbnail = (k * 7) % 11;
+    parts[k].distance = k * 0.5f;
+    parts[k].red_shift = 1;
+    parts[k].green_shift = 2;
+    parts[k].blue_shift = 3;
+  }
+
+  QByteArray key = MatchMap::computeKey(target, checksum, 0, tileHeight, tileWidth, SearchOptions());
+  QCOMPARE(MatchMap::computeKey(target, checksum, 0, tileHeight, tileWidth, SearchOptions()), key);
+  QVERIFY(MatchMap::computeKey(target, checksum, 1, tileHeight, tileWidth, SearchOptions()) != key);
+  MatchMap map;
+  map.assign(key, checksum, 0, target.size(), tileHeight, tileWidth, parts);
+  QVERIFY(map.save(filename));
+
+  MatchMap loaded;
+  QVERIFY(!loaded.load(filename, MatchMap::computeKey(target, "other database", 0, tileHeight, tileWidth, SearchOptions())));
+  QVERIFY(loaded.load(filename, key));
+  QCOMPARE(loaded.getKey(), key);
+  QCOMPARE(loaded.getPartCount(), static_cast<long>(parts.size()));
+
+  QVector<ImagePart> restored;
+  loaded.restoreParts(restored);
+  QCOMPARE(restored.size(), parts.size());
+  for(int k = 0; k < parts.size(); ++k)
+  {
+    QCOMPARE(restored[k].rect, parts[k].rect);
+    QCOMPARE(restored[k].color, parts[k].color);
+    QCOMPARE(restored[k].thumbnail, parts[k].thumbnail);
+    QCOMPARE(restored[k].distance, parts[k].distance);
+    QCOMPARE(restored[k].red_shift, 0);
+  }
+}
+
+void QtMosaicTests::treeMatchesBruteForce()
+{
+  const long count = 3000;
+  const long queries = 200;
+  const long dimensions[] = {12, 27, 75};
+  const DescriptorStorage storages[] = {FloatStorage, QuantizedStorage};
+
+  for(int d = 0; d < 3; ++d)
+  {
+    long dimension = dimensions[d];
+    std::vector<float> thumbnails = SyntheticData::generateDescriptors(count, dimension, 20, 12, 5);
+    std::vector<float> images = SyntheticData::generateDescriptors(queries, dimension, 20, 30, 6);
+    for(int s = 0; s < 2; ++s)
+    {
+      AntipoleTree tree;
+      tree.setDescriptorStorage(storages[s]);
+      tree.build(thumbnails, dimension);
+      // The exhaustive search runs on the values the tree stores and compares, quantized or not
+      BruteForceIndex bruteForce;
+      bruteForce.build(tree.getThumbnails(), dimension);
+
+      std::vector<std::vector<float> > batch(queries, std::vector<float>(dimension));
+      for(long q = 0; q < queries; ++q)
+      {
+        tree.quantize(&images[q * dimension], &batch[q][0], dimension);
+      }
+      std::vector<SearchResult> treeResults = tree.search(batch, SearchOptions());
+      std::vector<SearchResult> bruteForceResults = bruteForce.search(batch, SearchOptions());
+      QCOMPARE(treeResults.size(), batch.size());
+      QCOMPARE(bruteForceResults.size(), batch.size());
+      for(long q = 0; q < queries; ++q)
+      {
+        // Ties may be broken differently, the distances must agree
+        SearchResult single = tree.search(batch[q], SearchOptions());
+        QVERIFY(closeEnough(single.distance, bruteForceResults[q].distance));
+        QVERIFY(closeEnough(treeResults[q].distance, bruteForceResults[q].distance));
+        QVERIFY(treeResults[q].exact);
+      }
+    }
+  }
+}
+
+void QtMosaicTests::thumbnailsDescribedAsParts()
+{
+  QTemporaryDir directory;
+  QVERIFY(directory.isValid());
+  QString filename = directory.filePath("thumbnails.mosaic");
+
+  // Sizes that the grid does not split evenly
+  QVector<QImage> thumbnails = SyntheticData::generateThumbnails(8, 50, 37, 4, 40, 11);
+  QVERIFY(SyntheticData::saveDatabase(filename, thumbnails));
+  QtMosaicDatabaseModel model(filename);
+  model.build();
+  const AntipoleTree& tree = model.getTree();
+  std::vector<float> descriptors = tree.getThumbnails();
+  long dimension = QtMosaicDatabaseModel::descriptorDimension;
+  QCOMPARE(static_cast<long>(descriptors.size()), thumbnails.size() * dimension);
+
+  // A target made of a single thumbnail is described as the thumbnail is indexed
+  QtMosaicRenderer renderer(&model);
+  renderer.setTileSize(37, 50);
+  for(int i = 0; i < thumbnails.size(); ++i)
+  {
+    QImage target = model.getParallelDatabase()[i].second.convertToFormat(QImage::Format_RGB32);
+    QVector<ImagePart> parts;
+    renderer.cutParts(target.size(), parts);
+    QCOMPARE(parts.size(), 1);
+    renderer.describeRows(target, parts.data(), 1, 1);
+    std::vector<float> descriptor(dimension);
+    tree.quantize(&parts[0].descriptor[0], &descriptor[0], dimension);
+    for(long j = 0; j < dimension; ++j)
+    {
+      QCOMPARE(descriptor[j], descriptors[i * dimension + j]);
+    }
+  }
+}
+
+QTEST_MAIN(QtMosaicTests)
+
+#include "QtMosaicTests.moc"
@@ -0,0 +1,32 @@
+TEMPLATE = app
+TARGET = qtmosaic-tests
+INCLUDEPATH += . .. ../bench
+
+QT += core gui concurrent testlib
+CONFIG += c++11 console testcase
+CONFIG -= app_bundle
+
+HEADERS += ../AntipoleTree.h \
+           ../BruteForceIndex.h \
+           ../ColorConversion.h \
+           ../DistanceKernels.h \
+           ../IvfPqIndex.h \
+           ../MatchMap.h \
+           ../QtMosaicDatabaseModel.h \
+           ../QtMosaicRenderer.h \
+           ../ThumbnailIndex.h \
+           ../TiffStripWriter.h \
+           ../ScanlineReader.h \
+           ../bench/SyntheticData.h
+SOURCES += ../AntipoleTree.cpp \
+           ../BruteForceIndex.cpp \
+           ../ColorConversion.cpp \
+           ../DistanceKernels.cpp \
+           ../IvfPqIndex.cpp \
+           ../MatchMap.cpp \
+           ../QtMosaicDatabaseModel.cpp \
+           ../QtMosaicRenderer.cpp \
+           ../TiffStripWriter.cpp \
+           ../ScanlineReader.cpp \
+           ../bench/SyntheticData.cpp \
+           QtMosaicTests.cpp